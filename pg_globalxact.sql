@@ -2,3 +2,65 @@ CREATE FUNCTION tpc_cleanup(text)
 RETURNS VOID
 LANGUAGE C STRICT
 AS '$libdir/pg_globalxact', 'tpc_cleanup_txnset';
+
+CREATE FUNCTION tpc_cleanup_all()
+RETURNS VOID
+LANGUAGE C
+AS '$libdir/pg_globalxact', 'tpc_cleanup_all';
+
+CREATE FUNCTION tpc_global_transactions(
+    OUT prefix text,
+    OUT phase text,
+    OUT participants int,
+    OUT started timestamptz,
+    OUT pid int)
+RETURNS SETOF record
+LANGUAGE C
+AS '$libdir/pg_globalxact', 'tpc_global_transactions';
+
+CREATE VIEW pg_globalxact_transactions AS
+    SELECT * FROM tpc_global_transactions();
+
+CREATE FUNCTION tpc_txnset_contents(
+    OUT file text,
+    OUT prefix text,
+    OUT phase text,
+    OUT host text,
+    OUT port int,
+    OUT database text,
+    OUT status text)
+RETURNS SETOF record
+LANGUAGE C
+AS '$libdir/pg_globalxact', 'tpc_txnset_contents';
+
+REVOKE ALL ON FUNCTION tpc_txnset_contents() FROM PUBLIC;
+
+CREATE FUNCTION tpc_stats(
+    OUT phase text,
+    OUT remote text,
+    OUT calls bigint,
+    OUT errors bigint,
+    OUT mean_ms float8,
+    OUT p50_ms float8,
+    OUT p99_ms float8,
+    OUT max_ms float8)
+RETURNS SETOF record
+LANGUAGE C
+AS '$libdir/pg_globalxact', 'tpc_stats';
+
+CREATE VIEW pg_globalxact_stats AS
+    SELECT * FROM tpc_stats();
+
+CREATE FUNCTION tpc_stats_reset()
+RETURNS VOID
+LANGUAGE C
+AS '$libdir/pg_globalxact', 'tpc_stats_reset';
+
+REVOKE ALL ON FUNCTION tpc_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION tpc_log_stress(sets int DEFAULT 10000)
+RETURNS int
+LANGUAGE C STRICT
+AS '$libdir/pg_globalxact', 'tpc_log_stress';
+
+REVOKE ALL ON FUNCTION tpc_log_stress(int) FROM PUBLIC;
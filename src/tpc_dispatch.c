@@ -0,0 +1,484 @@
+/*
+ * tpc_dispatch.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file implements asynchronous phase two.  With
+ * pg_globalxact.async_commit on, tpc_commit() makes its decision durable as
+ * usual, queues the set here, and returns without waiting for any remote.
+ * A pool of dispatcher workers takes sets off the queue, sends COMMIT
+ * PREPARED to every participant over connections they keep open between
+ * sets, and completes the set's log.  Sets that cannot be finished are left
+ * for recovery exactly as a backend would leave them.
+ *
+ * A dispatcher takes every set waiting in the queue at once and sends the
+ * commands for each remote down a single libpq pipeline.  Under load a
+ * remote that is part of hundreds of global transactions then gets one
+ * connection and a handful of round trips instead of one of each per
+ * transaction.
+ *
+ * The queue is a fixed ring of entries in shared memory.  When it is full,
+ * or the set will not fit in an entry, the backend simply does phase two
+ * itself.  Sets logged to WAL are never queued, because the backend that
+ * logged them is the one holding off checkpoints until they are finished.
+ *
+ * Nothing here is lost in a crash: every queued set already has a durable
+ * decision, so recovery finishes whatever the dispatchers did not.
+ *
+ * A dispatcher rereads the configuration on SIGHUP, between batches.  A
+ * condition variable sleep is not ended by the latch alone, so an idle
+ * dispatcher looks for a reload every DISPATCH_CHECK_INTERVAL.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_dispatch.h"
+#include "tpc_pipeline.h"
+#include "tpc_shmem.h"
+#include "tpc_registry.h"
+#include "tpc_wait.h"
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <libpq/pqsignal.h>
+#include <postmaster/bgworker.h>
+#include <storage/condition_variable.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/shmem.h>
+#include <tcop/tcopprot.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+
+/* Room for the participants' conninfos, newline separated. */
+#define PARTICIPANTS_MAX 2048
+
+/* Most sets a dispatcher takes off the queue at once. */
+#define DISPATCH_BATCH_MAX 64
+
+/* How often an idle dispatcher checks for a reload, in milliseconds. */
+#define DISPATCH_CHECK_INTERVAL 1000
+
+typedef struct dispatch_entry {
+    char	prefix[NAMEDATALEN];
+    tpc_phase	decision;
+    tpc_log_method log_method;
+    char	logpath[TPC_LOGPATH_MAX];
+    uint64	log_start;	/* for finishing a journal set */
+    int		registry_slot;	/* handed off by the backend */
+    char	participants[PARTICIPANTS_MAX];
+} dispatch_entry;
+
+typedef struct dispatch_shared {
+    uint64	head;		/* next entry to take */
+    uint64	tail;		/* next entry to fill */
+    ConditionVariable work;
+    dispatch_entry entries[FLEXIBLE_ARRAY_MEMBER];
+} dispatch_shared;
+
+/* One set being finished by a dispatcher. */
+typedef struct dispatch_set {
+    tpc_txnset *set;
+    int		registry_slot;
+    char	query[128];
+    bool	ok;		/* every participant answered OK */
+} dispatch_set;
+
+/*
+ * A remote a dispatcher has worked with, along with the commands queued for
+ * it in the current batch.  The connection itself belongs to the
+ * connection cache (tpc_conn_get()).
+ */
+typedef struct cached_conn {
+    char	conninfo[TPC_CONNINFO_MAX];	/* hash key */
+    PGconn     *conn;
+    tpc_pipeline pipeline;
+    bool	queued;		/* has commands in the current batch */
+} cached_conn;
+
+bool	    tpc_async_commit = false;
+int	    tpc_dispatchers = 2;
+int	    tpc_dispatch_queue_size = 256;
+
+static dispatch_shared *shared = NULL;
+static HTAB *connections = NULL;
+static tpc_pipeline *queued = NULL;	/* remotes with commands this batch */
+static volatile sig_atomic_t got_sighup = false;
+
+static void dispatch_sighup(SIGNAL_ARGS);
+static int take_batch(dispatch_entry * entries);
+static cached_conn *get_remote(const char *conninfo);
+static void rebuild_set(dispatch_set * dset, dispatch_entry * entry);
+static void finish_set(dispatch_set * dset);
+static void check_result(PGresult * res, void *arg);
+static void process_batch(dispatch_entry * entries, int n);
+
+/*
+ * void tpc_dispatch_init(void)
+ * Defines our GUCs and, when preloaded, registers the dispatchers.
+ */
+
+void
+tpc_dispatch_init(void)
+{
+    BackgroundWorker bgw;
+
+    DefineCustomBoolVariable("pg_globalxact.async_commit",
+			     "Return from commit before remotes have been told "
+			     "to commit.",
+			     NULL,
+			     &tpc_async_commit,
+			     false,
+			     PGC_USERSET, 0,
+			     NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.dispatchers",
+			    "Number of workers finishing phase two for "
+			    "async_commit.",
+			    NULL,
+			    &tpc_dispatchers,
+			    2, 0, 1024,
+			    PGC_POSTMASTER, 0,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.dispatch_queue_size",
+			    "Number of decided sets that may wait for a "
+			    "dispatcher.",
+			    NULL,
+			    &tpc_dispatch_queue_size,
+			    256, 16, 65536,
+			    PGC_POSTMASTER, 0,
+			    NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+	return;
+
+    memset(&bgw, 0, sizeof(bgw));
+    bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    bgw.bgw_restart_time = 5;
+    snprintf(bgw.bgw_library_name, BGW_MAXLEN, "pg_globalxact");
+    snprintf(bgw.bgw_function_name, BGW_MAXLEN, "tpc_dispatch_main");
+    snprintf(bgw.bgw_type, BGW_MAXLEN, "pg_globalxact dispatcher");
+    for (int i = 0; i < tpc_dispatchers; ++i) {
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "pg_globalxact dispatcher %d", i);
+	bgw.bgw_main_arg = Int32GetDatum(i);
+	RegisterBackgroundWorker(&bgw);
+    }
+}
+
+Size
+tpc_dispatch_shmem_size(void)
+{
+    return add_size(offsetof(dispatch_shared, entries),
+		    mul_size(sizeof(dispatch_entry), tpc_dispatch_queue_size));
+}
+
+void
+tpc_dispatch_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact dispatch queue",
+			     tpc_dispatch_shmem_size(), &found);
+    if (!found) {
+	shared->head = 0;
+	shared->tail = 0;
+	ConditionVariableInit(&shared->work);
+    }
+}
+
+/*
+ * bool tpc_dispatch_enqueue(tpc_txnset *txnset)
+ *
+ * Queues a set whose decision is durable.  Returns false if the set was not
+ * queued, in which case the caller must do phase two itself.
+ */
+
+bool
+tpc_dispatch_enqueue(tpc_txnset * txnset)
+{
+    LWLock     *lock;
+    dispatch_entry *entry;
+    size_t	used = 0;
+
+    if (!shared || 0 == tpc_dispatchers || TPC_LOG_WAL == txnset->log_method)
+	return false;
+
+    entry = palloc0(sizeof(dispatch_entry));
+    strlcpy(entry->prefix, txnset->txn_prefix, sizeof(entry->prefix));
+    strlcpy(entry->logpath, txnset->logpath, sizeof(entry->logpath));
+    entry->decision = txnset->tpc_phase;
+    entry->log_method = txnset->log_method;
+    entry->log_start = txnset->log_start;
+    for (tpc_txn * curr = txnset->head; curr; curr = curr->next) {
+	char	    conninfo[TPC_CONNINFO_MAX];
+	size_t	    len;
+
+	tpc_txnsetfile_conninfo(curr, conninfo, sizeof(conninfo));
+	len = strlen(conninfo);
+	if (used + len + 2 > sizeof(entry->participants)) {
+	    pfree(entry);
+	    return false;
+	}
+	memcpy(entry->participants + used, conninfo, len);
+	used += len;
+	entry->participants[used++] = '\n';
+    }
+
+    lock = tpc_shmem_lock(TPC_DISPATCH_LOCK);
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    if (shared->tail - shared->head >= (uint64) tpc_dispatch_queue_size) {
+	LWLockRelease(lock);
+	pfree(entry);
+	return false;
+    }
+    /* The registry slot goes with the set; a dispatcher may adopt it as
+     * soon as the entry is visible.
+     */
+    entry->registry_slot = txnset->registry_slot;
+    tpc_registry_hand_off(txnset->registry_slot);
+    txnset->registry_slot = -1;
+    memcpy(&shared->entries[shared->tail % tpc_dispatch_queue_size], entry,
+	   sizeof(dispatch_entry));
+    shared->tail++;
+    LWLockRelease(lock);
+
+    ConditionVariableSignal(&shared->work);
+    pfree(entry);
+    return true;
+}
+
+/*
+ * static int take_batch(dispatch_entry *entries)
+ *
+ * Copies up to DISPATCH_BATCH_MAX queued sets into entries, sleeping until
+ * there is at least one.  Returns how many were taken.  A pending reload is
+ * done first.
+ *
+ * Each set's registry slot is adopted as it is taken off the queue, so that
+ * if we exit before finishing the batch our exit hook frees the slots and
+ * recovery can take the sets over, rather than skip them forever.
+ */
+
+static int
+take_batch(dispatch_entry * entries)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_DISPATCH_LOCK);
+    int		n = 0;
+
+    for (;;) {
+	if (got_sighup) {
+	    got_sighup = false;
+	    ProcessConfigFile(PGC_SIGHUP);
+	}
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	while (shared->head != shared->tail && n < DISPATCH_BATCH_MAX) {
+	    memcpy(&entries[n],
+		   &shared->entries[shared->head % tpc_dispatch_queue_size],
+		   sizeof(dispatch_entry));
+	    tpc_registry_adopt(entries[n++].registry_slot);
+	    shared->head++;
+	}
+	LWLockRelease(lock);
+	if (n > 0)
+	    break;
+	(void) ConditionVariableTimedSleep(&shared->work,
+					   DISPATCH_CHECK_INTERVAL,
+					   PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+    return n;
+}
+
+/*
+ * static cached_conn *get_remote(const char *conninfo)
+ *
+ * Returns a remote, queued for the current batch with a healthy connection
+ * from the cache.
+ */
+
+static cached_conn *
+get_remote(const char *conninfo)
+{
+    cached_conn *remote;
+    bool	found;
+
+    remote = hash_search(connections, conninfo, HASH_ENTER, &found);
+    if (!found)
+	remote->queued = false;
+    if (!remote->queued) {
+	remote->conn = tpc_conn_get(conninfo);
+	tpc_pipeline_init(&remote->pipeline, remote->conn);
+	remote->pipeline.next = queued;
+	queued = &remote->pipeline;
+	remote->queued = true;
+    }
+    return remote;
+}
+
+/*
+ * static void rebuild_set(dispatch_set *dset, dispatch_entry *entry)
+ *
+ * Rebuilds the set from the queue entry and queues its phase two command on
+ * each participant's remote.
+ */
+
+static void
+rebuild_set(dispatch_set * dset, dispatch_entry * entry)
+{
+    tpc_txnset *set = palloc0(sizeof(tpc_txnset));
+    char       *conninfo;
+    char       *saveptr;
+
+    strlcpy(set->txn_prefix, entry->prefix, sizeof(set->txn_prefix));
+    strlcpy(set->logpath, entry->logpath, sizeof(set->logpath));
+    set->log_method = entry->log_method;
+    set->log_start = entry->log_start;
+    set->log = -1;
+    set->tpc_phase = entry->decision;
+    set->registry_slot = -1;
+    dset->set = set;
+    dset->registry_slot = entry->registry_slot;
+    dset->ok = true;
+    tpc_txnsetfile_phase_two_query(entry->decision, entry->prefix,
+				   dset->query, sizeof(dset->query));
+
+    for (conninfo = strtok_r(entry->participants, "\n", &saveptr); conninfo;
+	 conninfo = strtok_r(NULL, "\n", &saveptr)) {
+	tpc_txn    *txn = palloc0(sizeof(tpc_txn));
+	cached_conn *remote = get_remote(conninfo);
+
+	txn->conninfo = pstrdup(conninfo);
+	txn->conn = remote->conn;
+	if (set->head)
+	    set->latest->next = txn;
+	else
+	    set->head = txn;
+	set->latest = txn;
+
+	tpc_pipeline_add(&remote->pipeline, dset->query, 0, NULL,
+			 check_result, dset);
+    }
+    tpc_txnsetfile_reopen(set);
+}
+
+/*
+ * static void finish_set(dispatch_set *dset)
+ * Completes the set's log, or leaves it for recovery.
+ */
+
+static void
+finish_set(dispatch_set * dset)
+{
+    tpc_txnset *set = dset->set;
+
+    if (dset->ok) {
+	set->tpc_phase = COMPLETE;
+	tpc_txnsetfile_complete(set);
+    } else {
+	ereport(WARNING, (errmsg("could not finish global transaction %s, "
+				 "leaving it for recovery", set->txn_prefix)));
+	tpc_txnsetfile_incomplete(set);
+    }
+    tpc_registry_leave(dset->registry_slot);
+}
+
+static void
+check_result(PGresult * res, void *arg)
+{
+    dispatch_set *dset = (dispatch_set *) arg;
+
+    if (!res || PQresultStatus(res) != PGRES_COMMAND_OK)
+	dset->ok = false;
+}
+
+/*
+ * static void process_batch(dispatch_entry *entries, int n)
+ *
+ * Runs phase two for a batch of sets.  Commands for the same remote,
+ * whichever set they belong to, share one connection and, where libpq
+ * supports it, one pipeline, so a remote taking part in many sets sees one
+ * round trip for all of them rather than one per set.
+ */
+
+static void
+process_batch(dispatch_entry * entries, int n)
+{
+    dispatch_set *sets = palloc0(sizeof(dispatch_set) * n);
+    tpc_pipeline *pipeline;
+
+    queued = NULL;
+    for (int i = 0; i < n; ++i)
+	rebuild_set(&sets[i], &entries[i]);
+
+    tpc_pipeline_run(queued, tpc_wait_event(TPC_WAIT_REMOTE_COMMIT));
+
+    for (int i = 0; i < n; ++i)
+	finish_set(&sets[i]);
+
+    /* Connections in an unknown state are closed and opened afresh. */
+    pipeline = queued;
+    while (pipeline) {
+	tpc_pipeline *next = pipeline->next;
+	cached_conn *remote = (cached_conn *)
+	    ((char *) pipeline - offsetof(cached_conn, pipeline));
+
+	remote->queued = false;
+	if (pipeline->broken) {
+	    tpc_conn_drop(remote->conninfo);
+	    hash_search(connections, remote->conninfo, HASH_REMOVE, NULL);
+	}
+	pipeline = next;
+    }
+    queued = NULL;
+}
+
+static void
+dispatch_sighup(SIGNAL_ARGS)
+{
+    int		save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+/*
+ * void tpc_dispatch_main(Datum main_arg)
+ * Main loop of a dispatcher.
+ */
+
+void
+tpc_dispatch_main(Datum main_arg)
+{
+    MemoryContext work_context;
+    HASHCTL	ctl;
+    dispatch_entry *entries;
+
+    pqsignal(SIGHUP, dispatch_sighup);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = TPC_CONNINFO_MAX;
+    ctl.entrysize = sizeof(cached_conn);
+#if PG_VERSION_NUM >= 140000
+    connections = hash_create("pg_globalxact dispatcher connections", 16,
+			      &ctl, HASH_ELEM | HASH_STRINGS);
+#else
+    connections = hash_create("pg_globalxact dispatcher connections", 16,
+			      &ctl, HASH_ELEM);
+#endif
+    work_context = AllocSetContextCreate(TopMemoryContext,
+					 "pg_globalxact dispatch",
+					 ALLOCSET_DEFAULT_SIZES);
+
+    entries = palloc(sizeof(dispatch_entry) * DISPATCH_BATCH_MAX);
+
+    for (;;) {
+	int	    n = take_batch(entries);
+
+	MemoryContextSwitchTo(work_context);
+	process_batch(entries, n);
+	MemoryContextSwitchTo(TopMemoryContext);
+	MemoryContextReset(work_context);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef TPC_DISPATCH_H
+
+#define TPC_DISPATCH_H
+#include "tpc_txnset.h"
+
+/*
+ * Asynchronous phase two.  Once a set's decision is durable, a backend may
+ * queue it here and return to the client.  A pool of dispatcher workers
+ * sends the COMMIT or ROLLBACK PREPARED commands and completes the log.
+ */
+
+extern bool tpc_async_commit;
+extern int  tpc_dispatchers;
+extern int  tpc_dispatch_queue_size;
+
+extern void tpc_dispatch_init(void);
+extern Size tpc_dispatch_shmem_size(void);
+extern void tpc_dispatch_shmem_startup(void);
+extern bool tpc_dispatch_enqueue(tpc_txnset * txnset);
+extern PGDLLEXPORT void tpc_dispatch_main(Datum main_arg);
+
+#endif
@@ -0,0 +1,629 @@
+/*
+ * tpc_launcher.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file runs recovery with a bounded number of processes.  Earlier
+ * versions started a background worker per set file, so a backlog of
+ * thousands of files ran out of worker slots long before it ran out of
+ * files, and everything past the limit needed manual cleanup.
+ *
+ * Now tpc_cleanup() and tpc_cleanup_all() just put work in a queue in
+ * shared memory and wake the launcher, a background worker started with the
+ * server.  The launcher scans TPC_LOGDIR if asked to, feeding file names
+ * into the queue as there is room, and starts
+ * pg_globalxact.recovery_workers workers to drain it.  Each worker takes
+ * files off the queue in batches and recovers each batch together (see
+ * tpc_recovery.c).  When the queue is empty and nothing more is coming the
+ * workers exit, and the launcher goes back to sleep.
+ *
+ * A scan does not list the shards of TPC_LOGDIR itself.  It queues the
+ * shard directories, marked by a trailing slash, and a worker that takes
+ * one lists it and recovers its files, so the workers read the shards in
+ * parallel.  A worker takes a shard on its own, never in a batch.
+ *
+ * If no worker can be started at all the launcher does the work itself.
+ *
+ * A batch is given up on after pg_globalxact.recovery_round_timeout, so
+ * that a dead remote cannot keep a round from ending.  If any sets were
+ * left in doubt the launcher scans again once another timeout has passed.
+ *
+ * At startup the launcher also recovers whatever sets were left by the
+ * previous run, without anyone having to call tpc_cleanup_all().  It scans
+ * the directory once the log writer has written out the unfinished sets in
+ * the journal; sets in WAL have already been written out by redo.  Sets
+ * that backends have started since look just the same on disk, but they
+ * are in the registry (see tpc_registry.c) and recovery passes them over.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_launcher.h"
+#include "tpc_recovery.h"
+#include "tpc_logwriter.h"
+#include "tpc_shmem.h"
+#include <unistd.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <libpq/pqsignal.h>
+#include <postmaster/bgworker.h>
+#include <storage/condition_variable.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/shmem.h>
+#include <tcop/tcopprot.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+
+#define RECOVERY_QUEUE_SIZE 1024
+#define RECOVERY_BATCH_MAX 128
+#define RECOVERY_WORKERS_MAX 64
+
+typedef struct launcher_shared {
+    uint64	head;		/* next file to take */
+    uint64	tail;		/* next slot to fill */
+    bool	scan_requested;	/* launcher should scan TPC_LOGDIR */
+    bool	filling;	/* launcher is still adding files */
+    bool	startup_pending;	/* leftover sets not listed yet */
+    bool	unresolved;	/* a batch left sets in doubt this round */
+    Latch      *launcher_latch;
+    Latch      *worker_latches[RECOVERY_WORKERS_MAX];
+    ConditionVariable cv;	/* the queue changed */
+    char	paths[RECOVERY_QUEUE_SIZE][TPC_LOGPATH_MAX];
+} launcher_shared;
+
+int	    tpc_recovery_workers = 2;
+int	    tpc_recovery_connect_timeout = 10000;
+int	    tpc_recovery_round_timeout = 300000;
+bool	    tpc_startup_recovery = true;
+
+static launcher_shared *shared = NULL;
+static volatile sig_atomic_t got_sighup = false;
+
+static void launcher_sighup(SIGNAL_ARGS);
+static void launcher_exit(int code, Datum arg);
+static void worker_exit(int code, Datum arg);
+static int	start_workers(BackgroundWorkerHandle **handles);
+static void set_filling(bool filling);
+static void enqueue_path(const char *path);
+static int	take_paths(char **paths);
+static bool is_shard_path(const char *path);
+static void recover_paths(char **paths, int n);
+static void run_queue(void);
+static void run_round(char **paths, int n, bool scan);
+static void startup_recovery(void);
+
+/*
+ * void tpc_launcher_init(void)
+ *
+ * Defines our GUCs, and when we are preloaded registers the launcher.
+ */
+
+void
+tpc_launcher_init(void)
+{
+    BackgroundWorker bgw;
+
+    DefineCustomIntVariable("pg_globalxact.recovery_workers",
+			    "Number of workers recovering transaction sets.",
+			    NULL,
+			    &tpc_recovery_workers,
+			    2, 1, RECOVERY_WORKERS_MAX,
+			    PGC_SIGHUP, 0,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.recovery_connect_timeout",
+			    "Time recovery waits for remotes to accept a "
+			    "connection.",
+			    NULL,
+			    &tpc_recovery_connect_timeout,
+			    10000, 100, INT_MAX,
+			    PGC_SIGHUP, GUC_UNIT_MS,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.recovery_round_timeout",
+			    "Time a round of recovery keeps retrying remotes "
+			    "before leaving the rest for a later round.",
+			    NULL,
+			    &tpc_recovery_round_timeout,
+			    300000, 1000, INT_MAX,
+			    PGC_SIGHUP, GUC_UNIT_MS,
+			    NULL, NULL, NULL);
+    DefineCustomBoolVariable("pg_globalxact.startup_recovery",
+			     "Recover transaction sets left over from before "
+			     "startup.",
+			     NULL,
+			     &tpc_startup_recovery,
+			     true,
+			     PGC_POSTMASTER, 0,
+			     NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+	return;
+
+    memset(&bgw, 0, sizeof(bgw));
+    bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    bgw.bgw_restart_time = 5;
+    snprintf(bgw.bgw_library_name, BGW_MAXLEN, "pg_globalxact");
+    snprintf(bgw.bgw_function_name, BGW_MAXLEN, "tpc_launcher_main");
+    snprintf(bgw.bgw_name, BGW_MAXLEN, "pg_globalxact recovery launcher");
+    snprintf(bgw.bgw_type, BGW_MAXLEN, "pg_globalxact recovery launcher");
+    RegisterBackgroundWorker(&bgw);
+}
+
+Size
+tpc_launcher_shmem_size(void)
+{
+    return sizeof(launcher_shared);
+}
+
+void
+tpc_launcher_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact recovery queue",
+			     tpc_launcher_shmem_size(), &found);
+    if (!found) {
+	shared->head = 0;
+	shared->tail = 0;
+	shared->scan_requested = false;
+	shared->filling = false;
+	shared->startup_pending = tpc_startup_recovery;
+	shared->unresolved = false;
+	shared->launcher_latch = NULL;
+	memset(shared->worker_latches, 0, sizeof(shared->worker_latches));
+	ConditionVariableInit(&shared->cv);
+    }
+}
+
+/*
+ * void tpc_launcher_request(const char *path)
+ *
+ * Queues path for recovery, or with a NULL path asks for every set in
+ * TPC_LOGDIR, and wakes the launcher.  If the launcher is between restarts
+ * the request waits in the queue for it.
+ *
+ * Running workers are woken too, which makes them retry their remotes at
+ * once rather than wait out their backoff; a request is often made because
+ * a remote has just been fixed.
+ */
+
+void
+tpc_launcher_request(const char *path)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+    Latch      *latches[RECOVERY_WORKERS_MAX + 1];
+    int		nlatches = 0;
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    if (path) {
+	if (shared->tail - shared->head >= RECOVERY_QUEUE_SIZE) {
+	    LWLockRelease(lock);
+	    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+		    errmsg("recovery queue is full"),
+		    errhint("Use tpc_cleanup_all() to recover every set.")));
+	}
+	strlcpy(shared->paths[shared->tail % RECOVERY_QUEUE_SIZE], path,
+		TPC_LOGPATH_MAX);
+	shared->tail++;
+    } else {
+	shared->scan_requested = true;
+    }
+    if (shared->launcher_latch)
+	latches[nlatches++] = shared->launcher_latch;
+    for (int i = 0; i < RECOVERY_WORKERS_MAX; ++i) {
+	if (shared->worker_latches[i])
+	    latches[nlatches++] = shared->worker_latches[i];
+    }
+    LWLockRelease(lock);
+
+    ConditionVariableBroadcast(&shared->cv);
+    for (int i = 0; i < nlatches; ++i)
+	SetLatch(latches[i]);
+}
+
+static void
+launcher_sighup(SIGNAL_ARGS)
+{
+    int		save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+/*
+ * static void launcher_exit(int code, Datum arg)
+ * Stops requests from waking us, and lets waiting workers go.
+ */
+
+static void
+launcher_exit(int code, Datum arg)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->launcher_latch = NULL;
+    shared->filling = false;
+    LWLockRelease(lock);
+    ConditionVariableBroadcast(&shared->cv);
+}
+
+static void
+worker_exit(int code, Datum arg)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->worker_latches[DatumGetInt32(arg)] = NULL;
+    LWLockRelease(lock);
+}
+
+/*
+ * static int start_workers(BackgroundWorkerHandle **handles)
+ * Starts the pool.  Returns how many workers could be started.
+ */
+
+static int
+start_workers(BackgroundWorkerHandle **handles)
+{
+    BackgroundWorker bgw;
+    int		n = 0;
+
+    memset(&bgw, 0, sizeof(bgw));
+    bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    bgw.bgw_restart_time = BGW_NEVER_RESTART;
+    bgw.bgw_notify_pid = MyProcPid;
+    snprintf(bgw.bgw_library_name, BGW_MAXLEN, "pg_globalxact");
+    snprintf(bgw.bgw_function_name, BGW_MAXLEN, "tpc_recovery_worker_main");
+    snprintf(bgw.bgw_type, BGW_MAXLEN, "pg_globalxact recovery worker");
+    for (int i = 0; i < tpc_recovery_workers; ++i) {
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "pg_globalxact recovery worker %d",
+		 i);
+	bgw.bgw_main_arg = Int32GetDatum(i);
+	if (!RegisterDynamicBackgroundWorker(&bgw, &handles[n]))
+	    break;
+	++n;
+    }
+    if (n < tpc_recovery_workers)
+	ereport(LOG, (errmsg("started %d of %d recovery workers",
+			     n, tpc_recovery_workers)));
+    return n;
+}
+
+static void
+set_filling(bool filling)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->filling = filling;
+    LWLockRelease(lock);
+    ConditionVariableBroadcast(&shared->cv);
+}
+
+/*
+ * static void enqueue_path(const char *path)
+ * Adds a file to the queue, waiting for room if need be.
+ */
+
+static void
+enqueue_path(const char *path)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    for (;;) {
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	if (shared->tail - shared->head < RECOVERY_QUEUE_SIZE) {
+	    strlcpy(shared->paths[shared->tail % RECOVERY_QUEUE_SIZE], path,
+		    TPC_LOGPATH_MAX);
+	    shared->tail++;
+	    LWLockRelease(lock);
+	    break;
+	}
+	LWLockRelease(lock);
+	ConditionVariableSleep(&shared->cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+    ConditionVariableBroadcast(&shared->cv);
+}
+
+static bool
+is_shard_path(const char *path)
+{
+    size_t	len = strlen(path);
+
+    return len > 0 && '/' == path[len - 1];
+}
+
+/*
+ * static int take_paths(char **paths)
+ *
+ * Takes up to RECOVERY_BATCH_MAX files off the queue, or a single shard
+ * directory, waiting while it is empty but the launcher is still filling
+ * it.  Returns 0 when there is no more work.
+ */
+
+static int
+take_paths(char **paths)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+    int		n = 0;
+
+    for (;;) {
+	bool	    filling;
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	while (shared->head != shared->tail && n < RECOVERY_BATCH_MAX) {
+	    char       *path = shared->paths[shared->head % RECOVERY_QUEUE_SIZE];
+	    bool	shard = is_shard_path(path);
+
+	    if (shard && n > 0)
+		break;
+	    paths[n++] = pstrdup(path);
+	    shared->head++;
+	    if (shard)
+		break;
+	}
+	filling = shared->filling;
+	LWLockRelease(lock);
+	if (n > 0 || !filling)
+	    break;
+	ConditionVariableSleep(&shared->cv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+    if (n > 0)
+	ConditionVariableBroadcast(&shared->cv);
+    return n;
+}
+
+/*
+ * static void recover_paths(char **paths, int n)
+ *
+ * Recovers what was taken off the queue.  A shard directory is listed here
+ * and its files recovered a batch at a time.  Sets left in doubt are noted
+ * so the launcher comes back for them.
+ */
+
+static void
+recover_paths(char **paths, int n)
+{
+    char	dirpath[MAXPGPATH];
+    char      **listed;
+    int		nlisted;
+    int		unresolved = 0;
+
+    if (!(1 == n && is_shard_path(paths[0]))) {
+	unresolved = tpc_recover_files(paths, n);
+    } else {
+	strlcpy(dirpath, paths[0], sizeof(dirpath));
+	dirpath[strlen(dirpath) - 1] = '\0';
+	nlisted = tpc_recovery_list_shard(dirpath, &listed);
+	for (int i = 0; i < nlisted; i += RECOVERY_BATCH_MAX)
+	    unresolved += tpc_recover_files(listed + i,
+					    Min(RECOVERY_BATCH_MAX, nlisted - i));
+    }
+    if (unresolved > 0) {
+	LWLock	   *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	shared->unresolved = true;
+	LWLockRelease(lock);
+    }
+}
+
+/*
+ * static void run_queue(void)
+ * Recovers batches off the queue until there is no more work.
+ */
+
+static void
+run_queue(void)
+{
+    MemoryContext work_context;
+    MemoryContext old_context;
+    char       *paths[RECOVERY_BATCH_MAX];
+
+    work_context = AllocSetContextCreate(TopMemoryContext,
+					 "pg_globalxact recovery",
+					 ALLOCSET_DEFAULT_SIZES);
+    for (;;) {
+	int	    n;
+
+	old_context = MemoryContextSwitchTo(work_context);
+	n = take_paths(paths);
+	if (n > 0)
+	    recover_paths(paths, n);
+	MemoryContextSwitchTo(old_context);
+	MemoryContextReset(work_context);
+	if (0 == n)
+	    break;
+    }
+    MemoryContextDelete(work_context);
+}
+
+/*
+ * static void run_round(char **paths, int n, bool scan)
+ *
+ * Starts the pool, queues the given files and with scan the shards of
+ * TPC_LOGDIR, and waits for the pool to drain the queue.  Without a pool
+ * we drain the queue and recover the files ourselves, a batch at a time.
+ */
+
+static void
+run_round(char **paths, int n, bool scan)
+{
+    BackgroundWorkerHandle *handles[RECOVERY_WORKERS_MAX];
+    int		nworkers;
+
+    if (scan) {
+	char	  **listed;
+	int	    nlisted = tpc_recovery_list_shards(&listed);
+
+	paths = paths ? repalloc(paths, sizeof(char *) * (n + nlisted + 1))
+	    : palloc(sizeof(char *) * (nlisted + 1));
+	for (int i = 0; i < nlisted; ++i)
+	    paths[n++] = listed[i];
+    }
+
+    set_filling(true);
+    nworkers = start_workers(handles);
+    if (0 == nworkers) {
+	set_filling(false);
+	run_queue();
+	for (int i = 0; i < n;) {
+	    int		batch = 1;
+
+	    if (!is_shard_path(paths[i]))
+		while (i + batch < n && batch < RECOVERY_BATCH_MAX
+		       && !is_shard_path(paths[i + batch]))
+		    ++batch;
+	    recover_paths(paths + i, batch);
+	    i += batch;
+	}
+	return;
+    }
+    for (int i = 0; i < n; ++i)
+	enqueue_path(paths[i]);
+    set_filling(false);
+    for (int i = 0; i < nworkers; ++i)
+	WaitForBackgroundWorkerShutdown(handles[i]);
+}
+
+/*
+ * static void startup_recovery(void)
+ *
+ * Recovers the sets left over from before startup.
+ */
+
+static void
+startup_recovery(void)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+    char      **paths;
+    int		n;
+
+    while (!tpc_logwriter_recovered()) {
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			 100L, PG_WAIT_EXTENSION);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+    }
+
+    n = tpc_recovery_list_shards(&paths);
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->startup_pending = false;
+    LWLockRelease(lock);
+
+    if (n > 0)
+	run_round(paths, n, false);
+}
+
+/*
+ * void tpc_launcher_main(Datum main_arg)
+ *
+ * Main loop of the launcher.  Each round starts the pool, feeds it, and
+ * waits for it to finish.  Requests that arrive in the meantime are picked
+ * up by the next round.
+ */
+
+void
+tpc_launcher_main(Datum main_arg)
+{
+    MemoryContext round_context;
+    MemoryContext old_context;
+    LWLock     *lock;
+    bool	startup;
+    TimestampTz retry_at = 0;
+
+    pqsignal(SIGHUP, launcher_sighup);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+    lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->launcher_latch = MyLatch;
+    startup = shared->startup_pending;
+    LWLockRelease(lock);
+    before_shmem_exit(launcher_exit, 0);
+
+    round_context = AllocSetContextCreate(TopMemoryContext,
+					  "pg_globalxact launcher round",
+					  ALLOCSET_DEFAULT_SIZES);
+    if (startup) {
+	old_context = MemoryContextSwitchTo(round_context);
+	startup_recovery();
+	MemoryContextSwitchTo(old_context);
+	MemoryContextReset(round_context);
+    }
+
+    for (;;) {
+	bool	    scan;
+	bool	    queued;
+	bool	    unresolved;
+	long	    timeout = -1L;
+
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+	if (got_sighup) {
+	    got_sighup = false;
+	    ProcessConfigFile(PGC_SIGHUP);
+	}
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	scan = shared->scan_requested;
+	shared->scan_requested = false;
+	queued = (shared->head != shared->tail);
+	unresolved = shared->unresolved;
+	shared->unresolved = false;
+	LWLockRelease(lock);
+
+	/* Come back later for whatever the last round left in doubt. */
+	if (unresolved)
+	    retry_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+						   tpc_recovery_round_timeout);
+	if (retry_at != 0 && GetCurrentTimestamp() >= retry_at) {
+	    retry_at = 0;
+	    scan = true;
+	}
+
+	if (scan || queued) {
+	    old_context = MemoryContextSwitchTo(round_context);
+	    run_round(NULL, 0, scan);
+	    MemoryContextSwitchTo(old_context);
+	    MemoryContextReset(round_context);
+	    continue;
+	}
+	if (retry_at != 0) {
+	    long	secs;
+	    int		usecs;
+
+	    TimestampDifference(GetCurrentTimestamp(), retry_at, &secs, &usecs);
+	    timeout = secs * 1000L + usecs / 1000 + 1;
+	}
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			 timeout, PG_WAIT_EXTENSION);
+    }
+}
+
+/*
+ * void tpc_recovery_worker_main(Datum main_arg)
+ * Main loop of a recovery worker.
+ */
+
+void
+tpc_recovery_worker_main(Datum main_arg)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_RECOVERY_LOCK);
+
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->worker_latches[DatumGetInt32(main_arg)] = MyLatch;
+    LWLockRelease(lock);
+    before_shmem_exit(worker_exit, main_arg);
+
+    run_queue();
+}
@@ -0,0 +1,25 @@
+#ifndef TPC_LAUNCHER_H
+
+#define TPC_LAUNCHER_H
+#include "tpc_txnset.h"
+
+/*
+ * The recovery launcher.  Set files to recover go through a queue in shared
+ * memory to a fixed-size pool of recovery workers, so any number of files
+ * can be recovered with a handful of worker slots.  At startup the launcher
+ * recovers the sets left over from the previous run.
+ */
+
+extern int  tpc_recovery_workers;
+extern int  tpc_recovery_connect_timeout;
+extern int  tpc_recovery_round_timeout;
+extern bool tpc_startup_recovery;
+
+extern void tpc_launcher_init(void);
+extern Size tpc_launcher_shmem_size(void);
+extern void tpc_launcher_shmem_startup(void);
+extern void tpc_launcher_request(const char *path);
+extern PGDLLEXPORT void tpc_launcher_main(Datum main_arg);
+extern PGDLLEXPORT void tpc_recovery_worker_main(Datum main_arg);
+
+#endif
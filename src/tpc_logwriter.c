@@ -0,0 +1,1423 @@
+/*
+ * tpc_logwriter.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file implements the journal, a group-committed alternative to
+ * keeping one file per transaction set.  It is modelled loosely on the WAL
+ * writer:  backends copy their records into a ring buffer in shared memory,
+ * and if they need them durable they wake the log writer and sleep on a
+ * condition variable.  The log writer writes everything in the buffer,
+ * syncs once, and wakes everyone whose records made it out.  Under load a
+ * single fdatasync therefore covers the commits of many backends.
+ *
+ * Each journal record is the record the file method would have written,
+ * carrying the txn_prefix of its transaction set (see tpc_record.h).  A
+ * set is finished once its COMPLETE phase record has been written.
+ *
+ * On disk the journal is a series of fixed-size segment files, which the
+ * log writer fills with zeroes ahead of time and then overwrites in place,
+ * so appending never creates, extends or removes a file.  A set counts as
+ * open in the segment holding its first record until it finishes.  Once a
+ * segment has been written out and no set is open in it or in any older
+ * segment, the log writer recycles it as WAL does:  the file is renamed to
+ * become a future segment, while fewer than pg_globalxact.journal_segments
+ * are ready, and removed otherwise.  A recycled segment still holds its old
+ * records until they are overwritten.  Every record is stamped with the
+ * segment it was written to, which is how replay tells the two apart.  A
+ * record never straddles two segments; the rest of a segment too short for
+ * the next record is left as zeroes.
+ *
+ * With pg_globalxact.io_engine = io_uring the log writer does not wait for
+ * each sync before writing what came in meanwhile; see tpc_uring.c.
+ *
+ * Whatever the log method, the log writer also removes the files of
+ * finished sets when it has nothing to write; see tpc_reaper.c.
+ *
+ * After a crash the log writer reads what is left of the journal and writes
+ * out every unfinished set as an ordinary transaction set file, so recovery
+ * only ever has to deal with one kind of input.  Backends that leave a set
+ * incomplete do the same for their own set, and the log writer does it for
+ * sets whose process went away without finishing them.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_logwriter.h"
+#include "tpc_shmem.h"
+#include "tpc_wait.h"
+#include "tpc_record.h"
+#include "tpc_uring.h"
+#include "tpc_reaper.h"
+#include "tpc_registry.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <libpq/pqsignal.h>
+#include <postmaster/bgworker.h>
+#include <storage/condition_variable.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/shmem.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+
+static const char journalpath[] = TPC_LOGDIR "/" TPC_JOURNAL_NAME;
+
+/* Segments whose open sets are counted one by one; see count_open(). */
+#define TRACKED_SEGMENTS 64
+
+/* Segments kept before the log writer looks for abandoned sets; see
+ * retire_abandoned().
+ */
+#define RETIRE_SEGMENTS 16
+
+/* How long a backend waiting on the log writer sleeps between checks that
+ * it is still there, and how long it may be gone before the backend gives
+ * up, in milliseconds.  A log writer that exits is restarted after a
+ * second.
+ */
+#define WRITER_CHECK_INTERVAL 1000
+#define WRITER_GONE_TIMEOUT 5000
+
+/* Segment file names are 16 hex digits, as for WAL. */
+#define SEGMENT_NAME_LEN 16
+
+/* Longest line of a journal in the old text format: a set file line plus
+ * its prefix.
+ */
+#define JOURNALLINE_MAX (512 + NAMEDATALEN)
+
+typedef struct logwriter_shared {
+    uint64	insert_pos;	/* end of the last record copied in */
+    uint64	flush_pos;	/* everything before this is durable */
+    uint64	tracked_from;	/* oldest segment with a count of its own */
+    int		old_sets;	/* open sets started before tracked_from */
+    int		open_sets[TRACKED_SEGMENTS];	/* by segment number */
+    uint64	oldest_segno;	/* oldest segment not yet recycled */
+    uint64	last_segno;	/* newest segment file, ready ones included */
+    bool	recovered;	/* leftover journal has been replayed */
+    Latch      *writer_latch;
+    ConditionVariable flushed;
+    char	buffer[FLEXIBLE_ARRAY_MEMBER];
+} logwriter_shared;
+
+/* Unfinished sets found while replaying the journal. */
+typedef struct journal_set {
+    char	prefix[NAMEDATALEN];	/* hash key */
+    StringInfoData lines;
+    bool	participants;	/* its participants were found */
+    bool	complete;
+    bool	alive;		/* in the registry; see retire_abandoned() */
+    int		segment;	/* stamp of its first record, or -1 */
+} journal_set;
+
+int	    tpc_log_buffers = 64;
+int	    tpc_log_writer_delay = 200;
+int	    tpc_journal_segment_size = 16384;
+int	    tpc_journal_segments = 4;
+
+static logwriter_shared *shared = NULL;
+static volatile sig_atomic_t got_sighup = false;
+static volatile sig_atomic_t shutdown_requested = false;
+
+/* The log writer's open segment. */
+static int  segment_fd = -1;
+static uint64 segment_open = 0;
+
+/* With io_uring, the end of what the log writer has submitted so far. */
+static bool use_uring = false;
+static uint64 submit_pos = 0;
+
+/* Segment from which the log writer next looks for abandoned sets. */
+static uint64 retire_next = 0;
+
+static Size buffer_size(void);
+static uint64 segment_bytes(void);
+static void segment_path(char *path, uint64 segno);
+static bool parse_segment_name(const char *name, uint64 *segno);
+static int  segno_cmp(const void *a, const void *b);
+static int  list_segments(uint64 **segnos);
+static void copy_in(const char *data, Size len);
+static void count_open(uint64 segno);
+static void count_finished(uint64 segno);
+static uint64 recycle_limit(void);
+static void wait_for_writer(Latch *latch, TimestampTz *gone_since,
+			    uint32 wait_event_info);
+static void logwriter_detach(int code, Datum arg);
+static void logwriter_sighup(SIGNAL_ARGS);
+static void logwriter_sigterm(SIGNAL_ARGS);
+static void replay_journal(void);
+static bool replay_file(const char *path, HTAB *sets, int segment);
+static HTAB *journal_sets(void);
+static journal_set *journal_entry(HTAB *sets, const char *prefix);
+static void replay_text(FILE *journal, HTAB *sets);
+static bool replay_records(tpc_record_stream * stream, HTAB *sets,
+			   int segment, const char *path);
+static void materialize_set(journal_set * set);
+static bool append_complete(const char *prefix, uint64 segno);
+static bool retire_abandoned(void);
+static void create_segment(uint64 segno);
+static void open_segment(uint64 segno);
+static void sync_segment(void);
+static void recycle_segment(uint64 segno);
+static void recycle_segments(void);
+static bool preallocate_segment(void);
+static void write_range(uint64 start, uint64 end);
+static void advance_flush(uint64 end);
+static void submit_range(uint64 start, uint64 end);
+static bool uring_pass(uint64 end);
+
+static Size
+buffer_size(void)
+{
+    return (Size) tpc_log_buffers * 1024;
+}
+
+static uint64
+segment_bytes(void)
+{
+    return (uint64) tpc_journal_segment_size * 1024;
+}
+
+static void
+segment_path(char *path, uint64 segno)
+{
+    snprintf(path, MAXPGPATH, "%s/%08X%08X", journalpath,
+	     (uint32) (segno >> 32), (uint32) segno);
+}
+
+static bool
+parse_segment_name(const char *name, uint64 *segno)
+{
+    unsigned int hi;
+    unsigned int lo;
+
+    if (strlen(name) != SEGMENT_NAME_LEN
+	|| strspn(name, "0123456789ABCDEF") != SEGMENT_NAME_LEN
+	|| sscanf(name, "%08X%08X", &hi, &lo) != 2)
+	return false;
+    *segno = ((uint64) hi << 32) | lo;
+    return true;
+}
+
+static int
+segno_cmp(const void *a, const void *b)
+{
+    uint64	x = *(const uint64 *) a;
+    uint64	y = *(const uint64 *) b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * static int list_segments(uint64 **segnos)
+ *
+ * Returns the numbers of the journal's segment files, palloc'd and in
+ * order, and how many there are.
+ */
+
+static int
+list_segments(uint64 **segnos)
+{
+    DIR	       *dir;
+    struct dirent *de;
+    int		n = 0;
+    int		max = 16;
+
+    *segnos = palloc(max * sizeof(uint64));
+    dir = AllocateDir(journalpath);
+    if (!dir) {
+	if (errno == ENOENT || errno == ENOTDIR)
+	    return 0;
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not open directory \"%s\": %m", journalpath)));
+    }
+    while ((de = ReadDir(dir, journalpath)) != NULL) {
+	uint64	    segno;
+
+	if (!parse_segment_name(de->d_name, &segno))
+	    continue;
+	if (n == max) {
+	    max *= 2;
+	    *segnos = repalloc(*segnos, max * sizeof(uint64));
+	}
+	(*segnos)[n++] = segno;
+    }
+    FreeDir(dir);
+    qsort(*segnos, n, sizeof(uint64), segno_cmp);
+    return n;
+}
+
+/*
+ * void tpc_logwriter_init(void)
+ *
+ * Defines our GUCs and, when preloaded, registers the log writer.  The
+ * writer runs whatever log_method is set to, since that can change on
+ * reload and it costs nothing while idle.
+ */
+
+void
+tpc_logwriter_init(void)
+{
+    BackgroundWorker bgw;
+
+    DefineCustomIntVariable("pg_globalxact.log_buffers",
+			    "Size of the shared journal buffer.",
+			    NULL,
+			    &tpc_log_buffers,
+			    64, 16, INT_MAX / 1024,
+			    PGC_POSTMASTER, GUC_UNIT_KB,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.log_writer_delay",
+			    "Time between journal flushes when nobody is waiting.",
+			    NULL,
+			    &tpc_log_writer_delay,
+			    200, 1, 10000,
+			    PGC_SIGHUP, GUC_UNIT_MS,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.journal_segment_size",
+			    "Size of each journal segment file.",
+			    NULL,
+			    &tpc_journal_segment_size,
+			    16384, 64, 1024 * 1024,
+			    PGC_POSTMASTER, GUC_UNIT_KB,
+			    NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_globalxact.journal_segments",
+			    "Number of journal segments kept ready beyond the "
+			    "one being written.",
+			    NULL,
+			    &tpc_journal_segments,
+			    4, 0, 1000,
+			    PGC_SIGHUP, 0,
+			    NULL, NULL, NULL);
+
+    if (!process_shared_preload_libraries_in_progress)
+	return;
+
+    memset(&bgw, 0, sizeof(bgw));
+    bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    bgw.bgw_start_time = BgWorkerStart_PostmasterStart;
+    bgw.bgw_restart_time = 1;
+    snprintf(bgw.bgw_library_name, BGW_MAXLEN, "pg_globalxact");
+    snprintf(bgw.bgw_function_name, BGW_MAXLEN, "tpc_logwriter_main");
+    snprintf(bgw.bgw_name, BGW_MAXLEN, "pg_globalxact log writer");
+    snprintf(bgw.bgw_type, BGW_MAXLEN, "pg_globalxact log writer");
+    RegisterBackgroundWorker(&bgw);
+}
+
+Size
+tpc_logwriter_shmem_size(void)
+{
+    return add_size(offsetof(logwriter_shared, buffer), buffer_size());
+}
+
+/*
+ * void tpc_logwriter_shmem_startup(void)
+ *
+ * Sets up the shared state.  The journal starts over in the segment after
+ * the newest one on disk, which the log writer has yet to replay, so that
+ * backends can append before it has.
+ */
+
+void
+tpc_logwriter_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact log writer",
+			     tpc_logwriter_shmem_size(), &found);
+    if (!found) {
+	uint64	   *segnos;
+	int		n = list_segments(&segnos);
+	uint64	    next = n > 0 ? segnos[n - 1] + 1 : 1;
+
+	pfree(segnos);
+	shared->insert_pos = next * segment_bytes();
+	shared->flush_pos = shared->insert_pos;
+	shared->tracked_from = next;
+	shared->old_sets = 0;
+	memset(shared->open_sets, 0, sizeof(shared->open_sets));
+	shared->oldest_segno = next;
+	shared->last_segno = next - 1;
+	shared->recovered = false;
+	shared->writer_latch = NULL;
+	ConditionVariableInit(&shared->flushed);
+    }
+}
+
+/*
+ * bool tpc_logwriter_recovered(void)
+ *
+ * Tells whether the journal left over from before startup has been written
+ * out as set files yet.
+ */
+
+bool
+tpc_logwriter_recovered(void)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    bool	recovered;
+
+    LWLockAcquire(lock, LW_SHARED);
+    recovered = shared->recovered;
+    LWLockRelease(lock);
+    return recovered;
+}
+
+/*
+ * static void copy_in(const char *data, Size len)
+ *
+ * Copies data into the buffer at the insert position, or zeroes if data is
+ * NULL.  The caller holds the lock and has made sure there is room.
+ */
+
+static void
+copy_in(const char *data, Size len)
+{
+    Size	size = buffer_size();
+    Size	offset = shared->insert_pos % size;
+    Size	first = Min(len, size - offset);
+
+    if (data) {
+	memcpy(shared->buffer + offset, data, first);
+	memcpy(shared->buffer, data + first, len - first);
+    } else {
+	memset(shared->buffer + offset, 0, first);
+	memset(shared->buffer, 0, len - first);
+    }
+    shared->insert_pos += len;
+}
+
+/*
+ * static void count_open(uint64 segno)
+ *
+ * Counts a set as open in segno, with the lock held.  Only the newest
+ * TRACKED_SEGMENTS segments have counts of their own.  Sets that stay open
+ * longer than that are lumped together in old_sets, and hold back the
+ * recycling of every segment older than tracked_from until they finish,
+ * or until retire_abandoned() finds nobody is going to finish them.
+ */
+
+static void
+count_open(uint64 segno)
+{
+    while (segno >= shared->tracked_from + TRACKED_SEGMENTS) {
+	int	   *count = &shared->open_sets[shared->tracked_from
+					       % TRACKED_SEGMENTS];
+
+	shared->old_sets += *count;
+	*count = 0;
+	shared->tracked_from++;
+    }
+    shared->open_sets[segno % TRACKED_SEGMENTS]++;
+}
+
+static void
+count_finished(uint64 segno)
+{
+    if (segno < shared->tracked_from)
+	shared->old_sets--;
+    else
+	shared->open_sets[segno % TRACKED_SEGMENTS]--;
+}
+
+/*
+ * static uint64 recycle_limit(void)
+ *
+ * Returns the oldest segment that must be kept, with the lock held:  the
+ * oldest one some open set started in, or else the one being written.
+ */
+
+static uint64
+recycle_limit(void)
+{
+    uint64	limit = shared->flush_pos / segment_bytes();
+
+    if (shared->old_sets > 0)
+	return shared->oldest_segno;
+    for (uint64 segno = shared->tracked_from;
+	 segno < limit && segno < shared->tracked_from + TRACKED_SEGMENTS;
+	 ++segno) {
+	if (shared->open_sets[segno % TRACKED_SEGMENTS] > 0)
+	    return segno;
+    }
+    return limit;
+}
+
+/*
+ * uint64 tpc_logwriter_append(char *record, int len, uint64 *set_start,
+ *                             bool finishes)
+ *
+ * Stamps a record with its segment and copies it into the journal buffer,
+ * waiting for the log writer to make room if the buffer is full.
+ *
+ * *set_start is where the set's first record went, or 0 before there is
+ * one.  The first record of a set counts it as open in its segment, and a
+ * record that finishes it counts it out again, both in the same critical
+ * section as the copy, so a segment can never be recycled between a set
+ * being started and its first record.
+ *
+ * Returns the position just past the record, for tpc_logwriter_flush.
+ */
+
+uint64
+tpc_logwriter_append(char *record, int len, uint64 *set_start, bool finishes)
+{
+    LWLock     *lock;
+    Size	size = buffer_size();
+    uint64	segsize = segment_bytes();
+    uint64	start;
+    Size	pad;
+    uint64	end;
+    TimestampTz gone_since = 0;
+
+    if (!shared)
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("pg_globalxact.log_method = journal requires "
+		       "pg_globalxact in shared_preload_libraries")));
+    if ((Size) len > size)
+	ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+		errmsg("journal record of %d bytes does not fit in "
+		       "pg_globalxact.log_buffers", len)));
+
+    lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    for (;;) {
+	Latch	   *latch;
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	/* Records do not straddle segments. */
+	pad = segsize - shared->insert_pos % segsize;
+	if (pad >= (Size) len)
+	    pad = 0;
+	if (shared->insert_pos - shared->flush_pos + pad + len <= size)
+	    break;
+	latch = shared->writer_latch;
+	LWLockRelease(lock);
+	wait_for_writer(latch, &gone_since,
+			tpc_wait_event(TPC_WAIT_LOG_WRITE));
+    }
+    ConditionVariableCancelSleep();
+
+    copy_in(NULL, pad);
+    start = shared->insert_pos;
+    tpc_record_set_segment(record, (uint16) (start / segsize));
+    copy_in(record, len);
+    if (finishes && *set_start != 0) {
+	count_finished(*set_start / segsize);
+	*set_start = 0;
+    } else if (!finishes && 0 == *set_start) {
+	count_open(start / segsize);
+	*set_start = start;
+    }
+    end = shared->insert_pos;
+    LWLockRelease(lock);
+
+    return end;
+}
+
+/*
+ * static void wait_for_writer(Latch *latch, TimestampTz *gone_since,
+ *                             uint32 wait_event_info)
+ *
+ * Wakes the log writer, whose latch is latch, and sleeps until it has
+ * flushed something or WRITER_CHECK_INTERVAL has passed.  With latch NULL
+ * there is no log writer; *gone_since is when we first found it gone, or 0,
+ * and once it has been gone for WRITER_GONE_TIMEOUT this errors out rather
+ * than wait for it forever.
+ */
+
+static void
+wait_for_writer(Latch *latch, TimestampTz *gone_since, uint32 wait_event_info)
+{
+    if (latch) {
+	SetLatch(latch);
+	*gone_since = 0;
+    } else if (0 == *gone_since)
+	*gone_since = GetCurrentTimestamp();
+    else if (TimestampDifferenceExceeds(*gone_since, GetCurrentTimestamp(),
+					WRITER_GONE_TIMEOUT)) {
+	ConditionVariableCancelSleep();
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("pg_globalxact log writer is not running")));
+    }
+    (void) ConditionVariableTimedSleep(&shared->flushed,
+				       WRITER_CHECK_INTERVAL,
+				       wait_event_info);
+}
+
+/*
+ * void tpc_logwriter_flush(uint64 upto)
+ *
+ * Wakes the log writer and waits until everything before upto is durable.
+ * Whoever else has appended in the meantime rides along on the same sync.
+ * Errors out if the log writer stays gone; see wait_for_writer.
+ */
+
+void
+tpc_logwriter_flush(uint64 upto)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    TimestampTz gone_since = 0;
+
+    for (;;) {
+	uint64	    flushed;
+	Latch	   *latch;
+
+	LWLockAcquire(lock, LW_SHARED);
+	flushed = shared->flush_pos;
+	latch = shared->writer_latch;
+	LWLockRelease(lock);
+	if (flushed >= upto)
+	    break;
+	wait_for_writer(latch, &gone_since,
+			tpc_wait_event(TPC_WAIT_LOG_SYNC));
+    }
+    ConditionVariableCancelSleep();
+}
+
+/*
+ * static void logwriter_detach(int code, Datum arg)
+ *
+ * Tells backends the log writer is gone, however it exits, so that they
+ * stop waking it and waiting for it.
+ */
+
+static void
+logwriter_detach(int code, Datum arg)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+
+    LWLockReleaseAll();
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->writer_latch = NULL;
+    LWLockRelease(lock);
+    ConditionVariableBroadcast(&shared->flushed);
+    tpc_reaper_attach(NULL);
+}
+
+static void
+logwriter_sighup(SIGNAL_ARGS)
+{
+    int		save_errno = errno;
+
+    got_sighup = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+static void
+logwriter_sigterm(SIGNAL_ARGS)
+{
+    int		save_errno = errno;
+
+    shutdown_requested = true;
+    SetLatch(MyLatch);
+    errno = save_errno;
+}
+
+/*
+ * static void materialize_set(journal_set *set)
+ *
+ * Writes an unfinished set from the journal out as a transaction set file
+ * in its shard.  An existing file for the set is left alone; it was written
+ * by a backend that gave up on the set and is at least as current as the
+ * journal.
+ */
+
+static void
+materialize_set(journal_set * set)
+{
+    char	shard[MAXPGPATH];
+    char	path[MAXPGPATH];
+    int		fd;
+
+    tpc_txnsetfile_shard_dir(tpc_txnsetfile_shard(set->prefix), shard,
+			     sizeof(shard), true);
+    snprintf(path, sizeof(path), "%s/%s", shard, set->prefix);
+    fd = BasicOpenFile(path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY);
+    if (fd < 0) {
+	if (errno == EEXIST)
+	    return;
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not create file \"%s\": %m", path)));
+    }
+    if (write(fd, set->lines.data, set->lines.len) != set->lines.len)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not write file \"%s\": %m", path)));
+    if (pg_fsync(fd) != 0)
+	ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+		errmsg("could not fsync file \"%s\": %m", path)));
+    close(fd);
+    fsync_fname(shard, true);
+    ereport(LOG, (errmsg("recovered unfinished transaction set %s "
+			 "from the journal", set->prefix)));
+}
+
+/*
+ * static HTAB *journal_sets(void)
+ * Creates a table of journal sets, keyed by prefix.
+ */
+
+static HTAB *
+journal_sets(void)
+{
+    HASHCTL	ctl;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = NAMEDATALEN;
+    ctl.entrysize = sizeof(journal_set);
+    ctl.hcxt = CurrentMemoryContext;
+#if PG_VERSION_NUM >= 140000
+    return hash_create("pg_globalxact journal", 64, &ctl,
+		       HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+#else
+    return hash_create("pg_globalxact journal", 64, &ctl,
+		       HASH_ELEM | HASH_CONTEXT);
+#endif
+}
+
+/*
+ * static journal_set *journal_entry(HTAB *sets, const char *prefix)
+ * Finds or adds the set with the given prefix.
+ */
+
+static journal_set *
+journal_entry(HTAB *sets, const char *prefix)
+{
+    journal_set *set;
+    bool	found;
+
+    set = hash_search(sets, prefix, HASH_ENTER, &found);
+    if (!found) {
+	initStringInfo(&set->lines);
+	set->participants = false;
+	set->complete = false;
+	set->alive = false;
+	set->segment = -1;
+    }
+    return set;
+}
+
+/*
+ * static void replay_text(FILE *journal, HTAB *sets)
+ * Collects the sets in a journal written in the old text format.
+ */
+
+static void
+replay_text(FILE *journal, HTAB *sets)
+{
+    char	line[JOURNALLINE_MAX];
+    char	done[32];
+
+    snprintf(done, sizeof(done), "phase %s\n", tpc_phase_get_label(COMPLETE));
+    while (fgets(line, sizeof(line), journal)) {
+	size_t	    len = strlen(line);
+	char	   *rest;
+	journal_set *set;
+
+	if (0 == len || line[len - 1] != '\n')
+	    break;
+	rest = strchr(line, ' ');
+	if (!rest)
+	    continue;
+	*rest++ = '\0';
+	set = journal_entry(sets, line);
+	if (strcmp(rest, done) == 0)
+	    set->complete = true;
+	else {
+	    appendStringInfoString(&set->lines, rest);
+	    set->participants = true;
+	}
+    }
+}
+
+/*
+ * static bool replay_records(tpc_record_stream *stream, HTAB *sets,
+ *                            int segment, const char *path)
+ *
+ * Collects the sets in one journal file.  Records go into the set files as
+ * they are, prefix and all.  segment is the stamp the file's records must
+ * carry, or -1 for a journal from before segments.  Replay stops at the
+ * first record that fails its checks or carries another stamp; like WAL,
+ * nothing after it can be trusted.  In a recycled segment that is just
+ * where the new records end and the old ones begin.  A set is dropped as
+ * soon as its COMPLETE record turns up, as a long journal holds many
+ * finished sets and few unfinished ones.
+ *
+ * Returns whether the file was read up to space never written, in which
+ * case the journal may go on in the next segment.
+ */
+
+static bool
+replay_records(tpc_record_stream * stream, HTAB *sets, int segment,
+	       const char *path)
+{
+    tpc_record_view view;
+    tpc_record_result result;
+
+    while ((result = tpc_record_stream_next(stream, &view)) == TPC_RECORD_OK) {
+	const tpc_record *rec = view.rec;
+	char	    prefix[NAMEDATALEN];
+	journal_set *set;
+
+	if (segment >= 0 && rec->segment != (uint16) segment)
+	    return false;
+	if (0 == rec->prefix_len)
+	    continue;
+	strlcpy(prefix, view.prefix, Min(rec->prefix_len + 1, sizeof(prefix)));
+	set = journal_entry(sets, prefix);
+	if (TPC_REC_PHASE == rec->type && COMPLETE == rec->phase) {
+	    pfree(set->lines.data);
+	    hash_search(sets, prefix, HASH_REMOVE, NULL);
+	} else {
+	    if (set->segment < 0)
+		set->segment = rec->segment;
+	    appendBinaryStringInfo(&set->lines, (const char *) rec, rec->len);
+	    if (TPC_REC_PARTICIPANT == rec->type)
+		set->participants = true;
+	}
+    }
+    if (TPC_RECORD_CORRUPT == result)
+	ereport(segment < 0 ? WARNING : LOG,
+		(errmsg("invalid record in file \"%s\", "
+			"ignoring the rest of the journal", path)));
+    /* A segment ends in zeroes, or in less than a header's worth of them. */
+    return TPC_RECORD_END == result || TPC_RECORD_TORN == result;
+}
+
+/*
+ * static bool replay_file(const char *path, HTAB *sets, int segment)
+ *
+ * Collects the sets in one journal file, as for replay_records.  A journal
+ * left by a version that wrote text is replayed as text.
+ */
+
+static bool
+replay_file(const char *path, HTAB *sets, int segment)
+{
+    FILE       *file;
+    tpc_record_stream *stream;
+    bool	more = false;
+
+    file = AllocateFile(path, PG_BINARY_R);
+    if (!file)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not open file \"%s\": %m", path)));
+    stream = tpc_record_stream_open(file);
+    if (segment < 0 && tpc_record_stream_is_text(stream)) {
+	rewind(file);
+	replay_text(file, sets);
+    } else
+	more = replay_records(stream, sets, segment, path);
+    tpc_record_stream_close(stream);
+    FreeFile(file);
+    return more;
+}
+
+/*
+ * static void replay_journal(void)
+ *
+ * Reads the journal left over from before a crash or restart, writes out
+ * every set that never finished, and recycles the segments.  Segments are
+ * read in order for as long as they follow on from each other.  A torn
+ * record at the end is ignored; nobody waited on it, so nobody acted on it.
+ *
+ * A set whose first records were in a segment that has since been recycled
+ * has finished, even if its COMPLETE record never made it out, so sets
+ * without participants are not written out.
+ *
+ * A journal file from before segments is replayed first and then removed
+ * to make way for the directory.
+ */
+
+static void
+replay_journal(void)
+{
+    HTAB       *sets;
+    HASH_SEQ_STATUS status;
+    journal_set *set;
+    struct stat st;
+    uint64     *segnos;
+    int		n;
+    bool	legacy;
+
+    sets = journal_sets();
+    legacy = (stat(journalpath, &st) == 0 && !S_ISDIR(st.st_mode));
+    if (legacy)
+	(void) replay_file(journalpath, sets, -1);
+    n = list_segments(&segnos);
+    for (int i = 0; i < n; ++i) {
+	char	    path[MAXPGPATH];
+
+	if (i > 0 && segnos[i] != segnos[i - 1] + 1)
+	    break;
+	segment_path(path, segnos[i]);
+	if (!replay_file(path, sets, (int) (segnos[i] & PG_UINT16_MAX)))
+	    break;
+    }
+
+    hash_seq_init(&status, sets);
+    while ((set = (journal_set *) hash_seq_search(&status)) != NULL) {
+	if (!set->complete && set->participants)
+	    materialize_set(set);
+    }
+    hash_destroy(sets);
+
+    if (legacy)
+	(void) durable_unlink(journalpath, ERROR);
+    if (access(journalpath, F_OK) != 0) {
+	if (MakePGDirectory(journalpath) != 0)
+	    ereport(ERROR, (errcode_for_file_access(),
+		    errmsg("could not create directory \"%s\": %m",
+			   journalpath)));
+	fsync_fname(TPC_LOGDIR, true);
+    }
+
+    /* Everything replayed can be reused, unless it has the wrong size. */
+    for (int i = 0; i < n; ++i) {
+	char	    path[MAXPGPATH];
+
+	segment_path(path, segnos[i]);
+	if (stat(path, &st) == 0 && (uint64) st.st_size == segment_bytes())
+	    recycle_segment(segnos[i]);
+	else
+	    (void) durable_unlink(path, ERROR);
+    }
+    pfree(segnos);
+}
+
+/*
+ * static bool append_complete(const char *prefix, uint64 segno)
+ *
+ * Appends the COMPLETE record of a set the log writer has written out
+ * itself, and counts the set finished in segno, unless the buffer has no
+ * room right now.  The log writer cannot wait for room as backends do,
+ * since it is the one that makes it.
+ */
+
+static bool
+append_complete(const char *prefix, uint64 segno)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    uint64	segsize = segment_bytes();
+    tpc_record_buf record;
+    int		len;
+    Size	pad;
+    bool	room;
+
+    len = tpc_record_encode(record.data, TPC_REC_PHASE, COMPLETE, 0,
+			    TPC_STATUS_PENDING, prefix, NULL);
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    pad = segsize - shared->insert_pos % segsize;
+    if (pad >= (Size) len)
+	pad = 0;
+    room = (shared->insert_pos - shared->flush_pos + pad + len
+	    <= buffer_size());
+    if (room) {
+	copy_in(NULL, pad);
+	tpc_record_set_segment(record.data,
+			       (uint16) (shared->insert_pos / segsize));
+	copy_in(record.data, len);
+	count_finished(segno);
+    }
+    LWLockRelease(lock);
+    return room;
+}
+
+/*
+ * static bool retire_abandoned(void)
+ *
+ * Writes out the journal sets nobody is going to finish as ordinary set
+ * files for recovery, and marks them finished so that they stop holding
+ * back recycling.  A backend that dies in phase two, or a dispatcher that
+ * dies with sets in hand, leaves its set open in the journal; without this
+ * the segment it started in, and every later one, would be kept until the
+ * server restarted.
+ *
+ * Finding them means reading every segment kept, so this only looks once
+ * RETIRE_SEGMENTS are kept, and again each time that number has doubled,
+ * which keeps the cost of a set that is merely slow in line with the
+ * journal written meanwhile.
+ *
+ * A set is abandoned if it is not finished in the journal and not in the
+ * registry.  The registry is copied before reading the journal, and only
+ * once everything appended before the copy has been written out.  A set
+ * that started in a segment finished before the copy had entered the
+ * registry by then, so if it is missing from the copy it had left, and
+ * since a set's COMPLETE record is appended before it leaves the registry,
+ * that record would have been read.  Sets that started later wait for
+ * the next look.
+ *
+ * Returns whether it marked anything finished.
+ */
+
+static bool
+retire_abandoned(void)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    uint64	segsize = segment_bytes();
+    uint64	limit;
+    uint64	current;
+    uint64	written;
+    uint64	appended;
+    MemoryContext retire_context;
+    MemoryContext old_context;
+    HTAB       *sets;
+    HASH_SEQ_STATUS status;
+    journal_set *set;
+    List       *alive;
+    ListCell   *lc;
+    int		retired = 0;
+
+    LWLockAcquire(lock, LW_SHARED);
+    limit = recycle_limit();
+    current = shared->flush_pos / segsize;
+    LWLockRelease(lock);
+    if (current < limit + RETIRE_SEGMENTS) {
+	retire_next = 0;
+	return false;
+    }
+    if (current < retire_next)
+	return false;
+
+    retire_context = AllocSetContextCreate(CurrentMemoryContext,
+					   "pg_globalxact journal sets",
+					   ALLOCSET_DEFAULT_SIZES);
+    old_context = MemoryContextSwitchTo(retire_context);
+    alive = tpc_registry_prefixes();
+    LWLockAcquire(lock, LW_SHARED);
+    written = shared->flush_pos;
+    appended = shared->insert_pos;
+    LWLockRelease(lock);
+    if (written < appended) {
+	/* Try again once it is written out. */
+	MemoryContextSwitchTo(old_context);
+	MemoryContextDelete(retire_context);
+	return false;
+    }
+    retire_next = current + (current - limit);
+
+    sets = journal_sets();
+    foreach(lc, alive)
+	journal_entry(sets, (const char *) lfirst(lc))->alive = true;
+    for (uint64 segno = limit; segno * segsize < written; ++segno) {
+	char	    path[MAXPGPATH];
+
+	segment_path(path, segno);
+	if (!replay_file(path, sets, (int) (segno & PG_UINT16_MAX)))
+	    break;
+    }
+
+    hash_seq_init(&status, sets);
+    while ((set = (journal_set *) hash_seq_search(&status)) != NULL) {
+	uint64	    segno;
+
+	if (set->alive || set->complete || !set->participants
+	    || set->segment < 0)
+	    continue;
+	segno = limit + (((uint64) set->segment - limit) & PG_UINT16_MAX);
+	if (segno >= current)
+	    continue;
+	materialize_set(set);
+	if (!append_complete(set->prefix, segno)) {
+	    hash_seq_term(&status);
+	    break;
+	}
+	retired++;
+    }
+
+    MemoryContextSwitchTo(old_context);
+    MemoryContextDelete(retire_context);
+    if (retired > 0)
+	ereport(LOG, (errmsg("wrote out %d abandoned transaction sets "
+			     "from the journal for recovery", retired)));
+    return retired > 0;
+}
+
+/*
+ * static void create_segment(uint64 segno)
+ *
+ * Adds a segment file filled with zeroes, so that writing it later neither
+ * allocates blocks nor changes its size, and fdatasync has no metadata to
+ * flush.  It is built under a temporary name and renamed into place, so
+ * there is never a partial segment.
+ */
+
+static void
+create_segment(uint64 segno)
+{
+    static PGAlignedBlock zeroes;
+    char	tmppath[MAXPGPATH];
+    char	path[MAXPGPATH];
+    uint64	segsize = segment_bytes();
+    int		fd;
+
+    snprintf(tmppath, sizeof(tmppath), "%s/segment.tmp", journalpath);
+    segment_path(path, segno);
+    fd = BasicOpenFile(tmppath, O_RDWR | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not create file \"%s\": %m", tmppath)));
+    for (uint64 done = 0; done < segsize; done += BLCKSZ) {
+	int	    nbytes = (int) Min((uint64) BLCKSZ, segsize - done);
+
+	errno = 0;
+	pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_WRITE));
+	if (write(fd, zeroes.data, nbytes) != nbytes) {
+	    int		save_errno = errno;
+
+	    pgstat_report_wait_end();
+	    close(fd);
+	    unlink(tmppath);
+	    errno = save_errno ? save_errno : ENOSPC;
+	    ereport(ERROR, (errcode_for_file_access(),
+		    errmsg("could not write to file \"%s\": %m", tmppath)));
+	}
+	pgstat_report_wait_end();
+    }
+    pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_SYNC));
+    if (pg_fsync(fd) != 0)
+	ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+		errmsg("could not fsync file \"%s\": %m", tmppath)));
+    pgstat_report_wait_end();
+    close(fd);
+    durable_rename(tmppath, path, ERROR);
+}
+
+/*
+ * static void open_segment(uint64 segno)
+ *
+ * Makes segno the segment being written, after syncing the one before it.
+ * A segment that is not ready yet is created here, which only happens when
+ * the journal grows faster than the log writer prepares segments ahead.
+ */
+
+static void
+open_segment(uint64 segno)
+{
+    char	path[MAXPGPATH];
+
+    if (segment_fd >= 0) {
+	sync_segment();
+	close(segment_fd);
+	segment_fd = -1;
+    }
+    while (shared->last_segno < segno) {
+	create_segment(shared->last_segno + 1);
+	shared->last_segno++;
+    }
+    segment_path(path, segno);
+    segment_fd = BasicOpenFile(path, O_RDWR | PG_BINARY);
+    if (segment_fd < 0)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not open file \"%s\": %m", path)));
+    segment_open = segno;
+}
+
+static void
+sync_segment(void)
+{
+    char	path[MAXPGPATH];
+
+    pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_SYNC));
+    if (pg_fdatasync(segment_fd) != 0) {
+	segment_path(path, segment_open);
+	ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+		errmsg("could not fdatasync file \"%s\": %m", path)));
+    }
+    pgstat_report_wait_end();
+}
+
+/*
+ * static void recycle_segment(uint64 segno)
+ *
+ * Renames a segment nothing needs any more to be the next one ready for
+ * use, or removes it if enough are ready already.
+ */
+
+static void
+recycle_segment(uint64 segno)
+{
+    char	path[MAXPGPATH];
+    uint64	current = shared->flush_pos / segment_bytes();
+
+    segment_path(path, segno);
+    if (shared->last_segno < current + tpc_journal_segments) {
+	char	    newpath[MAXPGPATH];
+
+	segment_path(newpath, shared->last_segno + 1);
+	durable_rename(path, newpath, ERROR);
+	shared->last_segno++;
+    } else
+	(void) durable_unlink(path, ERROR);
+}
+
+/*
+ * static void recycle_segments(void)
+ * Recycles every segment older than the oldest one still needed.
+ */
+
+static void
+recycle_segments(void)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+    uint64	limit;
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    limit = recycle_limit();
+    /* Nothing older than limit is open, so it needs no counts. */
+    if (shared->tracked_from < limit)
+	shared->tracked_from = limit;
+    LWLockRelease(lock);
+
+    while (shared->oldest_segno < limit) {
+	recycle_segment(shared->oldest_segno);
+	shared->oldest_segno++;
+    }
+}
+
+/*
+ * static bool preallocate_segment(void)
+ *
+ * Creates the next segment if fewer than pg_globalxact.journal_segments
+ * are ready beyond the one being written.  Returns whether it did.
+ */
+
+static bool
+preallocate_segment(void)
+{
+    uint64	current = shared->flush_pos / segment_bytes();
+
+    if (shared->last_segno >= current + tpc_journal_segments)
+	return false;
+    create_segment(shared->last_segno + 1);
+    shared->last_segno++;
+    return true;
+}
+
+/*
+ * static void write_range(uint64 start, uint64 end)
+ *
+ * Writes part of the ring buffer to the journal segments it belongs in.
+ * Nobody can overwrite this part of the buffer until flush_pos moves past
+ * it, so no lock is needed.  A failed write would leave a partial record
+ * in the middle of the journal, so like WAL we do not try to carry on.
+ */
+
+static void
+write_range(uint64 start, uint64 end)
+{
+    Size	size = buffer_size();
+    uint64	segsize = segment_bytes();
+
+    while (start < end) {
+	uint64	    segno = start / segsize;
+	off_t	    segoff = (off_t) (start % segsize);
+	Size	    offset = start % size;
+	Size	    nbytes = Min(end - start, size - offset);
+	ssize_t	    written;
+
+	nbytes = Min(nbytes, segsize - segoff);
+	if (segment_fd < 0 || segno != segment_open)
+	    open_segment(segno);
+	pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_WRITE));
+	written = pg_pwrite(segment_fd, shared->buffer + offset, nbytes, segoff);
+	pgstat_report_wait_end();
+	if (written < 0 && errno == EINTR)
+	    continue;
+	if (written <= 0) {
+	    char	path[MAXPGPATH];
+
+	    segment_path(path, segno);
+	    ereport(PANIC, (errcode_for_file_access(),
+		    errmsg("could not write to file \"%s\": %m", path)));
+	}
+	start += written;
+    }
+}
+
+/*
+ * static void advance_flush(uint64 end)
+ *
+ * Publishes that everything before end is durable, wakes whoever waits for
+ * that, and recycles the segments that freed up.
+ */
+
+static void
+advance_flush(uint64 end)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+
+    if (0 == end)
+	return;
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->flush_pos = end;
+    LWLockRelease(lock);
+    ConditionVariableBroadcast(&shared->flushed);
+    recycle_segments();
+}
+
+/*
+ * static void submit_range(uint64 start, uint64 end)
+ *
+ * Submits part of the ring buffer as one io_uring flush per segment it
+ * touches.  The flushes of a segment are drained before moving on to the
+ * next, so a segment is never closed under a write.
+ */
+
+static void
+submit_range(uint64 start, uint64 end)
+{
+    Size	size = buffer_size();
+    uint64	segsize = segment_bytes();
+
+    while (start < end) {
+	uint64	    segno = start / segsize;
+	uint64	    stop = Min(end, (segno + 1) * segsize);
+
+	if (segment_fd < 0 || segno != segment_open) {
+	    while (tpc_uring_in_flight() > 0)
+		advance_flush(tpc_uring_reap(true));
+	    open_segment(segno);
+	}
+	while (start < stop) {
+	    Size	offset = start % size;
+	    Size	nbytes = Min(stop - start, size - offset);
+
+	    tpc_uring_write(segment_fd, shared->buffer + offset, nbytes,
+			    (off_t) (start % segsize));
+	    start += nbytes;
+	}
+	tpc_uring_sync(segment_fd, stop);
+    }
+}
+
+/*
+ * static bool uring_pass(uint64 end)
+ *
+ * One pass of the main loop with io_uring:  submits whatever was appended
+ * since the last submission, if another flush may be in flight, and
+ * collects the flushes that have completed.  Returns whether it did either.
+ */
+
+static bool
+uring_pass(uint64 end)
+{
+    bool	busy = false;
+    uint64	done;
+
+    if (end > submit_pos && tpc_uring_can_submit()) {
+	submit_range(submit_pos, end);
+	submit_pos = end;
+	busy = true;
+    }
+    done = tpc_uring_reap(false);
+    if (done > 0) {
+	advance_flush(done);
+	busy = true;
+    }
+    return busy;
+}
+
+/*
+ * void tpc_logwriter_main(Datum main_arg)
+ *
+ * Main loop of the log writer.  Each pass writes and syncs whatever is in
+ * the buffer and recycles the segments that freed up.  If there was nothing
+ * to do it removes finished set files, writes out abandoned sets, gets a
+ * segment ready, if one is wanted, or else sleeps until a backend wants a
+ * flush or log_writer_delay runs out, whichever is first.
+ * With io_uring it also wakes up when a flush completes.
+ */
+
+void
+tpc_logwriter_main(Datum main_arg)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_LOGWRITER_LOCK);
+
+    pqsignal(SIGHUP, logwriter_sighup);
+    pqsignal(SIGTERM, logwriter_sigterm);
+    BackgroundWorkerUnblockSignals();
+
+    if (access(TPC_LOGDIR, F_OK) != 0 && MakePGDirectory(TPC_LOGDIR) != 0)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not create directory \"%s\": %m", TPC_LOGDIR)));
+
+    before_shmem_exit(logwriter_detach, 0);
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->writer_latch = MyLatch;
+    LWLockRelease(lock);
+
+    /* Only replay once per postmaster lifetime; a restarted writer would
+     * otherwise write out the sets of backends that are still running.
+     */
+    if (!shared->recovered) {
+	replay_journal();
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	shared->recovered = true;
+	LWLockRelease(lock);
+    }
+
+    use_uring = (TPC_IO_URING == tpc_io_engine_setting
+		 && tpc_uring_start(shared->buffer, buffer_size()));
+    submit_pos = shared->flush_pos;
+    tpc_reaper_attach(MyLatch);
+
+    for (;;) {
+	uint64	    start;
+	uint64	    end;
+
+	if (got_sighup) {
+	    got_sighup = false;
+	    ProcessConfigFile(PGC_SIGHUP);
+	}
+
+	LWLockAcquire(lock, LW_EXCLUSIVE);
+	start = shared->flush_pos;
+	end = shared->insert_pos;
+	LWLockRelease(lock);
+
+	if (use_uring) {
+	    if (uring_pass(end))
+		continue;
+	} else if (end > start) {
+	    write_range(start, end);
+	    sync_segment();
+	    advance_flush(end);
+	    continue;
+	}
+
+	if (tpc_uring_in_flight() > 0) {
+	    (void) WaitLatchOrSocket(MyLatch,
+				     WL_LATCH_SET | WL_SOCKET_READABLE
+				     | WL_EXIT_ON_PM_DEATH,
+				     tpc_uring_eventfd(), -1L,
+				     tpc_wait_event(TPC_WAIT_LOG_SYNC));
+	    ResetLatch(MyLatch);
+	    continue;
+	}
+	if (tpc_reaper_run())
+	    continue;
+	if (retire_abandoned())
+	    continue;
+	if (shutdown_requested)
+	    break;
+	if (preallocate_segment())
+	    continue;
+
+	(void) WaitLatch(MyLatch,
+			 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			 tpc_log_writer_delay, PG_WAIT_EXTENSION);
+	ResetLatch(MyLatch);
+    }
+
+    tpc_uring_stop();
+    if (segment_fd >= 0)
+	close(segment_fd);
+    proc_exit(0);
+}
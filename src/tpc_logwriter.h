@@ -0,0 +1,37 @@
+#ifndef TPC_LOGWRITER_H
+
+#define TPC_LOGWRITER_H
+#include <postgres.h>
+
+/* Name of the journal's directory within TPC_LOGDIR.  Versions before
+ * segments kept the whole journal in a file of this name.
+ */
+#define TPC_JOURNAL_NAME "journal"
+
+/*
+ * The journal is a single shared log of transaction set records.  Backends
+ * append records to a buffer in shared memory and a dedicated log writer
+ * process writes and syncs them in batches, so one fdatasync makes the
+ * decisions of many backends durable at once.  On disk it is a series of
+ * fixed-size segment files, named after their number like WAL segments.
+ *
+ * Positions are byte offsets into the stream of records.  A position
+ * divided by the segment size is the number of the segment it falls in;
+ * numbers keep increasing across restarts, so 0 is never a position.
+ */
+
+extern int  tpc_log_buffers;
+extern int  tpc_log_writer_delay;
+extern int  tpc_journal_segment_size;
+extern int  tpc_journal_segments;
+
+extern void tpc_logwriter_init(void);
+extern Size tpc_logwriter_shmem_size(void);
+extern void tpc_logwriter_shmem_startup(void);
+extern uint64 tpc_logwriter_append(char *record, int len, uint64 *set_start,
+				    bool finishes);
+extern void tpc_logwriter_flush(uint64 upto);
+extern bool tpc_logwriter_recovered(void);
+extern PGDLLEXPORT void tpc_logwriter_main(Datum main_arg);
+
+#endif
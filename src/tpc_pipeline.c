@@ -0,0 +1,459 @@
+/*
+ * tpc_pipeline.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file runs queues of commands against many connections at once.  It
+ * is used where one process has a lot to say to each remote: dispatchers
+ * finishing many sets, and recovery resolving many in-doubt transactions.
+ * With pipeline mode a remote sees a handful of round trips for the whole
+ * queue rather than one per command.
+ *
+ * Like tpc_remote.c, nothing here throws errors for remote failures.  A
+ * command that could not be answered is reported with a NULL result and the
+ * pipeline is marked broken so the caller can drop the connection.
+ *
+ * Connections can be opened the same way, all at once, so that a remote
+ * that does not answer costs one connect timeout in total rather than one
+ * per remote behind it.
+ *
+ * Both waits wake on the process latch so they can be cancelled, but the
+ * latch may have been set for the caller, as the recovery launcher does to
+ * hand work to its workers.  A latch that fired during a wait is therefore
+ * set again before returning.
+ */
+
+#include "tpc_pipeline.h"
+#include "tpc_wait.h"
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <storage/latch.h>
+#include <utils/timestamp.h>
+
+static void finish_cmd(tpc_pipeline * pipeline);
+static void fail_remaining(tpc_pipeline * pipeline);
+static bool send_cmd(tpc_pipeline * pipeline, tpc_pipeline_cmd * cmd);
+static void keep_result(tpc_pipeline_cmd * cmd, PGresult * res);
+static void send_pipeline(tpc_pipeline * pipeline);
+static void consume_pipeline(tpc_pipeline * pipeline);
+static void end_pipeline(tpc_pipeline * pipeline);
+
+/*
+ * void tpc_pipeline_init(tpc_pipeline *pipeline, PGconn *conn)
+ * Sets up an empty queue for conn.
+ */
+
+void
+tpc_pipeline_init(tpc_pipeline * pipeline, PGconn * conn)
+{
+    memset(pipeline, 0, sizeof(tpc_pipeline));
+    pipeline->conn = conn;
+}
+
+/*
+ * void tpc_pipeline_add(tpc_pipeline *pipeline, const char *query,
+ *                       int nparams, const char *const *values,
+ *                       tpc_pipeline_callback callback, void *arg)
+ *
+ * Queues a command.  The query and parameters are copied.
+ */
+
+void
+tpc_pipeline_add(tpc_pipeline * pipeline, const char *query, int nparams,
+		 const char *const *values, tpc_pipeline_callback callback,
+		 void *arg)
+{
+    tpc_pipeline_cmd *cmd = palloc0(sizeof(tpc_pipeline_cmd));
+
+    cmd->query = pstrdup(query);
+    cmd->nparams = nparams;
+    if (nparams > 0) {
+	cmd->values = palloc(sizeof(char *) * nparams);
+	for (int i = 0; i < nparams; ++i)
+	    cmd->values[i] = values[i] ? pstrdup(values[i]) : NULL;
+    }
+    cmd->callback = callback;
+    cmd->arg = arg;
+    if (pipeline->last)
+	pipeline->last->next = cmd;
+    else
+	pipeline->first = cmd;
+    pipeline->last = cmd;
+}
+
+/*
+ * static void finish_cmd(tpc_pipeline *pipeline)
+ * Hands the oldest command's result to its callback and moves on.
+ */
+
+static void
+finish_cmd(tpc_pipeline * pipeline)
+{
+    tpc_pipeline_cmd *cmd = pipeline->current;
+
+    pipeline->current = cmd->next;
+    cmd->callback(cmd->res, cmd->arg);
+    if (cmd->res)
+	PQclear(cmd->res);
+    cmd->res = NULL;
+}
+
+/*
+ * static void fail_remaining(tpc_pipeline *pipeline)
+ *
+ * Reports every command we have no answer for as failed.  Some of them may
+ * in fact have run.
+ */
+
+static void
+fail_remaining(tpc_pipeline * pipeline)
+{
+    while (pipeline->current) {
+	if (pipeline->current->res)
+	    PQclear(pipeline->current->res);
+	pipeline->current->res = NULL;
+	finish_cmd(pipeline);
+    }
+    pipeline->broken = true;
+}
+
+/*
+ * static bool send_cmd(tpc_pipeline *pipeline, tpc_pipeline_cmd *cmd)
+ * Sends one command with the extended protocol, which pipelines require.
+ */
+
+static bool
+send_cmd(tpc_pipeline * pipeline, tpc_pipeline_cmd * cmd)
+{
+    return PQsendQueryParams(pipeline->conn, cmd->query, cmd->nparams, NULL,
+			     (const char *const *) cmd->values, NULL, NULL, 0);
+}
+
+/*
+ * static void keep_result(tpc_pipeline_cmd *cmd, PGresult *res)
+ * Keeps the first failing result of a command, otherwise the last one.
+ */
+
+static void
+keep_result(tpc_pipeline_cmd * cmd, PGresult * res)
+{
+    if (cmd->res && PQresultStatus(cmd->res) != PGRES_COMMAND_OK
+	&& PQresultStatus(cmd->res) != PGRES_TUPLES_OK) {
+	PQclear(res);
+	return;
+    }
+    if (cmd->res)
+	PQclear(cmd->res);
+    cmd->res = res;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+/*
+ * static void send_pipeline(tpc_pipeline *pipeline)
+ *
+ * Sends the whole queue.  Each command is followed by a sync of its own, so
+ * that a failing command does not abort the ones after it and none of them
+ * runs in a transaction block.
+ */
+
+static void
+send_pipeline(tpc_pipeline * pipeline)
+{
+    pipeline->current = pipeline->first;
+    if (PQstatus(pipeline->conn) != CONNECTION_OK
+	|| !PQenterPipelineMode(pipeline->conn)) {
+	fail_remaining(pipeline);
+	return;
+    }
+    for (tpc_pipeline_cmd * cmd = pipeline->first; cmd; cmd = cmd->next) {
+	if (!send_cmd(pipeline, cmd) || !PQpipelineSync(pipeline->conn)) {
+	    fail_remaining(pipeline);
+	    return;
+	}
+    }
+}
+
+/*
+ * static void consume_pipeline(tpc_pipeline *pipeline)
+ *
+ * Reads whatever results are available without blocking.  A command is
+ * done when its sync comes back.  libpq returns NULL once after the
+ * results of each query; NULL twice running means nothing more is coming,
+ * which only happens once the connection is lost, so whatever is left has
+ * failed.
+ */
+
+static void
+consume_pipeline(tpc_pipeline * pipeline)
+{
+    bool	ended = false;
+
+    while (pipeline->current && !PQisBusy(pipeline->conn)) {
+	PGresult   *res = PQgetResult(pipeline->conn);
+
+	if (NULL == res) {
+	    if (ended || PQstatus(pipeline->conn) != CONNECTION_OK) {
+		fail_remaining(pipeline);
+		break;
+	    }
+	    ended = true;
+	    continue;
+	}
+	ended = false;
+	if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+	    PQclear(res);
+	    finish_cmd(pipeline);
+	    continue;
+	}
+	keep_result(pipeline->current, res);
+    }
+}
+
+/*
+ * static void end_pipeline(tpc_pipeline *pipeline)
+ * Leaves pipeline mode, or marks the connection broken if we cannot.
+ */
+
+static void
+end_pipeline(tpc_pipeline * pipeline)
+{
+    if (!pipeline->broken && !PQexitPipelineMode(pipeline->conn))
+	pipeline->broken = true;
+}
+
+#else				/* !LIBPQ_HAS_PIPELINING */
+
+/*
+ * Without pipeline mode the commands go one at a time.  A command that
+ * cannot be sent leaves libpq idle, so it finishes in consume_pipeline
+ * with no result.
+ */
+
+static void
+send_pipeline(tpc_pipeline * pipeline)
+{
+    pipeline->current = pipeline->first;
+    if (PQstatus(pipeline->conn) != CONNECTION_OK) {
+	fail_remaining(pipeline);
+	return;
+    }
+    if (pipeline->current)
+	send_cmd(pipeline, pipeline->current);
+}
+
+static void
+consume_pipeline(tpc_pipeline * pipeline)
+{
+    while (pipeline->current && !PQisBusy(pipeline->conn)) {
+	PGresult   *res = PQgetResult(pipeline->conn);
+
+	if (res) {
+	    keep_result(pipeline->current, res);
+	    continue;
+	}
+	finish_cmd(pipeline);
+	if (pipeline->current)
+	    send_cmd(pipeline, pipeline->current);
+    }
+}
+
+static void
+end_pipeline(tpc_pipeline * pipeline)
+{
+}
+
+#endif
+
+/*
+ * void tpc_pipeline_run(tpc_pipeline *head, uint32 wait_event_info)
+ *
+ * Runs the queues of every pipeline in the list starting at head, all at
+ * once, and waits for the last answer, reporting wait_event_info while it
+ * does.  The wait can be cancelled.  The queues are empty afterwards.
+ */
+
+void
+tpc_pipeline_run(tpc_pipeline * head, uint32 wait_event_info)
+{
+    bool	latched = false;
+
+    for (tpc_pipeline * p = head; p; p = p->next) {
+	p->broken = false;
+	send_pipeline(p);
+    }
+
+    for (;;) {
+	WaitEventSet *set;
+	WaitEvent  *events;
+	int	    busy = 0;
+	int	    nevents;
+
+	for (tpc_pipeline * p = head; p; p = p->next) {
+	    consume_pipeline(p);
+	    if (p->current)
+		++busy;
+	}
+	if (0 == busy)
+	    break;
+
+#if PG_VERSION_NUM >= 170000
+	set = CreateWaitEventSet(NULL, busy + 2);
+#else
+	set = CreateWaitEventSet(CurrentMemoryContext, busy + 2);
+#endif
+	events = palloc(sizeof(WaitEvent) * (busy + 1));
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+			  NULL, NULL);
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	for (tpc_pipeline * p = head; p; p = p->next) {
+	    if (p->current)
+		AddWaitEventToSet(set, WL_SOCKET_READABLE, PQsocket(p->conn),
+				  NULL, p);
+	}
+
+	nevents = WaitEventSetWait(set, -1, events, busy + 1,
+				   wait_event_info);
+	for (int i = 0; i < nevents; ++i) {
+	    tpc_pipeline *p = (tpc_pipeline *) events[i].user_data;
+
+	    if (events[i].events & WL_LATCH_SET) {
+		ResetLatch(MyLatch);
+		latched = true;
+	    } else if ((events[i].events & WL_SOCKET_READABLE)
+		     && !PQconsumeInput(p->conn))
+		fail_remaining(p);
+	}
+	FreeWaitEventSet(set);
+	pfree(events);
+	CHECK_FOR_INTERRUPTS();
+    }
+
+    for (tpc_pipeline * p = head; p; p = p->next) {
+	end_pipeline(p);
+	p->first = NULL;
+	p->last = NULL;
+    }
+    if (latched)
+	SetLatch(MyLatch);
+}
+
+/*
+ * void tpc_pipeline_connect(PGconn **conns, const char *const *conninfos,
+ *                           int n, int timeout_ms)
+ *
+ * Makes sure each of conns is connected, opening a connection to the
+ * matching conninfo where conns[i] is NULL and resetting it where it is
+ * broken.  All connections are established at once.  Those that fail are
+ * reported as warnings and left for the caller to find with PQstatus();
+ * those still not done after timeout_ms are closed and set to NULL.
+ */
+
+void
+tpc_pipeline_connect(PGconn ** conns, const char *const *conninfos, int n,
+		     int timeout_ms)
+{
+    PostgresPollingStatusType *polling;
+    bool       *reset;
+    TimestampTz deadline;
+    int		pending = 0;
+    bool	latched = false;
+
+    polling = palloc(sizeof(PostgresPollingStatusType) * n);
+    reset = palloc0(sizeof(bool) * n);
+    for (int i = 0; i < n; ++i) {
+	polling[i] = PGRES_POLLING_OK;
+	if (conns[i] && PQstatus(conns[i]) == CONNECTION_OK)
+	    continue;
+	if (conns[i]) {
+	    reset[i] = true;
+	    if (!PQresetStart(conns[i]))
+		polling[i] = PGRES_POLLING_FAILED;
+	} else {
+	    conns[i] = PQconnectStart(conninfos[i]);
+	    if (!conns[i] || PQstatus(conns[i]) == CONNECTION_BAD)
+		polling[i] = PGRES_POLLING_FAILED;
+	}
+	if (PGRES_POLLING_FAILED == polling[i])
+	    continue;
+	/* libpq wants to be polled once the socket is writable first. */
+	polling[i] = PGRES_POLLING_WRITING;
+	++pending;
+    }
+
+    deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout_ms);
+    while (pending > 0) {
+	WaitEventSet *set;
+	WaitEvent  *events;
+	TimestampTz now = GetCurrentTimestamp();
+	long	    secs;
+	int	    usecs;
+	int	    nevents;
+
+	if (now >= deadline)
+	    break;
+	TimestampDifference(now, deadline, &secs, &usecs);
+
+#if PG_VERSION_NUM >= 170000
+	set = CreateWaitEventSet(NULL, pending + 2);
+#else
+	set = CreateWaitEventSet(CurrentMemoryContext, pending + 2);
+#endif
+	events = palloc(sizeof(WaitEvent) * (pending + 1));
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+			  NULL, NULL);
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	for (int i = 0; i < n; ++i) {
+	    if (PGRES_POLLING_READING == polling[i])
+		AddWaitEventToSet(set, WL_SOCKET_READABLE, PQsocket(conns[i]),
+				  NULL, &conns[i]);
+	    else if (PGRES_POLLING_WRITING == polling[i])
+		AddWaitEventToSet(set, WL_SOCKET_WRITEABLE, PQsocket(conns[i]),
+				  NULL, &conns[i]);
+	}
+
+	nevents = WaitEventSetWait(set, secs * 1000L + usecs / 1000 + 1,
+				   events, pending + 1,
+				   tpc_wait_event(TPC_WAIT_REMOTE_CONNECT));
+	for (int j = 0; j < nevents; ++j) {
+	    int		i;
+
+	    if (events[j].events & WL_LATCH_SET) {
+		ResetLatch(MyLatch);
+		latched = true;
+	    }
+	    if (!(events[j].events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE)))
+		continue;
+	    i = (PGconn **) events[j].user_data - conns;
+	    polling[i] = reset[i] ? PQresetPoll(conns[i])
+		: PQconnectPoll(conns[i]);
+	    if (PGRES_POLLING_OK == polling[i]
+		|| PGRES_POLLING_FAILED == polling[i])
+		--pending;
+	}
+	FreeWaitEventSet(set);
+	pfree(events);
+	CHECK_FOR_INTERRUPTS();
+    }
+
+    for (int i = 0; i < n; ++i) {
+	switch (polling[i]) {
+	case PGRES_POLLING_OK:
+	    break;
+	case PGRES_POLLING_FAILED:
+	    ereport(WARNING, (errmsg("could not connect to remote: %s",
+				     conns[i] ? PQerrorMessage(conns[i])
+				     : "out of memory")));
+	    break;
+	default:
+	    ereport(WARNING, (errmsg("timed out connecting to %s",
+				     PQhost(conns[i]))));
+	    PQfinish(conns[i]);
+	    conns[i] = NULL;
+	    break;
+	}
+    }
+    pfree(polling);
+    pfree(reset);
+    if (latched)
+	SetLatch(MyLatch);
+}
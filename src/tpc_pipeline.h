@@ -0,0 +1,47 @@
+#ifndef TPC_PIPELINE_H
+
+#define TPC_PIPELINE_H
+#include <libpq-fe.h>
+#include <postgres.h>
+
+/*
+ * Queues of commands for one connection each, run all at once.  Where libpq
+ * supports pipeline mode every queue goes out in a single pipeline, with a
+ * sync after each command so that one failure does not abort the rest.
+ * Otherwise the commands on each connection are sent one after another.
+ * Either way all connections are worked on concurrently.
+ *
+ * The callback gets the command's result (the first failure if there were
+ * several) or NULL if the command could not be sent or the connection was
+ * lost.  The result is cleared after the callback returns.
+ */
+typedef void (*tpc_pipeline_callback) (PGresult * res, void *arg);
+
+typedef struct tpc_pipeline_cmd {
+    struct tpc_pipeline_cmd *next;
+    char       *query;
+    int		nparams;
+    char      **values;
+    tpc_pipeline_callback callback;
+    void       *arg;
+    PGresult   *res;
+} tpc_pipeline_cmd;
+
+typedef struct tpc_pipeline {
+    PGconn     *conn;
+    tpc_pipeline_cmd *first;
+    tpc_pipeline_cmd *last;
+    tpc_pipeline_cmd *current;	/* oldest command still without its answer */
+    bool	broken;		/* connection state unknown, drop it */
+    struct tpc_pipeline *next;	/* pipelines run together */
+} tpc_pipeline;
+
+extern void tpc_pipeline_init(tpc_pipeline * pipeline, PGconn * conn);
+extern void tpc_pipeline_add(tpc_pipeline * pipeline, const char *query,
+			     int nparams, const char *const *values,
+			     tpc_pipeline_callback callback, void *arg);
+extern void tpc_pipeline_run(tpc_pipeline * head, uint32 wait_event_info);
+extern void tpc_pipeline_connect(PGconn ** conns, const char *const *conninfos,
+				 int n, int timeout_ms);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * tpc_reaper.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file removes the files of finished transaction sets.  Backends used
+ * to unlink their set file at the end of tpc_commit(), while the client
+ * waited, and on some filesystems unlink is slow, especially with many
+ * files in a directory.  Now a backend appends a COMPLETE phase record to
+ * the file, which costs a write but no sync, and queues the file here.
+ * Recovery queues the files of the sets it finishes too.
+ *
+ * The queue is a ring of paths in shared memory, drained by the log writer
+ * a batch at a time whenever it has nothing to write.  A backend wakes it
+ * early once the queue is half full.  After removing a batch the log
+ * writer syncs each directory it removed files from, once, so that a crash
+ * does not bring many of them back.
+ *
+ * A file that is not removed, whether because of a crash or because the
+ * log writer has not got to it yet, does no harm.  Recovery removes a file
+ * that ends with a COMPLETE record without contacting anyone, and any
+ * other file it finds was either queued by recovery itself, with nothing
+ * left prepared, or belongs to a set that is still in doubt.
+ */
+
+#include "tpc_reaper.h"
+#include "tpc_shmem.h"
+#include <unistd.h>
+#include <storage/fd.h>
+#include <storage/shmem.h>
+
+#define REAPER_QUEUE_SIZE 1024
+#define REAPER_BATCH_MAX 128
+
+typedef struct reaper_shared {
+    uint64	head;		/* next file to remove */
+    uint64	tail;		/* next slot to fill */
+    Latch      *latch;		/* the log writer's, while it runs */
+    char	paths[REAPER_QUEUE_SIZE][TPC_LOGPATH_MAX];
+} reaper_shared;
+
+static reaper_shared *shared = NULL;
+
+static void remove_file(const char *path);
+
+Size
+tpc_reaper_shmem_size(void)
+{
+    return sizeof(reaper_shared);
+}
+
+void
+tpc_reaper_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact reaper queue",
+			     tpc_reaper_shmem_size(), &found);
+    if (!found) {
+	shared->head = 0;
+	shared->tail = 0;
+	shared->latch = NULL;
+    }
+}
+
+/*
+ * void tpc_reaper_attach(Latch *latch)
+ *
+ * Tells backends whom to wake when the queue fills up.  The log writer
+ * attaches when it starts and detaches, with NULL, when it exits.
+ */
+
+void
+tpc_reaper_attach(Latch *latch)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_REAPER_LOCK);
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    shared->latch = latch;
+    LWLockRelease(lock);
+}
+
+static void
+remove_file(const char *path)
+{
+    if (unlink(path) != 0 && errno != ENOENT)
+	ereport(WARNING, (errcode_for_file_access(),
+		errmsg("could not remove file \"%s\": %m", path)));
+}
+
+/*
+ * void tpc_reaper_remove(const char *path)
+ *
+ * Queues a finished set file for removal.  If the queue is full, or there
+ * is no log writer to drain it, the file is removed here and now.
+ */
+
+void
+tpc_reaper_remove(const char *path)
+{
+    LWLock     *lock;
+    Latch      *latch = NULL;
+    bool	queued = false;
+
+    if (!shared) {
+	remove_file(path);
+	return;
+    }
+    lock = tpc_shmem_lock(TPC_REAPER_LOCK);
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    if (shared->latch && shared->tail - shared->head < REAPER_QUEUE_SIZE) {
+	strlcpy(shared->paths[shared->tail % REAPER_QUEUE_SIZE], path,
+		TPC_LOGPATH_MAX);
+	shared->tail++;
+	queued = true;
+	if (shared->tail - shared->head == REAPER_QUEUE_SIZE / 2)
+	    latch = shared->latch;
+    }
+    LWLockRelease(lock);
+
+    if (!queued)
+	remove_file(path);
+    else if (latch)
+	SetLatch(latch);
+}
+
+/*
+ * bool tpc_reaper_run(void)
+ *
+ * Removes a batch of queued files and syncs the directories they were in.
+ * Called by the log writer.  Returns whether there was anything to do.
+ */
+
+bool
+tpc_reaper_run(void)
+{
+    LWLock     *lock = tpc_shmem_lock(TPC_REAPER_LOCK);
+    char	paths[REAPER_BATCH_MAX][TPC_LOGPATH_MAX];
+    char	dirs[REAPER_BATCH_MAX][TPC_LOGPATH_MAX];
+    int		n = 0;
+    int		ndirs = 0;
+
+    LWLockAcquire(lock, LW_EXCLUSIVE);
+    while (shared->head != shared->tail && n < REAPER_BATCH_MAX) {
+	memcpy(paths[n++], shared->paths[shared->head % REAPER_QUEUE_SIZE],
+	       TPC_LOGPATH_MAX);
+	shared->head++;
+    }
+    LWLockRelease(lock);
+    if (0 == n)
+	return false;
+
+    for (int i = 0; i < n; ++i) {
+	char	   *slash;
+	int	    j;
+
+	remove_file(paths[i]);
+	slash = strrchr(paths[i], '/');
+	if (!slash)
+	    continue;
+	*slash = '\0';
+	for (j = 0; j < ndirs; ++j) {
+	    if (strcmp(dirs[j], paths[i]) == 0)
+		break;
+	}
+	if (j == ndirs)
+	    strlcpy(dirs[ndirs++], paths[i], TPC_LOGPATH_MAX);
+    }
+    for (int i = 0; i < ndirs; ++i)
+	(void) fsync_fname_ext(dirs[i], true, false, LOG);
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef TPC_REAPER_H
+
+#define TPC_REAPER_H
+#include "tpc_txnset.h"
+#include <storage/latch.h>
+
+/*
+ * Removal of finished set files off the commit path.  Backends and
+ * recovery queue the files in shared memory and the log writer removes
+ * them in batches, syncing each directory once per batch.  Without shared
+ * memory, or with the queue full, files are removed on the spot.
+ */
+
+extern Size tpc_reaper_shmem_size(void);
+extern void tpc_reaper_shmem_startup(void);
+extern void tpc_reaper_attach(Latch *latch);
+extern void tpc_reaper_remove(const char *path);
+extern bool tpc_reaper_run(void);
+
+#endif
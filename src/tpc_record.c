@@ -0,0 +1,257 @@
+/*
+ * tpc_record.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file encodes and decodes the records of transaction set logs.  Set
+ * files used to be text, written with snprintf and read back with fgets
+ * and sscanf.  That capped lines at a fixed length, interpreted a format
+ * string per line, and could not tell a torn or damaged line from a good
+ * one.  Records are now binary, length-prefixed and checksummed; see
+ * tpc_record.h for the layout.
+ *
+ * Readers walk records in place in a buffer.  The stream reader keeps a
+ * fixed buffer per file and refills it as records are consumed, so files
+ * of any length are read without copying records out.
+ *
+ * A record that does not fit in what is left of the input, or whose
+ * checksum fails as the very last record, was torn by a crash while being
+ * written.  Nobody can have acted on it, since it was never synced, so
+ * readers stop there quietly.  Anything else that fails the checks is
+ * corruption.
+ */
+
+#include "tpc_record.h"
+#include <ctype.h>
+
+#define STREAM_BUFSIZE 8192
+
+static const char *const status_labels[] = {"PENDING", "OK", "BAD"};
+
+static pg_crc32c record_crc(const char *data, size_t len);
+static void stream_fill(tpc_record_stream * stream);
+
+static pg_crc32c
+record_crc(const char *data, size_t len)
+{
+    pg_crc32c	crc;
+
+    INIT_CRC32C(crc);
+    COMP_CRC32C(crc, data + sizeof(pg_crc32c), len - sizeof(pg_crc32c));
+    FIN_CRC32C(crc);
+    return crc;
+}
+
+/*
+ * int tpc_record_encode(char *buf, tpc_record_type type, tpc_phase phase,
+ *                       int participant, tpc_status status,
+ *                       const char *prefix, const char *conninfo)
+ *
+ * Builds a record in buf, which must have room for TPC_RECORD_MAX bytes
+ * and be aligned as a tpc_record_buf is, and returns its length.  prefix
+ * and conninfo may be NULL.
+ */
+
+int
+tpc_record_encode(char *buf, tpc_record_type type, tpc_phase phase,
+		  int participant, tpc_status status,
+		  const char *prefix, const char *conninfo)
+{
+    tpc_record *rec = (tpc_record *) buf;
+    size_t	prefix_len = prefix ? strlen(prefix) : 0;
+    size_t	conninfo_len = conninfo ? strlen(conninfo) : 0;
+    size_t	len;
+
+    Assert(prefix_len < NAMEDATALEN);
+    Assert(conninfo_len <= UINT8_MAX);
+    Assert(participant >= 0 && participant <= UINT16_MAX);
+
+    len = TYPEALIGN(TPC_RECORD_ALIGN,
+		    sizeof(tpc_record) + prefix_len + conninfo_len);
+    memset(buf, 0, len);
+    rec->len = (uint16) len;
+    rec->version = TPC_RECORD_VERSION;
+    rec->type = (uint8) type;
+    rec->participant = (uint16) participant;
+    rec->phase = (uint8) phase;
+    rec->status = (uint8) status;
+    rec->prefix_len = (uint8) prefix_len;
+    rec->conninfo_len = (uint8) conninfo_len;
+    memcpy(buf + sizeof(tpc_record), prefix, prefix_len);
+    memcpy(buf + sizeof(tpc_record) + prefix_len, conninfo, conninfo_len);
+    rec->crc = record_crc(buf, len);
+    return (int) len;
+}
+
+/*
+ * void tpc_record_set_segment(char *buf, uint16 segment)
+ * Stamps an encoded record with its journal segment.
+ */
+
+void
+tpc_record_set_segment(char *buf, uint16 segment)
+{
+    tpc_record *rec = (tpc_record *) buf;
+
+    rec->segment = segment;
+    rec->crc = record_crc(buf, rec->len);
+}
+
+/*
+ * tpc_record_result tpc_record_parse(const char *data, size_t len,
+ *                                    bool at_end, tpc_record_view *view)
+ *
+ * Checks the record at the start of data, which holds len bytes and must
+ * be aligned to TPC_RECORD_ALIGN, and fills in view.  at_end says that
+ * nothing follows data; otherwise TORN just means more input is needed.
+ * A header of zeroes, as in space that was never written, ends the input.
+ */
+
+tpc_record_result
+tpc_record_parse(const char *data, size_t len, bool at_end,
+		 tpc_record_view * view)
+{
+    const tpc_record *rec = (const tpc_record *) data;
+
+    if (0 == len)
+	return TPC_RECORD_END;
+    if (len < sizeof(tpc_record))
+	return TPC_RECORD_TORN;
+    if (0 == rec->len && 0 == rec->version)
+	return TPC_RECORD_END;
+    if (rec->version != TPC_RECORD_VERSION
+	|| rec->len < sizeof(tpc_record) || rec->len > TPC_RECORD_MAX
+	|| rec->len % TPC_RECORD_ALIGN != 0)
+	return TPC_RECORD_CORRUPT;
+    if (rec->len > len)
+	return TPC_RECORD_TORN;
+    if (!EQ_CRC32C(rec->crc, record_crc(data, rec->len)))
+	return (at_end && rec->len == len) ? TPC_RECORD_TORN
+	    : TPC_RECORD_CORRUPT;
+    if (rec->type < TPC_REC_PHASE || rec->type > TPC_REC_ACTION
+	|| sizeof(tpc_record) + rec->prefix_len + rec->conninfo_len > rec->len)
+	return TPC_RECORD_CORRUPT;
+
+    view->rec = rec;
+    view->prefix = data + sizeof(tpc_record);
+    view->conninfo = view->prefix + rec->prefix_len;
+    return TPC_RECORD_OK;
+}
+
+/*
+ * tpc_record_stream *tpc_record_stream_open(FILE *file)
+ *
+ * Starts reading records from file, in the current memory context.  The
+ * file stays the caller's to close.
+ */
+
+tpc_record_stream *
+tpc_record_stream_open(FILE *file)
+{
+    tpc_record_stream *stream;
+
+    stream = palloc(sizeof(tpc_record_stream));
+    stream->buf = palloc(STREAM_BUFSIZE);
+    stream->file = file;
+    stream->start = 0;
+    stream->end = 0;
+    stream->eof = false;
+    return stream;
+}
+
+void
+tpc_record_stream_close(tpc_record_stream * stream)
+{
+    pfree(stream->buf);
+    pfree(stream);
+}
+
+/*
+ * static void stream_fill(tpc_record_stream *stream)
+ * Moves what is left to the front of the buffer and reads more after it.
+ */
+
+static void
+stream_fill(tpc_record_stream * stream)
+{
+    size_t	n;
+
+    if (stream->start > 0) {
+	memmove(stream->buf, stream->buf + stream->start,
+		stream->end - stream->start);
+	stream->end -= stream->start;
+	stream->start = 0;
+    }
+    n = fread(stream->buf + stream->end, 1, STREAM_BUFSIZE - stream->end,
+	      stream->file);
+    if (ferror(stream->file))
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not read transaction set log: %m")));
+    if (0 == n)
+	stream->eof = true;
+    stream->end += n;
+}
+
+/*
+ * bool tpc_record_stream_is_text(tpc_record_stream *stream)
+ *
+ * Tells whether the file is in the old text format.  Only meaningful
+ * before the first record is read.  A binary record has its version in
+ * its seventh byte, which is never printable.
+ */
+
+bool
+tpc_record_stream_is_text(tpc_record_stream * stream)
+{
+    if (stream->end == stream->start && !stream->eof)
+	stream_fill(stream);
+    if (stream->end == stream->start)
+	return false;
+    for (size_t i = stream->start; i < stream->end && i < stream->start + 8;
+	 ++i) {
+	unsigned char c = (unsigned char) stream->buf[i];
+
+	if (!isprint(c) && !isspace(c))
+	    return false;
+    }
+    return true;
+}
+
+/*
+ * tpc_record_result tpc_record_stream_next(tpc_record_stream *stream,
+ *                                          tpc_record_view *view)
+ *
+ * Returns the next record in view, reading more of the file as needed.
+ */
+
+tpc_record_result
+tpc_record_stream_next(tpc_record_stream * stream, tpc_record_view * view)
+{
+    for (;;) {
+	size_t	    avail = stream->end - stream->start;
+	tpc_record_result result;
+
+	result = tpc_record_parse(stream->buf + stream->start, avail,
+				  stream->eof, view);
+	if (TPC_RECORD_OK == result) {
+	    stream->start += view->rec->len;
+	    return result;
+	}
+	if (stream->eof || TPC_RECORD_CORRUPT == result
+	    || (TPC_RECORD_END == result && avail > 0))
+	    return result;
+	stream_fill(stream);
+    }
+}
+
+/*
+ * const char *tpc_status_get_label(tpc_status status)
+ * Returns the label for a participant status, as the text format had it.
+ */
+
+const char *
+tpc_status_get_label(tpc_status status)
+{
+    if ((int) status < 0 || status > TPC_STATUS_BAD)
+	return "UNKNOWN";
+    return status_labels[status];
+}
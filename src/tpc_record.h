@@ -0,0 +1,112 @@
+#ifndef TPC_RECORD_H
+
+#define TPC_RECORD_H
+#include <postgres.h>
+#include <stdio.h>
+#include <port/pg_crc32c.h>
+#include "tpc_phase.h"
+
+/*
+ * The binary record format shared by set files, the journal and WAL.
+ *
+ * Every record starts with a tpc_record header and is padded to a multiple
+ * of TPC_RECORD_ALIGN, so that headers can be read in place from a buffer
+ * holding consecutive records.  The CRC-32C covers everything after the
+ * crc field, padding included.  Like WAL, records are in the byte order of
+ * the machine that wrote them.
+ *
+ * A PHASE record marks the set as having entered a phase.  A PARTICIPANT
+ * record gives a participant its id within the file along with its
+ * conninfo; ACTION records then refer to the participant by id alone.
+ *
+ * Records may carry the prefix of their set.  PHASE records always do, and
+ * in the journal, where sets are interleaved, every record does.  Journal
+ * records also carry the low bits of the number of the segment they were
+ * written to, so that what a recycled segment held before can be told from
+ * what was written to it since.
+ *
+ * Version 0 was a text format, one line per record, which the readers
+ * still recognize.
+ */
+
+#define TPC_RECORD_VERSION 1
+#define TPC_RECORD_ALIGN 4
+#define TPC_RECORD_MAX \
+    TYPEALIGN(TPC_RECORD_ALIGN, sizeof(tpc_record) + NAMEDATALEN + 256)
+
+typedef enum {
+    TPC_REC_PHASE = 1,
+    TPC_REC_PARTICIPANT,
+    TPC_REC_ACTION
+}	    tpc_record_type;
+
+/* What we know of a participant. */
+typedef enum {
+    TPC_STATUS_PENDING,
+    TPC_STATUS_OK,
+    TPC_STATUS_BAD
+}	    tpc_status;
+
+typedef struct tpc_record {
+    pg_crc32c	crc;		/* of the rest of the record */
+    uint16	len;		/* whole record, padding included */
+    uint8	version;
+    uint8	type;		/* tpc_record_type */
+    uint16	participant;	/* id, for PARTICIPANT and ACTION */
+    uint8	phase;		/* tpc_phase */
+    uint8	status;		/* tpc_status */
+    uint8	prefix_len;	/* bytes of set prefix after the header */
+    uint8	conninfo_len;	/* bytes of conninfo after the prefix */
+    uint16	segment;	/* journal segment, low bits; 0 elsewhere */
+}	    tpc_record;
+
+/*
+ * Room for one record, aligned for its header.  Records are built in place
+ * through a tpc_record pointer, so a plain char array will not do.
+ */
+typedef union tpc_record_buf {
+    tpc_record	hdr;
+    char	data[TPC_RECORD_MAX];
+}	    tpc_record_buf;
+
+/*
+ * A record as returned by the readers.  The pointers are into the reader's
+ * buffer and are valid until the next record is read; prefix and conninfo
+ * are not NUL terminated.
+ */
+typedef struct tpc_record_view {
+    const tpc_record *rec;
+    const char *prefix;
+    const char *conninfo;
+}	    tpc_record_view;
+
+typedef enum {
+    TPC_RECORD_OK,
+    TPC_RECORD_END,		/* no more records */
+    TPC_RECORD_TORN,		/* the last record was only partly written */
+    TPC_RECORD_CORRUPT		/* a record failed its checks */
+}	    tpc_record_result;
+
+/* Reads records from a file through a fixed buffer. */
+typedef struct tpc_record_stream {
+    FILE       *file;
+    size_t	start;		/* first byte not yet returned */
+    size_t	end;		/* end of the data in buf */
+    bool	eof;
+    char       *buf;		/* MAXALIGNed, for reading headers in place */
+}	    tpc_record_stream;
+
+extern int  tpc_record_encode(char *buf, tpc_record_type type, tpc_phase phase,
+			      int participant, tpc_status status,
+			      const char *prefix, const char *conninfo);
+extern void tpc_record_set_segment(char *buf, uint16 segment);
+extern tpc_record_result tpc_record_parse(const char *data, size_t len,
+					  bool at_end, tpc_record_view * view);
+extern tpc_record_stream *tpc_record_stream_open(FILE *file);
+extern void tpc_record_stream_close(tpc_record_stream * stream);
+extern bool tpc_record_stream_is_text(tpc_record_stream * stream);
+extern tpc_record_result tpc_record_stream_next(tpc_record_stream * stream,
+						tpc_record_view * view);
+extern const char *tpc_status_get_label(tpc_status status);
+
+#endif
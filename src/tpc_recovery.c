@@ -0,0 +1,659 @@
+/*
+ * tpc_recovery.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file finishes transaction sets that were left behind, whether by a
+ * crash or because a participant could not be reached in phase two.
+ *
+ * Earlier versions did this one participant at a time: look the gid up in
+ * pg_prepared_xacts, then send COMMIT or ROLLBACK PREPARED, two round trips
+ * per participant per pass.  After a crash with thousands of sets in doubt
+ * that adds up.  Instead we load every set we were given, group the
+ * participants by remote, and on each pass ask every remote once which of
+ * its gids are still prepared.  The answers are resolved in a single
+ * pipeline per remote, with all remotes worked on at once, so a pass costs
+ * about two round trips however many sets there are.
+ *
+ * Connections to all the remotes in a pass are opened at once, with
+ * pg_globalxact.recovery_connect_timeout as the deadline, and the pass goes
+ * ahead with whichever remotes answered.  An unreachable remote therefore
+ * holds up a pass by one timeout at most, and is then left to its backoff.
+ *
+ * Remotes are grouped by connection string, which includes the database,
+ * since a prepared transaction can only be finished from its own database.
+ *
+ * Files of sets still in progress, according to the registry, are left
+ * alone.
+ *
+ * A gid that is not prepared any more needs nothing: it was either never
+ * prepared or already finished.  A set is done, and its file queued for
+ * removal, once none of its gids are prepared anywhere.  A file whose last
+ * phase is COMPLETE belongs to a set that finished normally and was only
+ * waiting to be removed, so it is queued again without contacting anyone.
+ *
+ * A round of recovery gives up after pg_globalxact.recovery_round_timeout,
+ * so that a remote that is gone for good cannot hold a worker forever.
+ * The sets it could not finish stay on disk for the next round.
+ *
+ * Remotes are retried on their own schedule, kept in a heap ordered by the
+ * time of the next attempt.  A remote that made progress is tried again
+ * straight away; one that could not be reached or resolved nothing backs
+ * off exponentially, with jitter so that workers recovering sets on the
+ * same remote do not all come back at once.  In between we sleep on our
+ * latch, so a shutdown is noticed at once, and anyone who sets the latch
+ * (the launcher does when it is asked for more recovery) has every remote
+ * retried right away.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_recovery.h"
+#include "tpc_pipeline.h"
+#include "tpc_logwriter.h"
+#include "tpc_launcher.h"
+#include "tpc_registry.h"
+#include "tpc_reaper.h"
+#include "tpc_wait.h"
+#include <unistd.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <lib/pairingheap.h>
+#include <lib/stringinfo.h>
+#include <storage/fd.h>
+#include <storage/latch.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include <utils/timestamp.h>
+#if PG_VERSION_NUM >= 150000
+#include <common/pg_prng.h>
+#endif
+
+/* Bounds of the delay between attempts on a remote, in milliseconds. */
+#define RETRY_MIN_MS 1000
+#define RETRY_MAX_MS 300000
+
+static const char prepared_query[] =
+    "SELECT gid FROM pg_prepared_xacts WHERE gid = ANY($1::text[])";
+
+typedef struct recovery_set {
+    tpc_txnset *set;
+    bool	rollback;
+    int		outstanding;	/* participants still in doubt */
+} recovery_set;
+
+typedef struct recovery_item {
+    struct recovery_item *next;
+    recovery_set *rset;
+    bool	found;		/* still prepared on the remote */
+    bool	resolved;
+} recovery_item;
+
+typedef struct recovery_host {
+    char	conninfo[TPC_CONNINFO_MAX];	/* hash key */
+    PGconn     *conn;
+    tpc_pipeline pipeline;
+    recovery_item *items;	/* participants still in doubt here */
+    bool	checked;	/* the last check answered */
+    int		failures;	/* attempts in a row without progress */
+    TimestampTz next_attempt;
+    pairingheap_node node;	/* in the retry schedule */
+    struct recovery_host *next;
+    struct recovery_host *next_due;
+} recovery_host;
+
+static HTAB *host_table = NULL;
+static recovery_host *hosts = NULL;
+
+static void add_item(recovery_set * rset, tpc_txn * txn);
+static char *gid_array(recovery_host * host);
+static void check_prepared(PGresult * res, void *arg);
+static void check_resolved(PGresult * res, void *arg);
+static void run_pipelines(tpc_pipeline * head);
+static void recovery_pass(recovery_host * due);
+static int	host_cmp(const pairingheap_node * a, const pairingheap_node * b,
+		     void *arg);
+static void schedule_host(recovery_host * host, int resolved, TimestampTz now);
+static void finish_set(recovery_set * rset);
+
+/*
+ * static void add_item(recovery_set *rset, tpc_txn *txn)
+ * Files a participant of a set under its remote.
+ */
+
+static void
+add_item(recovery_set * rset, tpc_txn * txn)
+{
+    recovery_host *host;
+    recovery_item *item = palloc0(sizeof(recovery_item));
+    bool	found;
+
+    host = hash_search(host_table, txn->conninfo, HASH_ENTER, &found);
+    if (!found) {
+	host->conn = tpc_conn_take(txn->conninfo);
+	host->items = NULL;
+	host->failures = 0;
+	host->next_attempt = 0;
+	host->next = hosts;
+	hosts = host;
+    }
+    item->rset = rset;
+    item->next = host->items;
+    host->items = item;
+    rset->outstanding++;
+}
+
+/*
+ * static char *gid_array(recovery_host *host)
+ * Returns the gids in doubt on a remote as a text[] literal.
+ */
+
+static char *
+gid_array(recovery_host * host)
+{
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '{');
+    for (recovery_item * item = host->items; item; item = item->next) {
+	if (item != host->items)
+	    appendStringInfoChar(&buf, ',');
+	appendStringInfoChar(&buf, '"');
+	for (const char *c = item->rset->set->txn_prefix; *c; ++c) {
+	    if ('"' == *c || '\\' == *c)
+		appendStringInfoChar(&buf, '\\');
+	    appendStringInfoChar(&buf, *c);
+	}
+	appendStringInfoChar(&buf, '"');
+    }
+    appendStringInfoChar(&buf, '}');
+    return buf.data;
+}
+
+/*
+ * static void check_prepared(PGresult *res, void *arg)
+ * Notes which of a remote's gids are still prepared.
+ */
+
+static void
+check_prepared(PGresult * res, void *arg)
+{
+    recovery_host *host = (recovery_host *) arg;
+    HTAB       *gids;
+    HASHCTL	ctl;
+
+    if (!res || PQresultStatus(res) != PGRES_TUPLES_OK) {
+	ereport(WARNING, (errmsg("could not check prepared transactions "
+				 "on %s: %s", PQhost(host->conn),
+				 PQerrorMessage(host->conn))));
+	return;
+    }
+    host->checked = true;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = NAMEDATALEN;
+    ctl.entrysize = NAMEDATALEN;
+    ctl.hcxt = CurrentMemoryContext;
+#if PG_VERSION_NUM >= 140000
+    gids = hash_create("pg_globalxact prepared gids", PQntuples(res) + 1,
+		       &ctl, HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+#else
+    gids = hash_create("pg_globalxact prepared gids", PQntuples(res) + 1,
+		       &ctl, HASH_ELEM | HASH_CONTEXT);
+#endif
+    for (int i = 0; i < PQntuples(res); ++i)
+	hash_search(gids, PQgetvalue(res, i, 0), HASH_ENTER, NULL);
+    for (recovery_item * item = host->items; item; item = item->next)
+	item->found = (NULL != hash_search(gids, item->rset->set->txn_prefix,
+					   HASH_FIND, NULL));
+    hash_destroy(gids);
+}
+
+static void
+check_resolved(PGresult * res, void *arg)
+{
+    recovery_item *item = (recovery_item *) arg;
+
+    if (res && PQresultStatus(res) == PGRES_COMMAND_OK)
+	item->resolved = true;
+}
+
+/*
+ * static void run_pipelines(tpc_pipeline *head)
+ * Runs the queued commands and drops connections left in an unknown state.
+ */
+
+static void
+run_pipelines(tpc_pipeline * head)
+{
+    if (!head)
+	return;
+    tpc_pipeline_run(head, tpc_wait_event(TPC_WAIT_REMOTE_RESOLVE));
+    for (recovery_host * host = hosts; host; host = host->next) {
+	if (host->conn && host->pipeline.broken) {
+	    PQfinish(host->conn);
+	    host->conn = NULL;
+	}
+    }
+}
+
+/*
+ * static void recovery_pass(recovery_host *due)
+ *
+ * Asks every remote in the due list which of its participants are still
+ * prepared, then commits or rolls back those that are.  Each remote is then
+ * given the time of its next attempt.
+ */
+
+static void
+recovery_pass(recovery_host * due)
+{
+    tpc_pipeline *head = NULL;
+    TimestampTz now;
+    PGconn    **conns;
+    const char **conninfos;
+    int		n = 0;
+
+    for (recovery_host * host = due; host; host = host->next_due)
+	++n;
+    conns = palloc(sizeof(PGconn *) * n);
+    conninfos = palloc(sizeof(char *) * n);
+    n = 0;
+    for (recovery_host * host = due; host; host = host->next_due) {
+	conns[n] = host->conn;
+	conninfos[n++] = host->conninfo;
+    }
+    tpc_pipeline_connect(conns, conninfos, n, tpc_recovery_connect_timeout);
+    n = 0;
+    for (recovery_host * host = due; host; host = host->next_due)
+	host->conn = conns[n++];
+
+    for (recovery_host * host = due; host; host = host->next_due) {
+	const char *param;
+
+	host->checked = false;
+	if (!host->conn || PQstatus(host->conn) != CONNECTION_OK)
+	    continue;
+	tpc_pipeline_init(&host->pipeline, host->conn);
+	param = gid_array(host);
+	tpc_pipeline_add(&host->pipeline, prepared_query, 1, &param,
+			 check_prepared, host);
+	host->pipeline.next = head;
+	head = &host->pipeline;
+    }
+    run_pipelines(head);
+
+    head = NULL;
+    for (recovery_host * host = due; host; host = host->next_due) {
+	if (!host->checked)
+	    continue;
+	tpc_pipeline_init(&host->pipeline, host->conn);
+	for (recovery_item * item = host->items; item; item = item->next) {
+	    char	query[128];
+
+	    if (!item->found) {
+		item->resolved = true;
+		continue;
+	    }
+	    tpc_txnsetfile_phase_two_query(item->rset->rollback ? ROLLBACK : COMMIT,
+					   item->rset->set->txn_prefix,
+					   query, sizeof(query));
+	    tpc_pipeline_add(&host->pipeline, query, 0, NULL,
+			     check_resolved, item);
+	}
+	if (host->pipeline.first) {
+	    host->pipeline.next = head;
+	    head = &host->pipeline;
+	}
+    }
+    run_pipelines(head);
+
+    now = GetCurrentTimestamp();
+    for (recovery_host * host = due; host; host = host->next_due) {
+	recovery_item **link = &host->items;
+	int	    resolved = 0;
+
+	while (*link) {
+	    recovery_item *item = *link;
+
+	    if (!item->resolved) {
+		link = &item->next;
+		continue;
+	    }
+	    *link = item->next;
+	    ++resolved;
+	    if (0 == --item->rset->outstanding)
+		finish_set(item->rset);
+	}
+	schedule_host(host, resolved, now);
+    }
+}
+
+/*
+ * static int host_cmp(const pairingheap_node *a, const pairingheap_node *b,
+ *                     void *arg)
+ * Puts the remote due first at the top of the (max-)heap.
+ */
+
+static int
+host_cmp(const pairingheap_node * a, const pairingheap_node * b, void *arg)
+{
+    const recovery_host *ha = pairingheap_const_container(recovery_host, node, a);
+    const recovery_host *hb = pairingheap_const_container(recovery_host, node, b);
+
+    if (ha->next_attempt < hb->next_attempt)
+	return 1;
+    if (ha->next_attempt > hb->next_attempt)
+	return -1;
+    return 0;
+}
+
+/*
+ * static void schedule_host(recovery_host *host, int resolved, TimestampTz now)
+ *
+ * Sets the time of the next attempt on a remote.  Progress means the remote
+ * is healthy and is tried again at once.  Otherwise the delay doubles with
+ * each failure, up to RETRY_MAX_MS, and is then cut by a random amount of
+ * up to half.
+ */
+
+static void
+schedule_host(recovery_host * host, int resolved, TimestampTz now)
+{
+    double	delay = RETRY_MIN_MS;
+    double	jitter;
+
+    if (resolved > 0) {
+	host->failures = 0;
+	host->next_attempt = now;
+	return;
+    }
+    host->failures++;
+    for (int i = 1; i < host->failures && delay < RETRY_MAX_MS; ++i)
+	delay *= 2;
+    delay = Min(delay, RETRY_MAX_MS);
+#if PG_VERSION_NUM >= 150000
+    jitter = pg_prng_double(&pg_global_prng_state);
+#else
+    jitter = (double) random() / MAX_RANDOM_VALUE;
+#endif
+    delay -= delay * jitter / 2;
+    host->next_attempt = TimestampTzPlusMilliseconds(now, (int64) delay);
+    ereport(LOG, (errmsg("no progress recovering global transactions on %s, "
+			 "retrying in %d ms",
+			 host->conn ? PQhost(host->conn) : "remote",
+			 (int) delay)));
+}
+
+/*
+ * static void finish_set(recovery_set *rset)
+ * Queues the file of a set with nothing left in doubt for removal.
+ */
+
+static void
+finish_set(recovery_set * rset)
+{
+    tpc_reaper_remove(rset->set->logpath);
+    ereport(LOG, (errmsg("recovered global transaction %s",
+			 rset->set->txn_prefix)));
+}
+
+/*
+ * int tpc_recover_files(char **paths, int n)
+ *
+ * Recovers the sets in the given files, and keeps retrying each remote on
+ * its schedule until every one of them is finished or
+ * pg_globalxact.recovery_round_timeout has passed.  Returns how many sets
+ * were left unfinished; their files stay for a later round.
+ */
+
+int
+tpc_recover_files(char **paths, int n)
+{
+    HASHCTL	ctl;
+    MemoryContext pass_context;
+    MemoryContext old_context;
+    pairingheap *schedule;
+    recovery_set *sets;
+    TimestampTz deadline;
+    int		unresolved = 0;
+
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.keysize = TPC_CONNINFO_MAX;
+    ctl.entrysize = sizeof(recovery_host);
+#if PG_VERSION_NUM >= 140000
+    host_table = hash_create("pg_globalxact recovery remotes", 16, &ctl,
+			     HASH_ELEM | HASH_STRINGS);
+#else
+    host_table = hash_create("pg_globalxact recovery remotes", 16, &ctl,
+			     HASH_ELEM);
+#endif
+    hosts = NULL;
+    sets = palloc0(sizeof(recovery_set) * (n + 1));
+
+    for (int i = 0; i < n; ++i) {
+	recovery_set *rset = &sets[i];
+
+	const char *name = strrchr(paths[i], '/');
+
+	/* Someone else may have finished it already. */
+	if (access(paths[i], F_OK) != 0)
+	    continue;
+	/* Or it is not abandoned at all. */
+	if (tpc_registry_contains(name ? name + 1 : paths[i])) {
+	    ereport(LOG, (errmsg("global transaction %s is still in progress, "
+				 "not recovering it", name ? name + 1 : paths[i])));
+	    continue;
+	}
+	rset->set = tpc_txnset_from_file(paths[i]);
+	if (!rset->set)
+	    continue;
+	/* Finished, and only waiting to be removed. */
+	if (COMPLETE == rset->set->tpc_phase) {
+	    tpc_reaper_remove(paths[i]);
+	    continue;
+	}
+	rset->rollback = (rset->set->tpc_phase != COMMIT);
+	for (tpc_txn * txn = rset->set->head; txn; txn = txn->next)
+	    add_item(rset, txn);
+	if (0 == rset->outstanding)
+	    finish_set(rset);
+    }
+
+    schedule = pairingheap_allocate(host_cmp, NULL);
+    for (recovery_host * host = hosts; host; host = host->next)
+	pairingheap_add(schedule, &host->node);
+
+    pass_context = AllocSetContextCreate(CurrentMemoryContext,
+					 "pg_globalxact recovery pass",
+					 ALLOCSET_DEFAULT_SIZES);
+    deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+					   tpc_recovery_round_timeout);
+    while (!pairingheap_is_empty(schedule)) {
+	TimestampTz now = GetCurrentTimestamp();
+	recovery_host *due = NULL;
+	recovery_host *first;
+	long	    secs;
+	int	    usecs;
+	int	    rc;
+
+	if (now >= deadline)
+	    break;
+	while (!pairingheap_is_empty(schedule)) {
+	    first = pairingheap_container(recovery_host, node,
+					  pairingheap_first(schedule));
+	    if (first->next_attempt > now)
+		break;
+	    pairingheap_remove_first(schedule);
+	    first->next_due = due;
+	    due = first;
+	}
+	if (due) {
+	    old_context = MemoryContextSwitchTo(pass_context);
+	    recovery_pass(due);
+	    MemoryContextSwitchTo(old_context);
+	    MemoryContextReset(pass_context);
+	    for (recovery_host * host = due; host; host = host->next_due) {
+		if (host->items)
+		    pairingheap_add(schedule, &host->node);
+	    }
+	    continue;
+	}
+
+	TimestampDifference(now, Min(first->next_attempt, deadline),
+			    &secs, &usecs);
+	rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+		       secs * 1000L + usecs / 1000 + 1, PG_WAIT_EXTENSION);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+
+	/* Woken up: try everything again now. */
+	if (rc & WL_LATCH_SET) {
+	    pairingheap_reset(schedule);
+	    for (recovery_host * host = hosts; host; host = host->next) {
+		if (!host->items)
+		    continue;
+		host->next_attempt = 0;
+		pairingheap_add(schedule, &host->node);
+	    }
+	}
+    }
+    MemoryContextDelete(pass_context);
+    pairingheap_free(schedule);
+
+    /* Healthy connections go back to the cache for the next batch. */
+    for (recovery_host * host = hosts; host; host = host->next) {
+	if (host->conn && PQstatus(host->conn) == CONNECTION_OK)
+	    tpc_conn_keep(host->conninfo, host->conn);
+	else if (host->conn)
+	    PQfinish(host->conn);
+    }
+    hash_destroy(host_table);
+    host_table = NULL;
+    hosts = NULL;
+
+    for (int i = 0; i < n; ++i) {
+	if (sets[i].set && sets[i].outstanding > 0)
+	    ++unresolved;
+    }
+    if (unresolved > 0)
+	ereport(LOG, (errmsg("leaving %d global transactions in doubt for a "
+			     "later round of recovery", unresolved)));
+    pfree(sets);
+    return unresolved;
+}
+
+/*
+ * static int list_into(const char *dirpath, bool shards, char ***paths,
+ *                      int n, int *max)
+ *
+ * Appends the set files in one directory to *paths, which holds n paths
+ * and has room for *max, growing it as needed, and returns the new count.
+ * With shards the shard directories are appended too, with a trailing
+ * slash, rather than skipped.
+ */
+
+static int
+list_into(const char *dirpath, bool shards, char ***paths, int n, int *max)
+{
+    DIR	       *dir;
+    struct dirent *de;
+
+    dir = AllocateDir(dirpath);
+    if (!dir && errno == ENOENT)
+	return n;
+    while ((de = ReadDir(dir, dirpath)) != NULL) {
+	bool	    shard = tpc_txnsetfile_is_shard(dirpath, de->d_name);
+
+	if ('.' == de->d_name[0] || strcmp(de->d_name, TPC_JOURNAL_NAME) == 0
+	    || (shard && !shards))
+	    continue;
+	if (n == *max) {
+	    *max *= 2;
+	    *paths = repalloc(*paths, sizeof(char *) * *max);
+	}
+	(*paths)[n++] = psprintf(shard ? "%s/%s/" : "%s/%s", dirpath,
+				 de->d_name);
+    }
+    FreeDir(dir);
+    return n;
+}
+
+/*
+ * int tpc_recovery_list_dir(char ***paths)
+ *
+ * Lists the set files in TPC_LOGDIR and its shards, palloc'd, and returns
+ * how many there are.
+ */
+
+int
+tpc_recovery_list_dir(char ***paths)
+{
+    int		n = 0;
+    int		max = 64;
+
+    *paths = NULL;
+    if (access(TPC_LOGDIR, F_OK) != 0)
+	return 0;
+
+    *paths = palloc(sizeof(char *) * max);
+    n = list_into(TPC_LOGDIR, false, paths, n, &max);
+    for (int i = 0; i < TPC_LOGDIR_SHARDS; ++i) {
+	char	    shard[MAXPGPATH];
+
+	tpc_txnsetfile_shard_dir(i, shard, sizeof(shard), false);
+	n = list_into(shard, false, paths, n, &max);
+    }
+    return n;
+}
+
+/*
+ * int tpc_recovery_list_shards(char ***paths)
+ *
+ * Lists the work of a scan of TPC_LOGDIR without reading the shards:  the
+ * set files left directly in TPC_LOGDIR by versions before shards, then
+ * the shard directories, each with a trailing slash.  Whoever recovers a
+ * shard lists it with tpc_recovery_list_shard, so a scan is spread over
+ * the recovery workers.
+ */
+
+int
+tpc_recovery_list_shards(char ***paths)
+{
+    int		max = 64;
+
+    *paths = NULL;
+    if (access(TPC_LOGDIR, F_OK) != 0)
+	return 0;
+
+    *paths = palloc(sizeof(char *) * max);
+    return list_into(TPC_LOGDIR, true, paths, 0, &max);
+}
+
+/*
+ * int tpc_recovery_list_shard(const char *dirpath, char ***paths)
+ * Lists the set files in one shard directory, as tpc_recovery_list_dir.
+ */
+
+int
+tpc_recovery_list_shard(const char *dirpath, char ***paths)
+{
+    int		max = 64;
+
+    *paths = palloc(sizeof(char *) * max);
+    return list_into(dirpath, false, paths, 0, &max);
+}
+
+/*
+ * void tpc_recover_dir(void)
+ * Recovers every set file in TPC_LOGDIR.
+ */
+
+void
+tpc_recover_dir(void)
+{
+    char      **paths;
+    int		n = tpc_recovery_list_dir(&paths);
+
+    if (n > 0)
+	(void) tpc_recover_files(paths, n);
+}
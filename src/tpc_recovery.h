@@ -0,0 +1,18 @@
+#ifndef TPC_RECOVERY_H
+
+#define TPC_RECOVERY_H
+#include "tpc_txnset.h"
+
+/*
+ * Recovery of transaction sets left behind in TPC_LOGDIR.  Sets are
+ * recovered together: their participants are grouped by remote, and each
+ * remote is asked about all of its in-doubt transactions at once.
+ */
+
+extern int	tpc_recover_files(char **paths, int n);
+extern int	tpc_recovery_list_dir(char ***paths);
+extern int	tpc_recovery_list_shards(char ***paths);
+extern int	tpc_recovery_list_shard(const char *dirpath, char ***paths);
+extern void tpc_recover_dir(void);
+
+#endif
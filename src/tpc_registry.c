@@ -0,0 +1,388 @@
+/*
+ * tpc_registry.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file keeps the registry of global transactions in progress.  Before
+ * it existed the only trace of a set in progress was a local variable in
+ * its backend and, once it prepared, a file on disk.  Monitoring meant
+ * parsing files, and recovery could not tell a set in progress from one
+ * that had been abandoned.
+ *
+ * The registry is a fixed array of slots in shared memory, sized by
+ * pg_globalxact.max_global_transactions.  A backend claims a free slot
+ * with a compare-and-swap when it begins a set and gives it up when the
+ * set is finished; a dispatcher finishing the set takes the slot over.
+ * Only the owner ever writes to a slot, so no locks are needed to write
+ * one.  Readers never lock either: each slot carries a change count which
+ * the owner bumps before and after every change, as for PgBackendStatus,
+ * and a reader retries until it sees the same even count on both sides of
+ * its copy.
+ *
+ * A set is registered before its set file can exist, so a file whose set
+ * is not in the registry is known to be abandoned.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_registry.h"
+#include "tpc_shmem.h"
+#include <miscadmin.h>
+#include <port/atomics.h>
+#include <storage/ipc.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/timestamp.h>
+
+typedef struct registry_slot {
+    pg_atomic_uint32 in_use;	/* claimed, whether or not published yet */
+    pg_atomic_uint32 changecount;	/* odd while the owner is writing */
+    int		pid;		/* owner */
+    tpc_phase	phase;
+    int		participants;
+    TimestampTz started;
+    char	prefix[NAMEDATALEN];	/* empty when the slot is free */
+} registry_slot;
+
+typedef struct registry_shared {
+    pg_atomic_uint32 next;	/* where the next search for a slot starts */
+    registry_slot slots[FLEXIBLE_ARRAY_MEMBER];
+} registry_shared;
+
+/* What a reader copies out of a slot. */
+typedef struct registry_entry {
+    int		pid;
+    tpc_phase	phase;
+    int		participants;
+    TimestampTz started;
+    char	prefix[NAMEDATALEN];
+} registry_entry;
+
+int	    tpc_max_global_transactions = 1024;
+
+static registry_shared *shared = NULL;
+static bool exit_hook_registered = false;
+
+static void begin_write(registry_slot * slot);
+static void end_write(registry_slot * slot);
+static bool read_slot(registry_slot * slot, registry_entry * entry);
+static void register_exit_hook(void);
+static void release_owned(int code, Datum arg);
+
+/*
+ * void tpc_registry_init(void)
+ * Defines our GUCs.
+ */
+
+void
+tpc_registry_init(void)
+{
+    DefineCustomIntVariable("pg_globalxact.max_global_transactions",
+			    "Number of global transactions that can be in "
+			    "progress at once.",
+			    NULL,
+			    &tpc_max_global_transactions,
+			    1024, 1, INT_MAX / 2,
+			    PGC_POSTMASTER, 0,
+			    NULL, NULL, NULL);
+}
+
+Size
+tpc_registry_shmem_size(void)
+{
+    return add_size(offsetof(registry_shared, slots),
+		    mul_size(sizeof(registry_slot),
+			     tpc_max_global_transactions));
+}
+
+void
+tpc_registry_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact registry",
+			     tpc_registry_shmem_size(), &found);
+    if (!found) {
+	pg_atomic_init_u32(&shared->next, 0);
+	for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	    registry_slot *slot = &shared->slots[i];
+
+	    pg_atomic_init_u32(&slot->in_use, 0);
+	    pg_atomic_init_u32(&slot->changecount, 0);
+	    slot->pid = 0;
+	    slot->prefix[0] = '\0';
+	}
+    }
+}
+
+static void
+begin_write(registry_slot * slot)
+{
+    pg_atomic_fetch_add_u32(&slot->changecount, 1);
+    pg_write_barrier();
+}
+
+static void
+end_write(registry_slot * slot)
+{
+    pg_write_barrier();
+    pg_atomic_fetch_add_u32(&slot->changecount, 1);
+}
+
+/*
+ * static bool read_slot(registry_slot *slot, registry_entry *entry)
+ *
+ * Copies a consistent view of a slot.  Returns false if the slot holds no
+ * set.
+ */
+
+static bool
+read_slot(registry_slot * slot, registry_entry * entry)
+{
+    for (;;) {
+	uint32	    before;
+	uint32	    after;
+
+	before = pg_atomic_read_u32(&slot->changecount);
+	pg_read_barrier();
+	if (0 == (before & 1)) {
+	    entry->pid = slot->pid;
+	    entry->phase = slot->phase;
+	    entry->participants = slot->participants;
+	    entry->started = slot->started;
+	    memcpy(entry->prefix, slot->prefix, NAMEDATALEN);
+	    pg_read_barrier();
+	    after = pg_atomic_read_u32(&slot->changecount);
+	    if (before == after)
+		break;
+	}
+	CHECK_FOR_INTERRUPTS();
+	pg_spin_delay();
+    }
+    entry->prefix[NAMEDATALEN - 1] = '\0';
+    return entry->prefix[0] != '\0';
+}
+
+static void
+register_exit_hook(void)
+{
+    if (!exit_hook_registered) {
+	before_shmem_exit(release_owned, 0);
+	exit_hook_registered = true;
+    }
+}
+
+/*
+ * static void release_owned(int code, Datum arg)
+ *
+ * Gives up any slot we still own when we exit, so an error on the way out
+ * cannot leave a set looking alive forever.
+ */
+
+static void
+release_owned(int code, Datum arg)
+{
+    for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	registry_slot *slot = &shared->slots[i];
+
+	if (pg_atomic_read_u32(&slot->in_use) && slot->pid == MyProcPid)
+	    tpc_registry_leave(i);
+    }
+}
+
+/*
+ * int tpc_registry_enter(const char *prefix)
+ *
+ * Claims a slot for a new set and returns it, or -1 without shared memory.
+ * Errors out if every slot is taken.
+ */
+
+int
+tpc_registry_enter(const char *prefix)
+{
+    uint32	start;
+
+    if (!shared)
+	return -1;
+    register_exit_hook();
+
+    start = pg_atomic_fetch_add_u32(&shared->next, 1);
+    for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	int	    n = (start + i) % tpc_max_global_transactions;
+	registry_slot *slot = &shared->slots[n];
+	uint32	    expected = 0;
+
+	if (!pg_atomic_compare_exchange_u32(&slot->in_use, &expected, 1))
+	    continue;
+	begin_write(slot);
+	slot->pid = MyProcPid;
+	slot->phase = BEGIN;
+	slot->participants = 0;
+	slot->started = GetCurrentTimestamp();
+	strlcpy(slot->prefix, prefix, NAMEDATALEN);
+	end_write(slot);
+	return n;
+    }
+    ereport(ERROR, (errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+	    errmsg("too many global transactions in progress"),
+	    errhint("Increase pg_globalxact.max_global_transactions.")));
+    return -1;			/* keep compiler quiet */
+}
+
+/*
+ * void tpc_registry_publish(tpc_txnset *txnset)
+ * Updates the phase and participant count of a registered set.
+ */
+
+void
+tpc_registry_publish(tpc_txnset * txnset)
+{
+    registry_slot *slot;
+    int		participants = 0;
+
+    if (txnset->registry_slot < 0)
+	return;
+    for (tpc_txn * txn = txnset->head; txn; txn = txn->next)
+	++participants;
+    slot = &shared->slots[txnset->registry_slot];
+    begin_write(slot);
+    slot->phase = txnset->tpc_phase;
+    slot->participants = participants;
+    end_write(slot);
+}
+
+/*
+ * void tpc_registry_hand_off(int slot)
+ *
+ * Gives up ownership of a slot without freeing it, for a set another
+ * process is going to finish.  The set stays in the registry until the new
+ * owner adopts it and then leaves.
+ */
+
+void
+tpc_registry_hand_off(int slot)
+{
+    registry_slot *s;
+
+    if (slot < 0 || !shared)
+	return;
+    s = &shared->slots[slot];
+    begin_write(s);
+    s->pid = 0;
+    end_write(s);
+}
+
+/*
+ * void tpc_registry_adopt(int slot)
+ * Takes over a slot handed to us along with its set.
+ */
+
+void
+tpc_registry_adopt(int slot)
+{
+    registry_slot *s;
+
+    if (slot < 0 || !shared)
+	return;
+    register_exit_hook();
+    s = &shared->slots[slot];
+    begin_write(s);
+    s->pid = MyProcPid;
+    end_write(s);
+}
+
+/*
+ * void tpc_registry_leave(int slot)
+ * Frees a slot once its set is finished or left for recovery.
+ */
+
+void
+tpc_registry_leave(int slot)
+{
+    registry_slot *s;
+
+    if (slot < 0 || !shared)
+	return;
+    s = &shared->slots[slot];
+    begin_write(s);
+    s->pid = 0;
+    s->prefix[0] = '\0';
+    end_write(s);
+    pg_atomic_write_u32(&s->in_use, 0);
+}
+
+/*
+ * bool tpc_registry_contains(const char *prefix)
+ * Tells whether the set with the given prefix is in progress.
+ */
+
+bool
+tpc_registry_contains(const char *prefix)
+{
+    if (!shared)
+	return false;
+    for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	registry_entry entry;
+
+	if (read_slot(&shared->slots[i], &entry)
+	    && strcmp(entry.prefix, prefix) == 0)
+	    return true;
+    }
+    return false;
+}
+
+/*
+ * List *tpc_registry_prefixes(void)
+ * Returns a palloc'd copy of the prefix of every set in progress.
+ */
+
+List *
+tpc_registry_prefixes(void)
+{
+    List       *prefixes = NIL;
+
+    if (!shared)
+	return NIL;
+    for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	registry_entry entry;
+
+	if (read_slot(&shared->slots[i], &entry))
+	    prefixes = lappend(prefixes, pstrdup(entry.prefix));
+    }
+    return prefixes;
+}
+
+/* SQL function listing the global transactions in progress, one row per
+ * set:  prefix, phase, participants, start time and the pid of the
+ * process working on it.  Reading the registry takes no locks.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_global_transactions);
+Datum
+tpc_global_transactions(PG_FUNCTION_ARGS)
+{
+    TupleDesc	tupdesc;
+    Tuplestorestate *tupstore;
+
+    if (!shared)
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("tpc_global_transactions() requires pg_globalxact in "
+		       "shared_preload_libraries")));
+    tupstore = tpc_materialize(fcinfo, &tupdesc);
+
+    for (int i = 0; i < tpc_max_global_transactions; ++i) {
+	registry_entry entry;
+	Datum	    values[5];
+	bool	    nulls[5] = {false, false, false, false, false};
+
+	if (!read_slot(&shared->slots[i], &entry))
+	    continue;
+	values[0] = CStringGetTextDatum(entry.prefix);
+	values[1] = CStringGetTextDatum(tpc_phase_get_label(entry.phase));
+	values[2] = Int32GetDatum(entry.participants);
+	values[3] = TimestampTzGetDatum(entry.started);
+	values[4] = Int32GetDatum(entry.pid);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+    }
+    return (Datum) 0;
+}
@@ -0,0 +1,31 @@
+#ifndef TPC_REGISTRY_H
+
+#define TPC_REGISTRY_H
+#include "tpc_txnset.h"
+#include <nodes/pg_list.h>
+
+/*
+ * The registry of global transactions in progress, in shared memory.  Each
+ * set has a slot from tpc_begin until it is finished, whether by its own
+ * backend or by a dispatcher.  Slots are written only by their owner and
+ * read without locks, so monitoring and recovery can look at every set in
+ * progress without touching the filesystem or slowing anyone down.
+ *
+ * Without shared memory nothing is registered and every set looks
+ * abandoned to recovery.
+ */
+
+extern int  tpc_max_global_transactions;
+
+extern void tpc_registry_init(void);
+extern Size tpc_registry_shmem_size(void);
+extern void tpc_registry_shmem_startup(void);
+extern int  tpc_registry_enter(const char *prefix);
+extern void tpc_registry_publish(tpc_txnset * txnset);
+extern void tpc_registry_hand_off(int slot);
+extern void tpc_registry_adopt(int slot);
+extern void tpc_registry_leave(int slot);
+extern bool tpc_registry_contains(const char *prefix);
+extern List *tpc_registry_prefixes(void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * tpc_remote.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file handles sending commands to every participant of a transaction
+ * set at once.  Rather than running a blocking PQexec against each
+ * connection in turn, commands are sent everywhere with PQsendQuery and the
+ * results are collected as the sockets become readable.  The time taken is
+ * therefore that of the slowest participant rather than the sum of all of
+ * them.
+ *
+ * Nothing in here throws errors for remote failures, since phase two runs
+ * in places (transaction abort) where errors are not allowed.  Failures are
+ * instead reported to the caller's callback with whatever result we have.
+ */
+
+#include "tpc_remote.h"
+#include "tpc_stats.h"
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <storage/latch.h>
+
+static bool finish_txn(tpc_txn * txn, tpc_remote_callback callback, void *arg);
+static bool consume_txn(tpc_txn * txn, tpc_remote_callback callback, void *arg);
+static bool discard_result(tpc_txn * txn, PGresult * res, void *arg);
+static void cancel_busy(tpc_txn * head);
+
+/*
+ * static bool finish_txn(tpc_txn *txn, tpc_remote_callback callback, void *arg)
+ *
+ * Marks the participant as no longer busy and hands its result to the
+ * callback.  Returns whatever the callback returned.
+ */
+
+static bool
+finish_txn(tpc_txn * txn, tpc_remote_callback callback, void *arg)
+{
+    PGresult   *res = txn->res;
+    bool	keep_going;
+
+    txn->busy = false;
+    txn->res = NULL;
+    keep_going = callback(txn, res, arg);
+    if (res)
+	PQclear(res);
+    return keep_going;
+}
+
+/*
+ * static bool consume_txn(tpc_txn *txn, tpc_remote_callback callback, void *arg)
+ *
+ * Collects whatever results are available on the participant without
+ * blocking.  Once the command has produced all of its results the
+ * participant is finished.  If several results come back we keep the first
+ * failure, otherwise the last one.
+ *
+ * A command that could not be sent leaves libpq idle, so it finishes here
+ * straight away with no result.
+ */
+
+static bool
+consume_txn(tpc_txn * txn, tpc_remote_callback callback, void *arg)
+{
+    while (!PQisBusy(txn->conn)) {
+	PGresult   *res = PQgetResult(txn->conn);
+
+	if (NULL == res)
+	    return finish_txn(txn, callback, arg);
+	if (txn->res && PQresultStatus(txn->res) != PGRES_COMMAND_OK
+	    && PQresultStatus(txn->res) != PGRES_TUPLES_OK) {
+	    PQclear(res);
+	    continue;
+	}
+	if (txn->res)
+	    PQclear(txn->res);
+	txn->res = res;
+    }
+    return true;
+}
+
+/*
+ * Callback used once a wait has been abandoned.
+ */
+
+static bool
+discard_result(tpc_txn * txn, PGresult * res, void *arg)
+{
+    return true;
+}
+
+/*
+ * static void cancel_busy(tpc_txn *head)
+ *
+ * Sends a cancel request for every command still in flight.  The commands
+ * still need their results read afterwards.
+ */
+
+static void
+cancel_busy(tpc_txn * head)
+{
+    for (tpc_txn * curr = head; curr; curr = curr->next) {
+	PGcancel   *cancel;
+	char	    errbuf[256];
+
+	if (!curr->busy)
+	    continue;
+	cancel = PQgetCancel(curr->conn);
+	if (cancel) {
+	    if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+		ereport(WARNING, (errmsg("could not cancel command on %s: %s",
+					 PQhost(curr->conn), errbuf)));
+	    PQfreeCancel(cancel);
+	}
+    }
+}
+
+/*
+ * void tpc_remote_send(tpc_txn *txn, const char *query)
+ *
+ * Starts query on the participant without waiting for it.  The result is
+ * picked up by tpc_remote_wait.  Callbacks may use this to send a follow-up
+ * command to the participant they were called for.
+ */
+
+void
+tpc_remote_send(tpc_txn * txn, const char *query)
+{
+    txn->busy = true;
+    txn->res = NULL;
+    tpc_stats_start(&txn->sent);
+    PQsendQuery(txn->conn, query);
+}
+
+/*
+ * void tpc_remote_wait(tpc_txn *head, tpc_remote_callback callback, void *arg,
+ *                      uint32 wait_event_info)
+ *
+ * Waits until no participant in the list starting at head has a command in
+ * flight.  The callback is run for each participant in the order the
+ * answers arrive.  If the callback returns false, whatever is still in
+ * flight is cancelled and its results thrown away.  While we wait the
+ * backend reports wait_event_info (see tpc_wait_event).
+ */
+
+void
+tpc_remote_wait(tpc_txn * head, tpc_remote_callback callback, void *arg,
+		uint32 wait_event_info)
+{
+    for (;;) {
+	WaitEventSet *set;
+	WaitEvent  *events;
+	int	    busy = 0;
+	int	    nevents;
+
+	for (tpc_txn * curr = head; curr; curr = curr->next) {
+	    if (curr->busy && !consume_txn(curr, callback, arg)) {
+		cancel_busy(head);
+		callback = discard_result;
+	    }
+	    if (curr->busy)
+		++busy;
+	}
+	if (0 == busy)
+	    return;
+
+#if PG_VERSION_NUM >= 170000
+	set = CreateWaitEventSet(NULL, busy + 1);
+#else
+	set = CreateWaitEventSet(CurrentMemoryContext, busy + 1);
+#endif
+	events = palloc(sizeof(WaitEvent) * busy);
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+			  NULL, NULL);
+	for (tpc_txn * curr = head; curr; curr = curr->next) {
+	    if (curr->busy)
+		AddWaitEventToSet(set, WL_SOCKET_READABLE, PQsocket(curr->conn),
+				  NULL, curr);
+	}
+
+	nevents = WaitEventSetWait(set, -1, events, busy, wait_event_info);
+	for (int i = 0; i < nevents; ++i) {
+	    tpc_txn    *txn = (tpc_txn *) events[i].user_data;
+
+	    if (!(events[i].events & WL_SOCKET_READABLE))
+		continue;
+
+	    /* A lost connection finishes the participant with no result. */
+	    if (!PQconsumeInput(txn->conn)) {
+		if (txn->res)
+		    PQclear(txn->res);
+		txn->res = NULL;
+		if (!finish_txn(txn, callback, arg)) {
+		    cancel_busy(head);
+		    callback = discard_result;
+		}
+	    }
+	}
+	FreeWaitEventSet(set);
+	pfree(events);
+    }
+}
+
+/*
+ * void tpc_remote_fanout(tpc_txn *head, const char *query,
+ *                        tpc_remote_callback callback, void *arg,
+ *                        uint32 wait_event_info)
+ *
+ * Sends the same query to every participant in the list starting at head
+ * and waits for all of them.
+ */
+
+void
+tpc_remote_fanout(tpc_txn * head, const char *query,
+		  tpc_remote_callback callback, void *arg, uint32 wait_event_info)
+{
+    for (tpc_txn * curr = head; curr; curr = curr->next)
+	tpc_remote_send(curr, query);
+    tpc_remote_wait(head, callback, arg, wait_event_info);
+}
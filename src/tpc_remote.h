@@ -0,0 +1,22 @@
+#ifndef TPC_REMOTE_H
+
+#define TPC_REMOTE_H
+#include "tpc_txnset.h"
+
+/*
+ * Called once for every participant when its command has finished.  res is
+ * the result of the command, or NULL if the command could not be sent or the
+ * connection was lost.  The result is cleared after the callback returns.
+ *
+ * Returning false abandons the wait: every participant still busy gets a
+ * cancel request and its result is discarded.
+ */
+typedef bool (*tpc_remote_callback) (tpc_txn * txn, PGresult * res, void *arg);
+
+extern void tpc_remote_send(tpc_txn * txn, const char *query);
+extern void tpc_remote_wait(tpc_txn * head, tpc_remote_callback callback,
+			    void *arg, uint32 wait_event_info);
+extern void tpc_remote_fanout(tpc_txn * head, const char *query,
+			      tpc_remote_callback callback, void *arg,
+			      uint32 wait_event_info);
+#endif
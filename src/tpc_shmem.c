@@ -0,0 +1,121 @@
+/*
+ * tpc_shmem.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file installs the shared memory hooks for the extension.  It does
+ * not own any shared state itself; it asks each module how much it needs
+ * and tells it when to initialize.
+ *
+ * None of this happens unless we are in shared_preload_libraries.  Callers
+ * that need shared memory should check tpc_shmem_available() and error out
+ * politely otherwise.
+ */
+
+#include "tpc_shmem.h"
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/shmem.h>
+#include "tpc_logwriter.h"
+#include "tpc_dispatch.h"
+#include "tpc_launcher.h"
+#include "tpc_registry.h"
+#include "tpc_reaper.h"
+#include "tpc_stats.h"
+
+static const char tranche_name[] = "pg_globalxact";
+
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static LWLockPadded *locks = NULL;
+
+static void tpc_shmem_request(void);
+static void tpc_shmem_startup(void);
+
+/*
+ * static void tpc_shmem_request(void)
+ * Reserves space and locks for every module.
+ */
+
+static void
+tpc_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook)
+	prev_shmem_request_hook();
+#endif
+    RequestAddinShmemSpace(tpc_logwriter_shmem_size());
+    RequestAddinShmemSpace(tpc_dispatch_shmem_size());
+    RequestAddinShmemSpace(tpc_launcher_shmem_size());
+    RequestAddinShmemSpace(tpc_registry_shmem_size());
+    RequestAddinShmemSpace(tpc_reaper_shmem_size());
+    RequestAddinShmemSpace(tpc_stats_shmem_size());
+    RequestNamedLWLockTranche(tranche_name, TPC_NUM_LWLOCKS);
+}
+
+/*
+ * static void tpc_shmem_startup(void)
+ * Attaches to (or creates) the shared state of every module.
+ */
+
+static void
+tpc_shmem_startup(void)
+{
+    if (prev_shmem_startup_hook)
+	prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    locks = GetNamedLWLockTranche(tranche_name);
+    tpc_logwriter_shmem_startup();
+    tpc_dispatch_shmem_startup();
+    tpc_launcher_shmem_startup();
+    tpc_registry_shmem_startup();
+    tpc_reaper_shmem_startup();
+    tpc_stats_shmem_startup();
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * void tpc_shmem_init(void)
+ * Installs the hooks.  Called from _PG_init.
+ */
+
+void
+tpc_shmem_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+	return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = tpc_shmem_request;
+#else
+    tpc_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = tpc_shmem_startup;
+}
+
+/*
+ * bool tpc_shmem_available(void)
+ * Returns true if our shared memory has been set up.
+ */
+
+bool
+tpc_shmem_available(void)
+{
+    return locks != NULL;
+}
+
+/*
+ * LWLock *tpc_shmem_lock(tpc_lwlock lock)
+ * Returns one of the locks from our tranche.
+ */
+
+LWLock *
+tpc_shmem_lock(tpc_lwlock lock)
+{
+    Assert(locks != NULL);
+    return &locks[lock].lock;
+}
@@ -0,0 +1,26 @@
+#ifndef TPC_SHMEM_H
+
+#define TPC_SHMEM_H
+#include <postgres.h>
+#include <storage/lwlock.h>
+
+/*
+ * Shared memory is only available when the library is loaded through
+ * shared_preload_libraries.  Each module that needs some provides a size and
+ * a startup function which are called from the hooks installed here, and
+ * gets its locks from a single named tranche.
+ */
+
+typedef enum {
+    TPC_LOGWRITER_LOCK,
+    TPC_DISPATCH_LOCK,
+    TPC_RECOVERY_LOCK,
+    TPC_REAPER_LOCK,
+    TPC_NUM_LWLOCKS
+}	    tpc_lwlock;
+
+extern void tpc_shmem_init(void);
+extern bool tpc_shmem_available(void);
+extern LWLock *tpc_shmem_lock(tpc_lwlock lock);
+
+#endif
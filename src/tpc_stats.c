@@ -0,0 +1,427 @@
+/*
+ * tpc_stats.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file keeps latency statistics for global transactions, so that a
+ * slow commit can be pinned on the local transaction, the log, or one
+ * particular remote.
+ *
+ * Each statistic is a log-linear histogram of microseconds in shared
+ * memory: exact below 8us, then eight buckets for every power of two, so
+ * any value is known to within 12.5%.  Recording is a few atomic additions
+ * and takes no locks, which is what lets timing stay on in production.
+ * Percentiles are worked out from the buckets when the view is read.
+ *
+ * Remote commands are also kept per remote, in a fixed table of
+ * TPC_STATS_REMOTES entries keyed by the connection string we record for
+ * the participant.  An entry is claimed with a compare-and-swap the first
+ * time a remote is seen and never given back; once the table is full new
+ * remotes only count towards the totals.
+ */
+
+#include "tpc_stats.h"
+#include "tpc_shmem.h"
+#include "tpc_txnsetfile.h"
+#include <port/atomics.h>
+#include <port/pg_bitutils.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+
+#define TPC_STATS_REMOTES 64
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36	/* about 19 hours; anything longer is lumped in */
+#define HIST_BUCKETS (HIST_SUB * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+#define TPC_NUM_REMOTE_STATS (TPC_NUM_STATS - TPC_STAT_FIRST_REMOTE)
+
+/* Remote entry states */
+#define REMOTE_FREE 0
+#define REMOTE_CLAIMED 1	/* name being written */
+#define REMOTE_READY 2
+
+typedef struct stat_hist {
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 errors;
+    pg_atomic_uint64 total_us;
+    pg_atomic_uint64 max_us;
+    pg_atomic_uint64 buckets[HIST_BUCKETS];
+} stat_hist;
+
+typedef struct stat_remote {
+    pg_atomic_uint32 state;
+    char	name[TPC_CONNINFO_MAX];
+    stat_hist	hists[TPC_NUM_REMOTE_STATS];
+} stat_remote;
+
+typedef struct stats_shared {
+    stat_hist	totals[TPC_NUM_STATS];
+    stat_remote remotes[TPC_STATS_REMOTES];
+} stats_shared;
+
+static const char *const stat_labels[TPC_NUM_STATS] = {
+    "prepare",
+    "commit",
+    "one_phase_commit",
+    "rollback",
+    "local_commit",
+    "log_start",
+    "log_sync",
+    "log_complete",
+    "log_incomplete",
+    "remote_probe",
+    "remote_prepare",
+    "remote_commit",
+    "remote_rollback"
+};
+
+bool	    tpc_track_timing = true;
+
+static stats_shared *shared = NULL;
+
+static int	bucket_of(uint64 us);
+static uint64 bucket_upper(int bucket);
+static void hist_add(stat_hist * hist, uint64 us, bool ok);
+static void hist_reset(stat_hist * hist);
+static stat_remote *find_remote(const char *name);
+static void put_hist(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		     tpc_stat stat, const char *remote, stat_hist * hist);
+
+/*
+ * void tpc_stats_init(void)
+ * Defines our GUCs.
+ */
+
+void
+tpc_stats_init(void)
+{
+    DefineCustomBoolVariable("pg_globalxact.track_timing",
+			     "Collects latency statistics for global "
+			     "transactions.",
+			     NULL,
+			     &tpc_track_timing,
+			     true,
+			     PGC_SUSET, 0,
+			     NULL, NULL, NULL);
+}
+
+Size
+tpc_stats_shmem_size(void)
+{
+    return sizeof(stats_shared);
+}
+
+void
+tpc_stats_shmem_startup(void)
+{
+    bool	found;
+
+    shared = ShmemInitStruct("pg_globalxact stats", tpc_stats_shmem_size(),
+			     &found);
+    if (found)
+	return;
+    for (int i = 0; i < TPC_NUM_STATS; ++i) {
+	pg_atomic_init_u64(&shared->totals[i].calls, 0);
+	pg_atomic_init_u64(&shared->totals[i].errors, 0);
+	pg_atomic_init_u64(&shared->totals[i].total_us, 0);
+	pg_atomic_init_u64(&shared->totals[i].max_us, 0);
+	for (int b = 0; b < HIST_BUCKETS; ++b)
+	    pg_atomic_init_u64(&shared->totals[i].buckets[b], 0);
+    }
+    for (int r = 0; r < TPC_STATS_REMOTES; ++r) {
+	stat_remote *remote = &shared->remotes[r];
+
+	pg_atomic_init_u32(&remote->state, REMOTE_FREE);
+	remote->name[0] = '\0';
+	for (int i = 0; i < TPC_NUM_REMOTE_STATS; ++i) {
+	    pg_atomic_init_u64(&remote->hists[i].calls, 0);
+	    pg_atomic_init_u64(&remote->hists[i].errors, 0);
+	    pg_atomic_init_u64(&remote->hists[i].total_us, 0);
+	    pg_atomic_init_u64(&remote->hists[i].max_us, 0);
+	    for (int b = 0; b < HIST_BUCKETS; ++b)
+		pg_atomic_init_u64(&remote->hists[i].buckets[b], 0);
+	}
+    }
+}
+
+/*
+ * static int bucket_of(uint64 us)
+ *
+ * Values below HIST_SUB get a bucket each.  Above that the leading bit
+ * picks a group of HIST_SUB buckets and the next HIST_SUB_BITS bits pick
+ * one within it.
+ */
+
+static int
+bucket_of(uint64 us)
+{
+    int		msb;
+
+    if (us < HIST_SUB)
+	return (int) us;
+    msb = pg_leftmost_one_pos64(us);
+    if (msb >= HIST_MAX_BITS)
+	return HIST_BUCKETS - 1;
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB
+	+ (int) ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * static uint64 bucket_upper(int bucket)
+ * Returns the first value past a bucket.
+ */
+
+static uint64
+bucket_upper(int bucket)
+{
+    int		group = bucket / HIST_SUB;
+
+    if (0 == group)
+	return bucket + 1;
+    return (uint64) (HIST_SUB + bucket % HIST_SUB + 1) << (group - 1);
+}
+
+static void
+hist_add(stat_hist * hist, uint64 us, bool ok)
+{
+    uint64	max = pg_atomic_read_u64(&hist->max_us);
+
+    pg_atomic_fetch_add_u64(&hist->buckets[bucket_of(us)], 1);
+    pg_atomic_fetch_add_u64(&hist->total_us, us);
+    if (!ok)
+	pg_atomic_fetch_add_u64(&hist->errors, 1);
+    while (us > max
+	   && !pg_atomic_compare_exchange_u64(&hist->max_us, &max, us))
+	;
+    /* Last, so a reader never sees more calls than bucket entries. */
+    pg_atomic_fetch_add_u64(&hist->calls, 1);
+}
+
+static void
+hist_reset(stat_hist * hist)
+{
+    pg_atomic_write_u64(&hist->calls, 0);
+    pg_atomic_write_u64(&hist->errors, 0);
+    pg_atomic_write_u64(&hist->total_us, 0);
+    pg_atomic_write_u64(&hist->max_us, 0);
+    for (int b = 0; b < HIST_BUCKETS; ++b)
+	pg_atomic_write_u64(&hist->buckets[b], 0);
+}
+
+/*
+ * void tpc_stats_start(instr_time *start)
+ *
+ * Starts timing a step.  When we are not keeping statistics the start time
+ * is left zero and recording it does nothing.
+ */
+
+void
+tpc_stats_start(instr_time * start)
+{
+    if (tpc_track_timing && shared)
+	INSTR_TIME_SET_CURRENT(*start);
+    else
+	INSTR_TIME_SET_ZERO(*start);
+}
+
+/*
+ * static uint64 elapsed_us(instr_time *start)
+ * Returns the microseconds since start.
+ */
+
+static uint64
+elapsed_us(instr_time * start)
+{
+    instr_time	now;
+
+    INSTR_TIME_SET_CURRENT(now);
+    INSTR_TIME_SUBTRACT(now, *start);
+    return (uint64) INSTR_TIME_GET_MICROSEC(now);
+}
+
+/*
+ * void tpc_stats_record(tpc_stat stat, instr_time *start, bool ok)
+ * Records a step started with tpc_stats_start.  ok is false if it failed.
+ */
+
+void
+tpc_stats_record(tpc_stat stat, instr_time * start, bool ok)
+{
+    if (!shared || INSTR_TIME_IS_ZERO(*start))
+	return;
+    hist_add(&shared->totals[stat], elapsed_us(start), ok);
+}
+
+/*
+ * static stat_remote *find_remote(const char *name)
+ *
+ * Finds the entry for a remote by open addressing, claiming a free one if
+ * the remote has not been seen before.  Returns NULL if the table is full.
+ */
+
+static stat_remote *
+find_remote(const char *name)
+{
+    uint32	hash = 2166136261u;
+
+    for (const char *c = name; *c; ++c)
+	hash = (hash ^ (unsigned char) *c) * 16777619u;
+
+    for (int i = 0; i < TPC_STATS_REMOTES; ++i) {
+	stat_remote *remote = &shared->remotes[(hash + i) % TPC_STATS_REMOTES];
+	uint32	    state = pg_atomic_read_u32(&remote->state);
+
+	if (REMOTE_FREE == state) {
+	    if (pg_atomic_compare_exchange_u32(&remote->state, &state,
+					       REMOTE_CLAIMED)) {
+		strlcpy(remote->name, name, sizeof(remote->name));
+		pg_write_barrier();
+		pg_atomic_write_u32(&remote->state, REMOTE_READY);
+		return remote;
+	    }
+	}
+	/* Someone else is naming it; it could be our remote. */
+	while (REMOTE_CLAIMED == state) {
+	    pg_spin_delay();
+	    state = pg_atomic_read_u32(&remote->state);
+	}
+	pg_read_barrier();
+	if (strcmp(remote->name, name) == 0)
+	    return remote;
+    }
+    return NULL;
+}
+
+/*
+ * void tpc_stats_remote(tpc_stat stat, tpc_txn *txn, bool ok)
+ *
+ * Records a command on a participant, timed from when tpc_remote_send
+ * sent it, both in total and for the remote.
+ */
+
+void
+tpc_stats_remote(tpc_stat stat, tpc_txn * txn, bool ok)
+{
+    char	name[TPC_CONNINFO_MAX];
+    stat_remote *remote;
+    uint64	us;
+
+    if (!shared || INSTR_TIME_IS_ZERO(txn->sent))
+	return;
+    Assert(stat >= TPC_STAT_FIRST_REMOTE);
+    us = elapsed_us(&txn->sent);
+    hist_add(&shared->totals[stat], us, ok);
+
+    tpc_txnsetfile_conninfo(txn, name, sizeof(name));
+    remote = find_remote(name);
+    if (remote)
+	hist_add(&remote->hists[stat - TPC_STAT_FIRST_REMOTE], us, ok);
+}
+
+/*
+ * static void put_hist(Tuplestorestate *tupstore, TupleDesc tupdesc,
+ *                      tpc_stat stat, const char *remote, stat_hist *hist)
+ *
+ * Adds the row for one histogram, if anything has been recorded in it.
+ * Percentiles are reported as the top of the bucket they fall in, but never
+ * above the maximum.
+ */
+
+static void
+put_hist(Tuplestorestate *tupstore, TupleDesc tupdesc, tpc_stat stat,
+	 const char *remote, stat_hist * hist)
+{
+    uint64	buckets[HIST_BUCKETS];
+    uint64	calls = pg_atomic_read_u64(&hist->calls);
+    uint64	max = pg_atomic_read_u64(&hist->max_us);
+    uint64	counted = 0;
+    uint64	seen = 0;
+    double	quantiles[2] = {0.5, 0.99};
+    uint64	results[2] = {max, max};
+    int		q = 0;
+    Datum	values[8];
+    bool	nulls[8] = {false, false, false, false, false, false, false,
+			    false};
+
+    if (0 == calls)
+	return;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+	buckets[b] = pg_atomic_read_u64(&hist->buckets[b]);
+	counted += buckets[b];
+    }
+    for (int b = 0; b < HIST_BUCKETS && q < 2; ++b) {
+	seen += buckets[b];
+	while (q < 2 && seen > 0 && seen >= quantiles[q] * counted) {
+	    results[q] = Min(bucket_upper(b), max);
+	    ++q;
+	}
+    }
+
+    values[0] = CStringGetTextDatum(stat_labels[stat]);
+    if (remote)
+	values[1] = CStringGetTextDatum(remote);
+    else
+	nulls[1] = true;
+    values[2] = Int64GetDatum((int64) calls);
+    values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&hist->errors));
+    values[4] = Float8GetDatum(pg_atomic_read_u64(&hist->total_us)
+			       / 1000.0 / calls);
+    values[5] = Float8GetDatum(results[0] / 1000.0);
+    values[6] = Float8GetDatum(results[1] / 1000.0);
+    values[7] = Float8GetDatum(max / 1000.0);
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/* SQL function listing the latency statistics:  one row per step with
+ * any calls, then one per remote and command.  Times are in milliseconds.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_stats);
+Datum
+tpc_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc	tupdesc;
+    Tuplestorestate *tupstore;
+
+    if (!shared)
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("tpc_stats() requires pg_globalxact in "
+		       "shared_preload_libraries")));
+    tupstore = tpc_materialize(fcinfo, &tupdesc);
+
+    for (int i = 0; i < TPC_NUM_STATS; ++i)
+	put_hist(tupstore, tupdesc, i, NULL, &shared->totals[i]);
+    for (int r = 0; r < TPC_STATS_REMOTES; ++r) {
+	stat_remote *remote = &shared->remotes[r];
+
+	if (pg_atomic_read_u32(&remote->state) != REMOTE_READY)
+	    continue;
+	pg_read_barrier();
+	for (int i = 0; i < TPC_NUM_REMOTE_STATS; ++i)
+	    put_hist(tupstore, tupdesc, TPC_STAT_FIRST_REMOTE + i,
+		     remote->name, &remote->hists[i]);
+    }
+    return (Datum) 0;
+}
+
+/* SQL function clearing the latency statistics.  Remotes keep their
+ * entries.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_stats_reset);
+Datum
+tpc_stats_reset(PG_FUNCTION_ARGS)
+{
+    if (!shared)
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("tpc_stats_reset() requires pg_globalxact in "
+		       "shared_preload_libraries")));
+    for (int i = 0; i < TPC_NUM_STATS; ++i)
+	hist_reset(&shared->totals[i]);
+    for (int r = 0; r < TPC_STATS_REMOTES; ++r)
+	for (int i = 0; i < TPC_NUM_REMOTE_STATS; ++i)
+	    hist_reset(&shared->remotes[r].hists[i]);
+    PG_RETURN_VOID();
+}
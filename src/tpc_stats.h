@@ -0,0 +1,46 @@
+#ifndef TPC_STATS_H
+
+#define TPC_STATS_H
+#include "tpc_txnset.h"
+#include <portability/instr_time.h>
+
+/*
+ * Latency statistics, kept in shared memory as log-linear histograms.  The
+ * first group of statistics covers the steps of a global transaction as a
+ * whole, the second the log, the last the commands sent to each remote,
+ * which are kept per remote as well as in total.
+ *
+ * Timing a step costs two clock reads and a handful of atomic additions,
+ * and nothing at all with pg_globalxact.track_timing off or without shared
+ * memory.
+ */
+
+typedef enum {
+    TPC_STAT_PREPARE,
+    TPC_STAT_COMMIT,
+    TPC_STAT_ONE_PHASE_COMMIT,
+    TPC_STAT_ROLLBACK,
+    TPC_STAT_LOCAL_COMMIT,
+    TPC_STAT_LOG_START,
+    TPC_STAT_LOG_SYNC,
+    TPC_STAT_LOG_COMPLETE,
+    TPC_STAT_LOG_INCOMPLETE,
+    TPC_STAT_REMOTE_PROBE,
+    TPC_STAT_REMOTE_PREPARE,
+    TPC_STAT_REMOTE_COMMIT,
+    TPC_STAT_REMOTE_ROLLBACK,
+    TPC_NUM_STATS
+}	    tpc_stat;
+
+#define TPC_STAT_FIRST_REMOTE TPC_STAT_REMOTE_PROBE
+
+extern bool tpc_track_timing;
+
+extern void tpc_stats_init(void);
+extern Size tpc_stats_shmem_size(void);
+extern void tpc_stats_shmem_startup(void);
+extern void tpc_stats_start(instr_time * start);
+extern void tpc_stats_record(tpc_stat stat, instr_time * start, bool ok);
+extern void tpc_stats_remote(tpc_stat stat, tpc_txn * txn, bool ok);
+
+#endif
@@ -1,12 +1,39 @@
 #include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_registry.h"
+#include "tpc_stats.h"
+#include "tpc_wait.h"
+#include "tpc_xlog.h"
+#include <pgstat.h>
+#include <utils/hsearch.h>
 #include <utils/uuid.h>
 
 #undef foreach
 #define foreach(e, l) for ((e) = (l); (e); (e) = (e)->next)
 
 static void txn_cleanup(XactEvent event, void *arg);
+static void commit_txnset(int elevel);
 static void cleanup(void);
 
+static bool callback_registered = false;
+
+/* Set once a set is finished in PRE_COMMIT, to time the local commit. */
+static instr_time local_commit_start;
+
+/*
+ * Connections kept open for the life of the backend, one per connection
+ * string, so that global transactions and recovery do not pay for
+ * connection setup and TLS handshakes every time.
+ */
+typedef struct tpc_conn_entry {
+	char	conninfo[TPC_CONNINFO_MAX];	/* hash key */
+	PGconn	   *conn;
+} tpc_conn_entry;
+
+static HTAB *conn_cache = NULL;
+
+static tpc_conn_entry *conn_entry(const char *conninfo);
+
 /* 
  * tpc_txnset for local connections is initialized to NULL at first.
  */
@@ -18,6 +45,9 @@ tpc_txnset * txnset = NULL;
  *
  * Registers the txnset with the current global txnset.  If there is no current
  * txnset, then one is created.
+ *
+ * A participant whose conninfo would not fit in its log record is refused
+ * here, long before anything is logged.
  */
 
 void
@@ -25,10 +55,23 @@ tpc_txnset_register(PGconn * conn)
 {
 	/* errors are safe here since the transaction will be aborted */
 	MemoryContext old_context = MemoryContextSwitchTo(CurTransactionContext);
+	char recorded[TPC_CONNINFO_MAX];
 
 	tpc_txn *txn = palloc0(sizeof(tpc_txn));
 	txn->next = NULL;
 	txn->conn = conn;
+	if (tpc_txnsetfile_conninfo(txn, recorded, sizeof(recorded))
+	    >= (int) sizeof(recorded))
+		ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				errmsg("connection string too long to log"),
+				errdetail("The host, port and database of a participant "
+					  "may take at most %d bytes.",
+					  TPC_CONNINFO_MAX - 1)));
+	/* before tpc_begin, so that the abort callback frees its registry slot */
+	if (!callback_registered) {
+		RegisterXactCallback(txn_cleanup, NULL);
+		callback_registered = true;
+	}
 	if (NULL == txnset) {
 		tpc_begin();
 		txnset->head = txn;
@@ -37,10 +80,169 @@ tpc_txnset_register(PGconn * conn)
 		txnset->latest->next = txn;
 		txnset->latest = txn;
 	}
-	RegisterXactCallback(txn_cleanup, NULL);
+	tpc_registry_publish(txnset);
 	MemoryContextSwitchTo(old_context);
 }
 
+/*
+ * PGconn *tpc_txnset_connect(const char *conninfo)
+ *
+ * Returns a cached connection to conninfo with a transaction block open on
+ * it, registered with the current txnset.  Asking for the same connection
+ * string again in the same global transaction returns the same connection.
+ */
+
+PGconn *
+tpc_txnset_connect(const char *conninfo)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+	tpc_txn	   *txn;
+
+	if (txnset) {
+		foreach(txn, txnset->head) {
+			if (txn->conninfo && strcmp(txn->conninfo, conninfo) == 0)
+				return txn->conn;
+		}
+	}
+
+	conn = tpc_conn_get(conninfo);
+	if (PQstatus(conn) != CONNECTION_OK) {
+		char	   *msg = pstrdup(PQerrorMessage(conn));
+
+		tpc_conn_drop(conninfo);
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+				errmsg("could not connect to remote: %s", msg)));
+	}
+	pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_REMOTE_BEGIN));
+	res = PQexec(conn, "BEGIN");
+	pgstat_report_wait_end();
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		char	   *msg = pstrdup(PQerrorMessage(conn));
+
+		PQclear(res);
+		tpc_conn_drop(conninfo);
+		ereport(ERROR, (errcode(ERRCODE_CONNECTION_FAILURE),
+				errmsg("could not begin remote transaction: %s", msg)));
+	}
+	PQclear(res);
+
+	tpc_txnset_register(conn);
+	txnset->latest->conninfo = MemoryContextStrdup(CurTransactionContext,
+						       conninfo);
+	return conn;
+}
+
+/*
+ * static tpc_conn_entry *conn_entry(const char *conninfo)
+ * Finds or makes the cache entry for conninfo.
+ */
+
+static tpc_conn_entry *
+conn_entry(const char *conninfo)
+{
+	tpc_conn_entry *entry;
+	bool		found;
+
+	if (strlen(conninfo) >= TPC_CONNINFO_MAX)
+		ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				errmsg("connection string too long")));
+	if (NULL == conn_cache) {
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = TPC_CONNINFO_MAX;
+		ctl.entrysize = sizeof(tpc_conn_entry);
+#if PG_VERSION_NUM >= 140000
+		conn_cache = hash_create("pg_globalxact connections", 16, &ctl,
+					 HASH_ELEM | HASH_STRINGS);
+#else
+		conn_cache = hash_create("pg_globalxact connections", 16, &ctl,
+					 HASH_ELEM);
+#endif
+	}
+	entry = hash_search(conn_cache, conninfo, HASH_ENTER, &found);
+	if (!found)
+		entry->conn = NULL;
+	return entry;
+}
+
+/*
+ * PGconn *tpc_conn_get(const char *conninfo)
+ *
+ * Returns the cached connection to conninfo, connecting first if there is
+ * none.  A cached connection that the remote has closed, or that was left
+ * in a transaction, is replaced by a new one.  The connection stays owned
+ * by the cache; check PQstatus() before using it.
+ */
+
+PGconn *
+tpc_conn_get(const char *conninfo)
+{
+	tpc_conn_entry *entry = conn_entry(conninfo);
+
+	/* Reading whatever is pending is enough to notice a closed socket. */
+	if (entry->conn
+	    && (!PQconsumeInput(entry->conn)
+		|| PQstatus(entry->conn) != CONNECTION_OK
+		|| PQtransactionStatus(entry->conn) != PQTRANS_IDLE)) {
+		PQfinish(entry->conn);
+		entry->conn = NULL;
+	}
+	if (NULL == entry->conn) {
+		pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_REMOTE_CONNECT));
+		entry->conn = PQconnectdb(conninfo);
+		pgstat_report_wait_end();
+	}
+	return entry->conn;
+}
+
+/*
+ * PGconn *tpc_conn_take(const char *conninfo)
+ *
+ * Takes the cached connection to conninfo, if any, out of the cache.  The
+ * caller owns it from then on and can give it back with tpc_conn_keep().
+ */
+
+PGconn *
+tpc_conn_take(const char *conninfo)
+{
+	tpc_conn_entry *entry = conn_entry(conninfo);
+	PGconn	   *conn = entry->conn;
+
+	hash_search(conn_cache, conninfo, HASH_REMOVE, NULL);
+	return conn;
+}
+
+/*
+ * void tpc_conn_keep(const char *conninfo, PGconn *conn)
+ * Puts a connection in the cache, closing any other one for conninfo.
+ */
+
+void
+tpc_conn_keep(const char *conninfo, PGconn *conn)
+{
+	tpc_conn_entry *entry = conn_entry(conninfo);
+
+	if (entry->conn && entry->conn != conn)
+		PQfinish(entry->conn);
+	entry->conn = conn;
+}
+
+/*
+ * void tpc_conn_drop(const char *conninfo)
+ * Closes and forgets the cached connection to conninfo.
+ */
+
+void
+tpc_conn_drop(const char *conninfo)
+{
+	PGconn	   *conn = tpc_conn_take(conninfo);
+
+	if (conn)
+		PQfinish(conn);
+}
+
 /* 
  * creates a new tpttxn if needed.
  */
@@ -107,15 +309,21 @@ uuid_to_str(pg_uuid_t *uuid)
  * current transaction.  Here we use the transaction memory context for the
  * allocations.
  *
- * The description (txn_prefix) is set to a UUID.
+ * The description (txn_prefix) is set to a UUID.  The set is entered in
+ * the registry of sets in progress before it becomes the current txnset,
+ * so a full registry leaves no half-made set behind.
  */
 
 void
 tpc_begin() {
     MemoryContext old_context = MemoryContextSwitchTo(CurTransactionContext);
-    txnset = (tpc_txnset *) palloc0(sizeof(tpc_txnset));
-    strncpy(txnset->txn_prefix,  uuid_to_str(gen_uuid()), 
-           sizeof(txnset->txn_prefix));
+    tpc_txnset *new_set = (tpc_txnset *) palloc0(sizeof(tpc_txnset));
+
+    strncpy(new_set->txn_prefix,  uuid_to_str(gen_uuid()),
+           sizeof(new_set->txn_prefix));
+    new_set->log = -1;
+    new_set->registry_slot = tpc_registry_enter(new_set->txn_prefix);
+    txnset = new_set;
     MemoryContextSwitchTo(old_context);
 }
 
@@ -124,12 +332,31 @@ tpc_begin() {
  * This is the primary event handler for commit and
  * rollback.  It hides the tpc semantics behind those of
  * the local transactional semantics.
+ *
+ * The callback stays registered for the life of the backend and does
+ * nothing when there is no txnset in the current transaction, apart from
+ * timing the local commit of one that has just finished.
  */
 
 
 static void
 txn_cleanup(XactEvent event, void *arg)
 {
+    if (!INSTR_TIME_IS_ZERO(local_commit_start)
+        && (XACT_EVENT_COMMIT == event || XACT_EVENT_PARALLEL_COMMIT == event
+            || XACT_EVENT_ABORT == event || XACT_EVENT_PARALLEL_ABORT == event)) {
+        tpc_stats_record(TPC_STAT_LOCAL_COMMIT, &local_commit_start,
+                         XACT_EVENT_COMMIT == event
+                         || XACT_EVENT_PARALLEL_COMMIT == event);
+        INSTR_TIME_SET_ZERO(local_commit_start);
+    }
+    if (NULL == txnset) {
+        /* an error may have come between the decision and the file */
+        if (XACT_EVENT_ABORT == event || XACT_EVENT_PARALLEL_ABORT == event)
+            tpc_xlog_release();
+        return;
+    }
+
     switch (event)
     {
         case XACT_EVENT_PREPARE:
@@ -144,18 +371,20 @@ txn_cleanup(XactEvent event, void *arg)
 	     */
             ereport(WARNING,
                     (errmsg("%s", "you are committing a remote transaction implicitly.  This can cause problems.")));
-	   // fall through for cleanup 
+            commit_txnset(WARNING);
+            break;
         case XACT_EVENT_PARALLEL_PRE_COMMIT:
 	    // fall through
         case XACT_EVENT_PRE_COMMIT:
-            tpc_commit();
-            cleanup();
+            commit_txnset(ERROR);
+            tpc_stats_start(&local_commit_start);
             break;
         case XACT_EVENT_PARALLEL_ABORT:
 	    // fall through
         case XACT_EVENT_ABORT:
             tpc_rollback();
             cleanup();
+            tpc_xlog_release();
             break;
         default:
             /* ignore */
@@ -163,21 +392,70 @@ txn_cleanup(XactEvent event, void *arg)
     }
 }
 
+/*
+ * static void commit_txnset(int elevel)
+ *
+ * Runs both phases for the current txnset.  If any participant fails to
+ * prepare, the set has already been rolled back by the time we get here and
+ * we report at elevel, which is ERROR unless the local commit is already
+ * past the point where it could be aborted.
+ *
+ * The same goes for a one-phase commit whose single participant would not
+ * commit.  If the connection was lost during that COMMIT the participant
+ * may have committed after all, so that is reported as unknown rather than
+ * as a rollback.
+ */
+
+static void
+commit_txnset(int elevel)
+{
+    char	prefix[NAMEDATALEN];
+    tpc_phase	result;
+
+    if (tpc_prepare() != PREPARE) {
+        strncpy(prefix, txnset->txn_prefix, sizeof(prefix));
+        cleanup();
+        ereport(elevel, (errcode(ERRCODE_TRANSACTION_ROLLBACK),
+                         errmsg("global transaction %s rolled back", prefix),
+                         errdetail("A participant failed to prepare.")));
+        return;
+    }
+    result = tpc_commit();
+    if (ROLLBACK == result) {
+        strncpy(prefix, txnset->txn_prefix, sizeof(prefix));
+        cleanup();
+        ereport(elevel, (errcode(ERRCODE_TRANSACTION_ROLLBACK),
+                         errmsg("global transaction %s rolled back", prefix),
+                         errdetail("The only participant failed to commit.")));
+        return;
+    }
+    if (INCOMPLETE == result && txnset->one_phase) {
+        strncpy(prefix, txnset->txn_prefix, sizeof(prefix));
+        cleanup();
+        ereport(elevel, (errcode(ERRCODE_TRANSACTION_RESOLUTION_UNKNOWN),
+                         errmsg("outcome of global transaction %s is unknown",
+                                prefix),
+                         errdetail("The connection to the only participant "
+                                   "was lost while it was committing."),
+                         errhint("Check on the participant whether the "
+                                 "transaction committed there.")));
+        return;
+    }
+    cleanup();
+}
+
 /* 
  * static void cleanup()
- * Deregisters the callback.
+ * Forgets the txnset for the current transaction and takes it out of the
+ * registry, unless a dispatcher has taken it over.
  *
  * Earlier versions also closed all connections
- * but that is wasteful.
+ * but that is wasteful.  The callback itself stays registered.
  */
 
 static void
 cleanup(void)
 {
-
-    UnregisterXactCallback(txn_cleanup, NULL);
+    tpc_registry_leave(txnset->registry_slot);
     txnset = NULL;
 }
-
-
-
@@ -7,8 +7,31 @@
 #include "tpc_phase.h"
 #include <access/xact.h>
 #include <funcapi.h>
+#include <portability/instr_time.h>
+#include <storage/fd.h>
 
 #define TPC_LOGPATH_MAX 255
+#define TPC_LOGDIR "extglobalxact"
+
+/* Set files are spread over this many subdirectories of TPC_LOGDIR, named
+ * by two hex digits, so that backends creating and removing files do not
+ * all contend on one directory.  See tpc_txnsetfile_shard().
+ */
+#define TPC_LOGDIR_SHARDS 256
+
+/*
+ * Where transaction set records go.  FILE keeps one file per set in
+ * TPC_LOGDIR.  JOURNAL appends them to a shared, group-committed journal.
+ * WAL logs them through our resource manager.  Both of the latter need
+ * shared_preload_libraries.
+ */
+typedef enum {
+    TPC_LOG_FILE,
+    TPC_LOG_JOURNAL,
+    TPC_LOG_WAL
+}	    tpc_log_method;
+
+extern int tpc_log_method_setting;
 
 /* putting the tpc_txnset struct/typedef here
  * because of the fact that whatever tracks state needs
@@ -23,23 +46,53 @@
  * the results of rollback or commit.  COMPLETE means
  * that the transaction set was completed and cleaned up.
  *
+ * ROLLBACK returned from tpc_commit means that the set was committed in one
+ * phase (pg_globalxact.one_phase_commit) and its only participant rolled
+ * back instead.  INCOMPLETE returned for such a set means that the
+ * connection was lost during the COMMIT, and whether it committed is not
+ * known.
+ *
+ * COMMIT returned from tpc_commit means that the decision is durable and
+ * phase two was handed to a dispatcher (pg_globalxact.async_commit).
+ *
  * INCOMPLETE means that the transaction set left dangling
  * transactions in places that must be externally cleaned up
  * and we don't want to wait around for them on the server.
  *
  * logpath gives you the path to the log file and the log
  * file descriptor will be closed after this point.
+ *
+ * The set file is held open as a virtual file descriptor rather than a
+ * stdio stream, so that however many sets are in progress a backend keeps
+ * no more kernel descriptors open than max_files_per_process allows.
  */
 
 typedef struct tpc_txn {
    PGconn *conn;
    struct tpc_txn *next;
+   char *conninfo;	/* connection string, if loaded from a file */
+   bool prepare_sent;	/* PREPARE TRANSACTION was sent */
+   bool prepared;	/* PREPARE TRANSACTION succeeded */
+   bool probed;		/* we know whether it wrote anything */
+   bool read_only;	/* wrote nothing, committed without 2PC */
+   bool busy;		/* a command is in flight on conn */
+   PGresult *res;	/* result of the command in flight */
+   instr_time sent;	/* when it was sent, for tpc_stats_remote */
+   int log_id;		/* id in the set's log, once written */
 } tpc_txn;
 
 typedef struct tpc_txnset {
     uint	counter;
-    FILE       *log;
+    tpc_log_method log_method;
+    File	log;		/* the open set file, or -1 */
+    off_t	log_off;	/* where the next record goes in it */
+    uint64	log_pos;	/* end of our last journal record */
+    uint64	log_start;	/* where our first journal record went */
+    StringInfo	lines;		/* everything logged so far, for WAL */
+    bool	presumed_abort;	/* nothing logged until the decision */
+    bool	one_phase;	/* one participant, committed without 2PC */
     tpc_phase	tpc_phase;
+    int		registry_slot;	/* our slot in the registry, or -1 */
     tpc_txn    *head;
     tpc_txn    *latest;
     char	logpath[TPC_LOGPATH_MAX];
@@ -52,6 +105,19 @@ extern void tpc_begin(void);
 extern void tpc_register_cnx(PGconn * cnx);
 extern void tpc_process_file(char *fname);
 extern void tpc_txnset_register(PGconn * conn);
+extern PGconn *tpc_txnset_connect(const char *conninfo);
+
+/*
+ * The backend's connection cache, keyed by connection string.  Connections
+ * handed out by tpc_conn_get() stay owned by the cache; tpc_conn_take() and
+ * tpc_conn_keep() move one out of it and back for callers that manage it
+ * themselves for a while.
+ */
+extern PGconn *tpc_conn_get(const char *conninfo);
+extern PGconn *tpc_conn_take(const char *conninfo);
+extern void tpc_conn_keep(const char *conninfo, PGconn * conn);
+extern void tpc_conn_drop(const char *conninfo);
+extern tpc_phase tpc_prepare(void);
 extern tpc_phase tpc_commit(void);
 extern tpc_phase tpc_rollback(void);
 #endif
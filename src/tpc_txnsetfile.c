@@ -15,7 +15,11 @@
  * Currently these are stored in a new folder extglobalexact in the
  * data directory.  While the name is longer than might be strictly
  * necessary, I did not want to preclude something eventually in
- * core PostgreSQL using the same path.
+ * core PostgreSQL using the same path.  Within it each file goes in one
+ * of TPC_LOGDIR_SHARDS subdirectories, chosen by a hash of the set's
+ * prefix, since every global transaction creates and removes a file and
+ * those serialize on the lock of the directory they are in.  Files that
+ * versions before that left directly in extglobalxact are still recovered.
  *
  * In general errors thrown in this file are ERROR_INVALID_TRANSACTION_STATE
  * errors, as they affect the state of the existing global transaction.
@@ -26,78 +30,152 @@
  */
 
 #include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_remote.h"
 #include <libpq-fe.h>
 #include <stdio.h>
 #include <postgres.h>
+#include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <miscadmin.h>
+#include <pgstat.h>
 #include <utils/builtins.h>
+#include <utils/memutils.h>
 #include <postmaster/bgworker.h>
+#include <storage/fd.h>
+#include <utils/guc.h>
+#include "tpc_logwriter.h"
+#include "tpc_dispatch.h"
+#include "tpc_shmem.h"
+#include "tpc_xlog.h"
+#include "tpc_recovery.h"
+#include "tpc_launcher.h"
+#include "tpc_registry.h"
+#include "tpc_stats.h"
+#include "tpc_wait.h"
+#include "tpc_record.h"
+#include "tpc_uring.h"
+#include "tpc_reaper.h"
 
 PG_MODULE_MAGIC;
 
-//PG_FUNCTION_INFO_V1(tpc_txnset_contents);
-static const char phasefmt[] = "phase %s\n";
-static const char actionfmt[] = "%s postgresql://%s:%s/%s %s %s\n";
+void	    _PG_init(void);
+
+static const struct config_enum_entry log_method_options[] = {
+    {"file", TPC_LOG_FILE, false},
+    {"journal", TPC_LOG_JOURNAL, false},
+    {"wal", TPC_LOG_WAL, false},
+    {NULL, 0, false}
+};
+
+int	    tpc_log_method_setting = TPC_LOG_FILE;
+bool	    tpc_presumed_abort_setting = false;
+bool	    tpc_detect_read_only_setting = true;
+bool	    tpc_one_phase_commit_setting = true;
+
 static const char getactionfmt[] = "%s %s %s %s";
-static const char dirpath[] = "extglobalxact";
+static const char conninfofmt[] = "postgresql://%s:%s/%s";
+static const char dirpath[] = TPC_LOGDIR;
 static const char preparefmt[] = "PREPARE TRANSACTION '%s'";
 static const char commitfmt[] = "COMMIT PREPARED '%s'";
 static const char rollbackfmt[] = "ROLLBACK PREPARED '%s'";
-const static char checkfmt[] = "SELECT * FROM pg_prepared_xacts "
-		               "WHERE gid = '%s'";
+static const char probefmt[] = "SELECT txid_current_if_assigned() IS NULL";
 
 static void tpc_register_bgworker(const char *fname);
 
 /*Max length of file line.  Going with 512 becaus connection strings in theory could be up to 255 characters long.
+ * Only the old text format has lines.
  */
 #define LINEBUFFSIZE 512
 
-tpc_txnset *tpc_txnset_from_file(const char *local_globalid);
-void	    tpc_txnsetfile_start(tpc_txnset * txnset, const char *local_globalid);
-void	    tpc_txnsetfile_write_phase(tpc_txnset * txnset, tpc_phase next_phase);
-void	    tpc_txnsetfile_write_action(tpc_txnset * txnset, tpc_txn * txn, const char *status);
-void	    tpc_txnsetfile_complete(tpc_txnset * txnset);
+static void from_text(tpc_txnset * txnset, FILE *file);
+static tpc_txn *add_participant(tpc_txnset * txnset, const char *conninfo,
+				size_t len);
+static void write_record(tpc_txnset * txnset, tpc_record_type type,
+			 tpc_phase phase, tpc_txn * txn, tpc_status status);
+static void file_forget(tpc_txnset * txnset);
+static void journal_forget(tpc_txnset * txnset);
 void        tpc_bgworker(Datum unused);
 void        tpc_process_file(char *fname);
-static void bg_cleanup(tpc_txnset *txnset, bool rollback);
-static bool check_txn(tpc_txnset *txnset, tpc_txn *last, tpc_txn *curr);
+
+/*
+ * void _PG_init(void)
+ * Defines our settings and, when we are preloaded, sets up shared memory
+ * and the log writer.
+ */
+
+void
+_PG_init(void)
+{
+    DefineCustomEnumVariable("pg_globalxact.log_method",
+			     "Where transaction set records are written.",
+			     "file writes one file per transaction set, journal "
+			     "writes a shared group-committed journal, wal "
+			     "writes WAL records.",
+			     &tpc_log_method_setting,
+			     TPC_LOG_FILE,
+			     log_method_options,
+			     PGC_SIGHUP, 0,
+			     NULL, NULL, NULL);
+    DefineCustomBoolVariable("pg_globalxact.presumed_abort",
+			     "Log nothing for a global transaction until it "
+			     "decides to commit.",
+			     NULL,
+			     &tpc_presumed_abort_setting,
+			     false,
+			     PGC_USERSET, 0,
+			     NULL, NULL, NULL);
+    DefineCustomBoolVariable("pg_globalxact.detect_read_only",
+			     "Commit participants that wrote nothing without "
+			     "two-phase commit.",
+			     NULL,
+			     &tpc_detect_read_only_setting,
+			     true,
+			     PGC_USERSET, 0,
+			     NULL, NULL, NULL);
+    DefineCustomBoolVariable("pg_globalxact.one_phase_commit",
+			     "Commit a global transaction with a single "
+			     "participant without two-phase commit.",
+			     "If the connection is lost during that COMMIT, "
+			     "the participant may have committed while the "
+			     "local transaction rolls back.",
+			     &tpc_one_phase_commit_setting,
+			     true,
+			     PGC_USERSET, 0,
+			     NULL, NULL, NULL);
+    tpc_logwriter_init();
+    tpc_uring_init();
+    tpc_dispatch_init();
+    tpc_launcher_init();
+    tpc_registry_init();
+    tpc_stats_init();
+    tpc_shmem_init();
+    tpc_xlog_init();
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("pg_globalxact");
+#else
+    EmitWarningsOnPlaceholders("pg_globalxact");
+#endif
+}
 
 
 /*
- * tpc_txnset *tpc_txnset_from_file(const char *local_globalid)
- * This function takes in the local_globalid of the transaction set
- * and loads the transaction set into memory from the file.  This is
- * used to load the file for the background worker, as well as for
- * administrator commands.
+ * static void from_text(tpc_txnset *txnset, FILE *file)
  *
- * This operates in whatever the memory context is current when the
- * function was called.  This allows it to be called in set returning
- * functions for monitoring distributed transaction state.
+ * Loads a set file written in the old text format, one line per record.
+ * Participant lines carry the set's prefix and their conninfo.
  */
 
-tpc_txnset
-* tpc_txnset_from_file(const char *local_globalid) {
-    tpc_txnset *txnset;
+static void
+from_text(tpc_txnset * txnset, FILE *file)
+{
     char	linebuff[LINEBUFFSIZE];
-    tpc_phase	lastphase;
-    txnset = palloc(sizeof(tpc_txnset));
-    txnset->head = NULL;
-    txnset->latest = NULL;
-
-    strncpy(txnset->logpath, local_globalid, sizeof(txnset->logpath));
-    txnset->log = fopen(txnset->logpath, "r");
+    char	phaselabel[12] = "";
 
-    /* File does not exist or we cannot open it */
-    if (txnset->log == NULL) {
-	int	    err = errno;
-	ereport(ERROR, (errmsg("Manual cleanup may be necessary. "
-		    "Could not open file %s, %s",
-		    txnset->logpath, strerror(err))));
-    }
-    while (fgets(linebuff, sizeof(linebuff), txnset->log)) {
+    while (fgets(linebuff, sizeof(linebuff), file)) {
 	char	    firstword[12];
-	char	    phaselabel[12];
 	char	    connectionstr[255];
 	char	    txnname[NAMEDATALEN];
 	char	    status[64];
@@ -109,14 +187,10 @@ tpc_txnset
 	    /* here we set the phase of the txnset. */
 
 	    sscanf(linebuff, "%s %s", firstword, phaselabel);
-	    lastphase = tpc_phase_from_label(phaselabel);
-	    txnset->tpc_phase = lastphase;
-	    if (INCOMPLETE == lastphase)
-		ereport(WARNING,
-		    (errmsg("Incomplete txnset found.  "
-			    "Entering recovery.")));
+	    txnset->tpc_phase = tpc_phase_from_label(phaselabel);
 	} else {
-	    tpc_txn    *txn = palloc0(sizeof(tpc_txn));
+	    tpc_txn    *txn;
+
 	    sscanf(linebuff, getactionfmt,
 		firstword, connectionstr, txnname, status);
 
@@ -132,417 +206,1617 @@ tpc_txnset
 			    connectionstr, linebuff)));
 		continue;
 	    }
-	    txn->conn= PQconnectdb(connectionstr);
 	    strncpy(txnset->txn_prefix, txnname, sizeof(txnset->txn_prefix));
-	    if (txnset->head) {
-		txnset->latest->next = txn;
-		txnset->latest = txn;
-	    } else {
-		txnset->head = txn;
-		txnset->latest = txn;
-	    }
+	    txn = add_participant(txnset, connectionstr, strlen(connectionstr));
+	    if (txn)
+		txn->log_id = -1;
 	}
     }
-    return txnset;
 }
 
-/* void tpc_txnsetfile_start (tpc_txnset *txnset, const char *local_globalid)
- * initializes a new file, makes sure that directory etc is set up,
- * Only used when starting a global transaction.
+/*
+ * static tpc_txn *add_participant(tpc_txnset *txnset, const char *conninfo,
+ *                                 size_t len)
  *
- * The txnset must already be created, and the local_globalid is a string
- * intended to be unique on the server.
+ * Adds a participant loaded from a file, unless it is already in the set.
+ * Participants are listed again in each phase; they are loaded once.
+ * Returns the new participant, or NULL if it was there already.
  */
 
-void
-tpc_txnsetfile_start(tpc_txnset * txnset, const char *local_globalid)
+static tpc_txn *
+add_participant(tpc_txnset * txnset, const char *conninfo, size_t len)
 {
-    if (access(dirpath, 0)) {
-	mkdir(dirpath, 0700);
-    }
-    if ((strlen(dirpath) + strlen(local_globalid) + 1) >= sizeof(txnset->logpath))
-	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-		errmsg("File path too long.  Path:  %s Localgtxnid: %s",
-		    dirpath, local_globalid)));
-    snprintf(txnset->logpath, sizeof(txnset->logpath),
-	"%s/%s", dirpath, local_globalid);
-    if (access(txnset->logpath, F_OK) != -1)
-	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-		errmsg("file %s already exists", txnset->logpath)));
+    tpc_txn    *txn;
 
-    txnset->log = fopen(txnset->logpath, "w");
-    if (!txnset->log)
-	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-		errmsg("could not create file %s", txnset->logpath)));
+    for (txn = txnset->head; txn; txn = txn->next) {
+	if (strlen(txn->conninfo) == len
+	    && strncmp(txn->conninfo, conninfo, len) == 0)
+	    return NULL;
+    }
+    txn = palloc0(sizeof(tpc_txn));
+    txn->conninfo = pnstrdup(conninfo, len);
+    if (txnset->head)
+	txnset->latest->next = txn;
+    else
+	txnset->head = txn;
+    txnset->latest = txn;
+    return txn;
 }
 
 /*
- * void tpc_txnsetfile_write_phase(tpc_txnset *txnset, tpc_phase phase)
+ * tpc_txnset *tpc_txnset_from_file(const char *local_globalid)
+ * This function takes in the local_globalid of the transaction set
+ * and loads the transaction set into memory from the file.  This is
+ * used to load the file for the background worker, as well as for
+ * administrator commands.
  *
- * Logs the phase state to the txnsetfile.
+ * This operates in whatever the memory context is current when the
+ * function was called.  This allows it to be called in set returning
+ * functions for monitoring distributed transaction state.
+ *
+ * Participants come back with their conninfo only.  Nothing is connected
+ * to, so loading many sets is cheap; whoever needs to talk to the remotes
+ * connects once per remote.
+ *
+ * Records are checked as they are read.  A torn record at the end was
+ * never synced and is ignored; a damaged one anywhere else is an error,
+ * since guessing at the set could commit what should be rolled back.
+ *
+ * Returns NULL if the file is gone, as when the log writer removed it after
+ * the set finished.
  */
 
-void
-tpc_txnsetfile_write_phase(tpc_txnset * txnset, tpc_phase phase)
-{
-    fprintf(txnset->log, phasefmt, tpc_phase_get_label(phase));
+tpc_txnset
+* tpc_txnset_from_file(const char *local_globalid) {
+    tpc_txnset *txnset;
+    tpc_record_stream *stream;
+    tpc_record_view view;
+    tpc_record_result result;
+    FILE       *file;
+
+    txnset = palloc0(sizeof(tpc_txnset));
+    txnset->head = NULL;
+    txnset->latest = NULL;
+    txnset->registry_slot = -1;
+
+    strncpy(txnset->logpath, local_globalid, sizeof(txnset->logpath));
+    file = fopen(txnset->logpath, PG_BINARY_R);
+
+    if (file == NULL && ENOENT == errno) {
+	pfree(txnset);
+	return NULL;
+    }
+    /* We cannot open it */
+    if (file == NULL) {
+	int	    err = errno;
+	ereport(ERROR, (errmsg("Manual cleanup may be necessary. "
+		    "Could not open file %s, %s",
+		    txnset->logpath, strerror(err))));
+    }
+
+    stream = tpc_record_stream_open(file);
+    if (tpc_record_stream_is_text(stream)) {
+	rewind(file);
+	from_text(txnset, file);
+	result = TPC_RECORD_END;
+    } else {
+	while ((result = tpc_record_stream_next(stream, &view)) == TPC_RECORD_OK) {
+	    const tpc_record *rec = view.rec;
+	    tpc_txn    *txn;
+
+	    switch (rec->type) {
+	    case TPC_REC_PHASE:
+		txnset->tpc_phase = (tpc_phase) rec->phase;
+		if (rec->prefix_len > 0)
+		    strlcpy(txnset->txn_prefix, view.prefix,
+			    Min(rec->prefix_len + 1, sizeof(txnset->txn_prefix)));
+		break;
+	    case TPC_REC_PARTICIPANT:
+		txn = add_participant(txnset, view.conninfo, rec->conninfo_len);
+		if (txn)
+		    txn->log_id = rec->participant;
+		break;
+	    default:
+		/* Actions do not matter to recovery. */
+		break;
+	    }
+	}
+    }
+    tpc_record_stream_close(stream);
+    fclose(file);
+
+    if (TPC_RECORD_CORRUPT == result)
+	ereport(ERROR, (errcode(ERRCODE_DATA_CORRUPTED),
+		errmsg("Manual cleanup may be necessary. "
+		       "Corrupt record in file %s", txnset->logpath)));
+    if (TPC_RECORD_TORN == result)
+	ereport(WARNING, (errmsg("ignoring torn record at the end of file %s",
+				 txnset->logpath)));
+    if (INCOMPLETE == txnset->tpc_phase)
+	ereport(WARNING,
+	    (errmsg("Incomplete txnset found.  "
+		    "Entering recovery.")));
+    txnset->log = -1;
+    return txnset;
 }
 
 /*
- * void tpc_txnsetfile_write_action(tpc_txnset *txnset, tpc_phase phase, tpc_txn *txn, const char *status)
+ * int tpc_txnsetfile_shard(const char *prefix)
  *
- * Writes the action, state, etc to the transactionset file.
- *
- * This causes an fsync on the file to make sure everything is recoverable in the event of server failure.
+ * Returns the subdirectory of TPC_LOGDIR that the file of the set with the
+ * given prefix goes in.  The hash is FNV-1a, written out here because the
+ * mapping is on disk and must not change with the server version.
  */
 
-void
-tpc_txnsetfile_write_action(tpc_txnset * txnset, tpc_txn * txn, const char *status)
+int
+tpc_txnsetfile_shard(const char *prefix)
 {
+    uint32	hash = 2166136261u;
 
-    fprintf(txnset->log, actionfmt,
-	tpc_phase_get_label(txnset->tpc_phase),
-	PQhost(txn->conn),
-	PQport(txn->conn),
-	PQdb(txn->conn),
-	txnset->txn_prefix,
-	status);
-    fflush(txnset->log);
+    for (const char *c = prefix; *c; ++c)
+	hash = (hash ^ (unsigned char) *c) * 16777619u;
+    return (int) (hash % TPC_LOGDIR_SHARDS);
 }
 
 /*
- * void tpc_txnsetfile_complete(tpc_txnset *txnset)
+ * void tpc_txnsetfile_shard_dir(int shard, char *buf, size_t len,
+ *                               bool create)
  *
- * Errors if state is not complete
- * Otherwise closes and removes transaction set file
+ * Puts the path of a shard directory in buf.  With create the directory is
+ * made if need be, along with TPC_LOGDIR, and its entry synced.  Each
+ * process remembers the shards it has seen, so this only touches the
+ * filesystem the first time.
  */
+
 void
-tpc_txnsetfile_complete(tpc_txnset * txnset)
+tpc_txnsetfile_shard_dir(int shard, char *buf, size_t len, bool create)
 {
-    if (txnset->tpc_phase != COMPLETE)
-	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-		errmsg("Transaction not compplete!, state is %s", tpc_phase_get_label(txnset->tpc_phase))));
+    static bool known[TPC_LOGDIR_SHARDS];
 
-    fclose(txnset->log);
-    unlink(txnset->logpath);
+    snprintf(buf, len, "%s/%02X", dirpath, shard);
+    if (!create || known[shard])
+	return;
+    if (access(dirpath, F_OK) != 0 && MakePGDirectory(dirpath) != 0
+	&& errno != EEXIST)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not create directory \"%s\": %m", dirpath)));
+    if (access(buf, F_OK) != 0) {
+	if (MakePGDirectory(buf) != 0 && errno != EEXIST)
+	    ereport(ERROR, (errcode_for_file_access(),
+		    errmsg("could not create directory \"%s\": %m", buf)));
+	fsync_fname(dirpath, true);
+    }
+    known[shard] = true;
 }
 
-
-/* SQL FUNCTION SECTION */
-
-/* SQL function for firing off a cleanup worker for a given file.
- *
- * note that there is not currently any protection for race conditions arising
- * from cleaning up a file that is correctly in a prepare state, though this is
- * not hard to avoid.
+/*
+ * bool tpc_txnsetfile_is_shard(const char *dir, const char *name)
  *
+ * Tells whether the entry name of dir is a shard directory.  A set file
+ * left in TPC_LOGDIR by a version before shards can have a two digit name
+ * too, so the entry must also be a directory.
  */
 
-PG_FUNCTION_INFO_V1(tpc_cleanup_txnset);
-Datum
-tpc_cleanup_txnset(PG_FUNCTION_ARGS) {
-    char       *fname = PG_GETARG_CSTRING(0);
-    tpc_register_bgworker(fname);
-    PG_RETURN_VOID();
+bool
+tpc_txnsetfile_is_shard(const char *dir, const char *name)
+{
+    char	path[MAXPGPATH];
+    struct stat st;
+
+    if (strlen(name) != 2 || !isxdigit((unsigned char) name[0])
+	|| !isxdigit((unsigned char) name[1]))
+	return false;
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
-/* SQL function for looking into the transacion set files themselves.
- * This returns a table of
- *   - host
- *   - port
- *   - database
- *   - transaction status
+/* static void start_file(tpc_txnset *txnset, const char *local_globalid)
+ * Creates the transaction set file in its shard and makes sure its
+ * directory entry is durable, since syncing the file alone does not
+ * guarantee that.  If that fails the file is closed and removed again, so
+ * the caller has nothing to clean up after an error.
  */
 
-/* not optimizing this size-wise */
-
-typedef struct info_line {
-    char       *host; int port; char *database; char *status_label;
-} info_line;
+static void
+start_file(tpc_txnset * txnset, const char *local_globalid)
+{
+    char	shard[MAXPGPATH];
+    bool	synced;
 
+    tpc_txnsetfile_shard_dir(tpc_txnsetfile_shard(local_globalid),
+			     shard, sizeof(shard), true);
+    if ((strlen(shard) + strlen(local_globalid) + 1) >= sizeof(txnset->logpath))
+	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+		errmsg("File path too long.  Path:  %s Localgtxnid: %s",
+		    shard, local_globalid)));
+    snprintf(txnset->logpath, sizeof(txnset->logpath),
+	"%s/%s", shard, local_globalid);
 
+    pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_WRITE));
+    txnset->log = PathNameOpenFile(txnset->logpath,
+	O_CREAT | O_EXCL | O_WRONLY | PG_BINARY);
+    pgstat_report_wait_end();
+    if (txnset->log < 0 && EEXIST == errno)
+	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+		errmsg("file %s already exists", txnset->logpath)));
+    if (txnset->log < 0)
+	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+		errmsg("could not create file %s: %m", txnset->logpath)));
+    txnset->log_off = 0;
+    pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_SYNC));
+    synced = (fsync_fname_ext(shard, true, false, LOG) == 0);
+    pgstat_report_wait_end();
+    if (!synced) {
+	int	    save_errno = errno;
+
+	FileClose(txnset->log);
+	txnset->log = -1;
+	unlink(txnset->logpath);
+	errno = save_errno;
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not fsync directory %s: %m", shard)));
+    }
+}
 
+/* void tpc_txnsetfile_start (tpc_txnset *txnset, const char *local_globalid)
+ * initializes a new file, makes sure that directory etc is set up,
+ * Only used when starting a global transaction.
+ *
+ * The txnset must already be created, and the local_globalid is a string
+ * intended to be unique on the server.
+ *
+ * The set is logged with whatever pg_globalxact.log_method is at this
+ * point.  For the journal there is nothing to create; the set is opened by
+ * its first record.  For WAL the lines are collected in memory and logged
+ * whole each time the set is synced.
+ */
 
-/* State so we don't have to keep re-reading the file for each line
- * Using value_per_call mode here.  It is not terribly hard to do it
- * in this case.  Right now this still doesn't work (still needs
- * some of the tuple constructor parts done).  But will be completed
- * soon, after basic test programs are done.
-Datum
-tpc_txnset_contents(PG_FUNCTION_ARGS) {
-    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
-    MemoryContext per_query_ctx;
-    MemoryContext oldcontext;
-    //info_line  return_next;
-    tpc_txnset *txnset_new;
-    char *gtlxid = PG_GETARG_CSTRING(0);
-
-    /* check to see if caller supports us returning a tuplestore */
-    /*
-    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-	ereport(ERROR,
-	    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		errmsg("set-valued function called in context that cannot accept a set")));
-    if (!(rsinfo->allowedModes & SFRM_Materialize))
-	ereport(ERROR,
-	    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-		errmsg("materialize mode required, but it is not allowed in this context")));
-
-    /*
-     * need to set up per statement memory context here for the txnset
-     */
-    /*
-    per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
-
-    oldcontext = MemoryContextSwitchTo(per_query_ctx);
-
-    if (SRF_IS_FIRSTCALL()){
-       // functx = SRF_FIRSTCALL_INIT();
-	txnset_new = palloc0(sizeof(tpc_txnset));
-    	txnset_new = tpc_txnset_from_file(gtlxid);
-	memcpy(txnset, txnset_new, sizeof(&txnset));
+void
+tpc_txnsetfile_start(tpc_txnset * txnset, const char *local_globalid)
+{
+    instr_time	start;
+
+    txnset->log_method = tpc_log_method_setting;
+    txnset->log_pos = 0;
+    txnset->log_start = 0;
+    if ((TPC_LOG_JOURNAL == txnset->log_method && !tpc_shmem_available())
+	|| (TPC_LOG_WAL == txnset->log_method && !tpc_xlog_available()))
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("pg_globalxact.log_method = %s requires pg_globalxact "
+		       "in shared_preload_libraries",
+		       TPC_LOG_WAL == txnset->log_method ? "wal" : "journal")));
+    if (TPC_LOG_FILE != txnset->log_method) {
+	txnset->log = -1;
+	txnset->logpath[0] = '\0';
+	if (TPC_LOG_WAL == txnset->log_method)
+	    txnset->lines = makeStringInfo();
+	return;
     }
-
-    /*
-     * For each transaction we return the tuple structure
-     */
-    //if (
-        // build the tuple and return it
-    //    info_line.host info_line.port info_line.database info_line.status_label;
-    /* Finally, close, and return end */
-    /*MemoryContextSwitchTo(oldcontext);
-    //SRF_RETURN_DONE(per_query_ctx); // not working yet anyway
+    tpc_stats_start(&start);
+    start_file(txnset, local_globalid);
+    tpc_stats_record(TPC_STAT_LOG_START, &start, true);
 }
 
-/* 
- * Rolls back the transaction by name on a connection
- * Writes data to rollback segment of pending transaction log.
+/*
+ * static void write_record(tpc_txnset *txnset, tpc_record_type type,
+ *                          tpc_phase phase, tpc_txn *txn, tpc_status status)
+ *
+ * Writes one record to wherever the set is being logged.  txn is the
+ * participant the record is about, if any.  Journal records carry the
+ * set's prefix, and the first one also counts the set as open.  Nothing
+ * here makes the record durable; see tpc_txnsetfile_sync.
  */
-tpc_phase
-tpc_rollback()
+
+static void
+write_record(tpc_txnset * txnset, tpc_record_type type, tpc_phase phase,
+	     tpc_txn * txn, tpc_status status)
 {
-	bool can_complete = true;
+    tpc_record_buf record;
+    char	conninfo[TPC_CONNINFO_MAX];
+    bool	journal = (TPC_LOG_JOURNAL == txnset->log_method);
+    int		len;
+
+    if (TPC_REC_PARTICIPANT == type)
+	tpc_txnsetfile_conninfo(txn, conninfo, sizeof(conninfo));
+    len = tpc_record_encode(record.data, type, phase, txn ? txn->log_id : 0,
+	status,
+	(journal || TPC_REC_PHASE == type) ? txnset->txn_prefix : NULL,
+	TPC_REC_PARTICIPANT == type ? conninfo : NULL);
+
+    if (journal) {
+	txnset->log_pos = tpc_logwriter_append(record.data, len,
+	    &txnset->log_start, false);
+	return;
+    }
+    if (TPC_LOG_WAL == txnset->log_method) {
+	appendBinaryStringInfo(txnset->lines, record.data, len);
+	return;
+    }
+    errno = 0;
+    if (FileWrite(txnset->log, record.data, len, txnset->log_off,
+		  tpc_wait_event(TPC_WAIT_LOG_WRITE)) != len) {
+	if (0 == errno)
+	    errno = ENOSPC;
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not write file %s: %m", txnset->logpath)));
+    }
+    txnset->log_off += len;
+}
 
-	if (txnset->tpc_phase != PREPARE) {
-		ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-				errmsg("Not in a valid phase of transaction")));
-	}
+/*
+ * void tpc_txnsetfile_reopen(tpc_txnset *txnset)
+ *
+ * Opens the file of a set that some other process started, so that it can
+ * be completed or left for recovery here.  Only the file method has
+ * anything to open.
+ */
 
-	txnset->tpc_phase = ROLLBACK;
-	tpc_txnsetfile_write_phase(txnset, ROLLBACK);
+void
+tpc_txnsetfile_reopen(tpc_txnset * txnset)
+{
+    if (TPC_LOG_FILE != txnset->log_method)
+	return;
+    txnset->log = PathNameOpenFile(txnset->logpath, O_WRONLY | PG_BINARY);
+    if (txnset->log < 0)
+	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+		errmsg("could not open file %s: %m", txnset->logpath)));
+    txnset->log_off = FileSize(txnset->log);
+    if (txnset->log_off < 0)
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not seek to end of file %s: %m",
+		       txnset->logpath)));
+}
 
-		
-	for(tpc_txn *curr = txnset->head; curr; curr = curr->next){
-		PGresult *res;
-		char rollback_query[128];
-		snprintf(rollback_query, sizeof(rollback_query), 
-			rollbackfmt, txnset->txn_prefix);
-		res = PQexec(curr->conn, rollback_query);
+/*
+ * void tpc_txnsetfile_handoff(tpc_txnset *txnset)
+ *
+ * Lets go of a set that another process is going to finish.  The file, if
+ * any, is closed but left in place.
+ */
 
-		/* We are not allowed to throw errors here, but we can flag
-		 * the run as impossible to complete.
-		 */
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			can_complete = false;
-		tpc_txnsetfile_write_action(txnset, curr, 
-				(PQresultStatus(res) == PGRES_COMMAND_OK
-				? "OK" : "BAD"));
-	}
-	if (can_complete)
-		tpc_txnsetfile_complete(txnset);
-	return txnset->tpc_phase;
+void
+tpc_txnsetfile_handoff(tpc_txnset * txnset)
+{
+    if (txnset->log >= 0) {
+	FileClose(txnset->log);
+	txnset->log = -1;
+    }
 }
 
 /*
- * Commits a transaction by name on a connection
- *
- * After writes status (committed or error) as action in pending transaction 
- * log.
+ * int tpc_txnsetfile_conninfo(tpc_txn *txn, char *buf, size_t len)
  *
- * Records our error state for complete run.
+ * Formats the connection string we record for a participant.  Returns its
+ * full length, which is len or more if it was cut short.
  */
 
-tpc_phase
-tpc_commit()
+int
+tpc_txnsetfile_conninfo(tpc_txn * txn, char *buf, size_t len)
 {
-	bool can_complete = true;
+    return snprintf(buf, len, conninfofmt,
+	PQhost(txn->conn), PQport(txn->conn), PQdb(txn->conn));
+}
 
-	if (txnset->tpc_phase != PREPARE) {
-		ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
-				errmsg("Not in a valid phase of transaction")));
-	}
+/*
+ * void tpc_txnsetfile_phase_two_query(tpc_phase decision, const char *prefix,
+ *                                     char *buf, size_t len)
+ *
+ * Formats the COMMIT PREPARED or ROLLBACK PREPARED command for a set.
+ */
 
-	txnset->tpc_phase = COMMIT;
-	tpc_txnsetfile_write_phase(txnset, COMMIT);
+void
+tpc_txnsetfile_phase_two_query(tpc_phase decision, const char *prefix,
+			       char *buf, size_t len)
+{
+    snprintf(buf, len, COMMIT == decision ? commitfmt : rollbackfmt, prefix);
+}
 
-		
-	for(tpc_txn *curr = txnset->head; curr; curr = curr->next){
-		PGresult *res;
-		char commit_query[128];
-		snprintf(commit_query, sizeof(commit_query), 
-			commitfmt, txnset->txn_prefix);
-		res = PQexec(curr->conn, commit_query);
+/*
+ * void tpc_txnsetfile_write_phase(tpc_txnset *txnset, tpc_phase phase)
+ *
+ * Logs the phase state to the txnsetfile.
+ */
 
-		/* We are not allowed to throw errors here, but we can flag
-		 * the run as impossible to complete.
-		 */
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
-			can_complete = false;
-		tpc_txnsetfile_write_action(txnset, curr,
-				(PQresultStatus(res) == PGRES_COMMAND_OK
-				? "OK" : "BAD"));
-	}
-	if (can_complete)
-		tpc_txnsetfile_complete(txnset);
-	return txnset->tpc_phase;
+void
+tpc_txnsetfile_write_phase(tpc_txnset * txnset, tpc_phase phase)
+{
+    write_record(txnset, TPC_REC_PHASE, phase, NULL, TPC_STATUS_PENDING);
 }
 
 /*
- * Registeres a background worker to process the file.
+ * void tpc_txnsetfile_write_action(tpc_txnset *txnset, tpc_txn *txn, tpc_status status)
  *
- * We use the bgw_extra field to point to the file rather than using the
- * arg struct.
+ * Writes the action, state, etc to the transactionset file.  The
+ * participant is referred to by the id it was given when the participants
+ * were written.
  *
+ * This is flushed to the operating system but not synced.
  */
 
-static void
-tpc_register_bgworker(const char *fname)
+void
+tpc_txnsetfile_write_action(tpc_txnset * txnset, tpc_txn * txn, tpc_status status)
 {
-        BackgroundWorkerHandle *bgwhandle = NULL;
-        BackgroundWorker *bgw = palloc0(sizeof(bgw));
-        snprintf(bgw->bgw_name, sizeof(bgw->bgw_name),
-                "TPC Cleanup %s", fname);
-        strncpy(bgw->bgw_library_name, "pg_globalxact.sl",
-                sizeof(bgw->bgw_library_name));
-        strncpy(bgw->bgw_function_name, "tpc_bgworker",
-               sizeof(bgw->bgw_function_name));
-        bgw->bgw_restart_time = 60;
-        strncpy(bgw->bgw_extra, fname, sizeof(bgw->bgw_extra));
-        bgw->bgw_main_arg = 0;
-        bgw->bgw_notify_pid = 0;
-        if (!RegisterDynamicBackgroundWorker(bgw, &bgwhandle)){
-                ereport(WARNING, (errmsg(
-                        "could not start worker for %s, "
-                        "Manual cleanup required.", fname)));
-        }
-        return;
+    write_record(txnset, TPC_REC_ACTION, txnset->tpc_phase, txn, status);
 }
 
+/*
+ * void tpc_txnsetfile_write_participants(tpc_txnset *txnset, tpc_phase phase)
+ *
+ * Writes a phase record followed by a PENDING participant record for every
+ * participant, all labelled with phase.  This is the full record of a set
+ * that recovery needs.  Each participant gets its id for the log here.
+ */
 
 void
-tpc_bgworker(Datum unused)
+tpc_txnsetfile_write_participants(tpc_txnset * txnset, tpc_phase phase)
 {
-	tpc_process_file(MyBgworkerEntry->bgw_extra);
-	return;
+    int		id = 0;
+
+    tpc_txnsetfile_write_phase(txnset, phase);
+    for (tpc_txn *curr = txnset->head; curr; curr = curr->next) {
+	curr->log_id = id++;
+	write_record(txnset, TPC_REC_PARTICIPANT, phase, curr,
+	    TPC_STATUS_PENDING);
+    }
 }
 
+/*
+ * void tpc_txnsetfile_sync(tpc_txnset *txnset)
+ *
+ * Makes everything logged for the set so far durable.  For the journal this
+ * waits for the log writer, which syncs on behalf of every backend waiting
+ * at the same time.  For WAL the set is logged and flushed, sharing the
+ * flush with whoever else is committing.
+ */
+
 void
-tpc_process_file(char *fname)
+tpc_txnsetfile_sync(tpc_txnset * txnset)
 {
-	tpc_txnset *txnset;
-	txnset = tpc_txnset_from_file(fname);
-	bg_cleanup(txnset, txnset->tpc_phase != COMMIT);
-	unlink(txnset->logpath);
-	return;
+    instr_time	start;
+
+    tpc_stats_start(&start);
+    if (TPC_LOG_JOURNAL == txnset->log_method)
+	tpc_logwriter_flush(txnset->log_pos);
+    else if (TPC_LOG_WAL == txnset->log_method)
+	tpc_xlog_decision(txnset->txn_prefix, txnset->lines->data,
+	    txnset->lines->len);
+    else if (FileSync(txnset->log, tpc_wait_event(TPC_WAIT_LOG_SYNC)) != 0) {
+	tpc_stats_record(TPC_STAT_LOG_SYNC, &start, false);
+	ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+		errmsg("could not fsync file %s: %m", txnset->logpath)));
+    }
+    tpc_stats_record(TPC_STAT_LOG_SYNC, &start, true);
 }
 
-
-/* This is the bg_cleanup process which runs once the txnset has been
- * initialized.  It repeatedly loops through the transactions.  If the
- * transactions no longer exist or if they can be brought to completion
- * they are removed from the list.
- *
- * When all transactions are removed from the list, we exit.
+/*
+ * void tpc_txnsetfile_complete(tpc_txnset *txnset)
  *
- * If rollback is false we commit transactions
- * and if true we roll them back.
+ * Errors if state is not complete
+ * Otherwise marks the set finished; nobody needs to wait for that to be
+ * durable.  A set file gets a COMPLETE phase record and is closed, and is
+ * then left to the log writer to remove along with others (see
+ * tpc_reaper.c), so the client does not wait for the unlink.
  */
-static void
-bg_cleanup(tpc_txnset *txnset, bool rollback)
+void
+tpc_txnsetfile_complete(tpc_txnset * txnset)
 {
-	tpc_txn *last = NULL;
-	tpc_txn *curr;
-	PGresult *res;
-	do {
-		/* check to see if we are in a re-run and if so sleep */
-		if (txnset->tpc_phase == INCOMPLETE)
-			sleep(1);
-
-		curr = txnset->head;
-		for (curr = txnset->head; curr; curr = curr->next){
-			char query[128];
-			ereport(WARNING, (errmsg("cleaning up xact %s", txnset->txn_prefix)));
-
-			/* The connection may have gone away so we had
-			 * better check its status and reset if needed
-			 */
-			if (PQstatus(curr->conn) == CONNECTION_BAD)
-				PQreset(curr->conn);
-
-			if (check_txn(txnset, last, curr))
-				continue;
-
-
-			if (rollback)
-				snprintf(query, sizeof(query), 
-					rollbackfmt, txnset->txn_prefix);
-			else
-				snprintf(query, sizeof(query), 
-					commitfmt, txnset->txn_prefix);
-			
-			res = PQexec(curr->conn, query);
-
-			/* if successful, remove this from list */
-			if (PQresultStatus(res) == PGRES_COMMAND_OK)
-				if (last)
-					last->next = curr->next;
-				else
-					txnset->head = curr->next;
-			else
-				last = curr;
-		}
-		txnset->tpc_phase = INCOMPLETE;
+    instr_time	start;
 
-	} while (txnset->head);
+    if (txnset->tpc_phase != COMPLETE)
+	ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+		errmsg("Transaction not compplete!, state is %s", tpc_phase_get_label(txnset->tpc_phase))));
 
+    tpc_stats_start(&start);
+    switch (txnset->log_method) {
+    case TPC_LOG_JOURNAL:
+	journal_forget(txnset);
+	break;
+    case TPC_LOG_WAL:
+	tpc_xlog_forget(txnset->txn_prefix);
+	break;
+    default:
+	file_forget(txnset);
+    }
+    tpc_stats_record(TPC_STAT_LOG_COMPLETE, &start, true);
 }
 
-/* Checks to see if a txn exists.  If the query succeeds and the transaction
- * does not exist then this returns true and removes the transaction from
- * the transaction set.
+/*
+ * static void file_forget(tpc_txnset *txnset)
  *
- * Otherwise return false so the cleanup will try to remove the transaction,
+ * Appends a COMPLETE phase record to a set file, closes it and queues it
+ * for removal.  This runs after every remote has committed, so it must not
+ * fail:  if the record cannot be written the file is removed right away
+ * instead.
  */
-static bool
-check_txn(tpc_txnset *txnset, tpc_txn *last, tpc_txn *curr)
-{
-	char query[128];
-	PGresult *res;
-	bool removed = false;
-	snprintf(query, sizeof(query), 
-		checkfmt, txnset->txn_prefix);
-	
-	res = PQexec(curr->conn, query);
-	if ((PQresultStatus(res) != PGRES_TUPLES_OK) && (PQresultStatus(res) != PGRES_COMMAND_OK)){
-		ereport(INFO, (errmsg("Transaction %s query failed", txnset->txn_prefix)));
-		removed = false;
-	}
-	else if (PQntuples(res) >= 1){
-		removed = false;
-		ereport(WARNING, (errmsg("Transaction %s found %d times", txnset->txn_prefix, PQntuples(res))));
-	} else {
-		/* txns are palloced so no need to free. 
-		 * Besides process dies as soon as we complete
-		 * cleanup anyway
-		 */
-		ereport(INFO, (errmsg("Transaction %s not found", txnset->txn_prefix)));
-		PQfinish(curr->conn);
+static void
+file_forget(tpc_txnset * txnset)
+{
+    tpc_record_buf record;
+    int		len;
+    bool	marked;
+
+    len = tpc_record_encode(record.data, TPC_REC_PHASE, COMPLETE, 0,
+	TPC_STATUS_PENDING, txnset->txn_prefix, NULL);
+    errno = 0;
+    marked = (FileWrite(txnset->log, record.data, len, txnset->log_off,
+			tpc_wait_event(TPC_WAIT_LOG_WRITE)) == len);
+    if (!marked && 0 == errno)
+	errno = ENOSPC;
+    if (!marked)
+	ereport(WARNING, (errcode_for_file_access(),
+		errmsg("could not mark file %s complete: %m, removing it now",
+		       txnset->logpath)));
+    FileClose(txnset->log);
+    txnset->log = -1;
+    if (marked)
+	tpc_reaper_remove(txnset->logpath);
+    else
+	unlink(txnset->logpath);
+}
+
+/*
+ * static void journal_forget(tpc_txnset *txnset)
+ * Appends the record that finishes a journal set.
+ */
+static void
+journal_forget(tpc_txnset * txnset)
+{
+    tpc_record_buf record;
+    int		len;
+
+    len = tpc_record_encode(record.data, TPC_REC_PHASE, COMPLETE, 0,
+	TPC_STATUS_PENDING, txnset->txn_prefix, NULL);
+    tpc_logwriter_append(record.data, len, &txnset->log_start, true);
+}
+
+/*
+ * void tpc_txnsetfile_incomplete(tpc_txnset *txnset)
+ *
+ * Leaves the set for recovery after phase two could not finish.  A set file
+ * is simply closed.  Journal and WAL sets are written out as a set file of
+ * their own, carrying the decision and participants.  A journal set is then
+ * marked finished so its segments can still be recycled.  A WAL set is not
+ * forgotten, so a standby keeps its copy of the file, but it stops holding
+ * up checkpoints.
+ */
+void
+tpc_txnsetfile_incomplete(tpc_txnset * txnset)
+{
+    tpc_log_method method = txnset->log_method;
+    instr_time	start;
+
+    tpc_stats_start(&start);
+    if (TPC_LOG_FILE != method) {
+	txnset->log_method = TPC_LOG_FILE;
+	start_file(txnset, txnset->txn_prefix);
+	tpc_txnsetfile_write_participants(txnset, txnset->tpc_phase);
+	tpc_txnsetfile_sync(txnset);
+	if (TPC_LOG_JOURNAL == method)
+	    journal_forget(txnset);
+	else
+	    tpc_xlog_release();
+    }
+    FileClose(txnset->log);
+    txnset->log = -1;
+    tpc_stats_record(TPC_STAT_LOG_INCOMPLETE, &start, true);
+}
+
+
+/* SQL FUNCTION SECTION */
+
+/* SQL function for firing off a cleanup worker for a given file.
+ *
+ * When we are preloaded the file goes to the recovery launcher's queue
+ * instead, so that however many files are cleaned up only
+ * pg_globalxact.recovery_workers workers are used.  Otherwise each call
+ * still gets a worker of its own.
+ *
+ * Sets still in progress are in the registry, when we are preloaded, and
+ * recovery leaves their files alone.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_cleanup_txnset);
+Datum
+tpc_cleanup_txnset(PG_FUNCTION_ARGS) {
+    char       *fname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    if (!fname[0])
+	ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		errmsg("file name must not be empty")));
+    if (tpc_shmem_available())
+	tpc_launcher_request(fname);
+    else
+	tpc_register_bgworker(fname);
+    PG_RETURN_VOID();
+}
+
+/* SQL function for recovering every transaction set in the directory with
+ * one worker.  The participants of all sets are grouped by remote, so this
+ * is much faster than one tpc_cleanup call per file.  Sets still in
+ * progress are skipped in the same way.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_cleanup_all);
+Datum
+tpc_cleanup_all(PG_FUNCTION_ARGS) {
+    if (tpc_shmem_available())
+	tpc_launcher_request(NULL);
+    else
+	tpc_register_bgworker("");
+    PG_RETURN_VOID();
+}
+
+/*
+ * Tuplestorestate *tpc_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+ *
+ * Sets up a materialize-mode set-returning function call and returns the
+ * tuplestore to put the rows in.
+ */
+
+Tuplestorestate *
+tpc_materialize(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Tuplestorestate *tupstore;
+    MemoryContext old_context;
+
+    if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+	ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		errmsg("set-valued function called in context that cannot "
+		       "accept a set")));
+    if (!(rsinfo->allowedModes & SFRM_Materialize))
+	ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		errmsg("materialize mode required, but it is not allowed in "
+		       "this context")));
+    if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+	elog(ERROR, "return type must be a row type");
+
+    old_context = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+    *tupdesc = CreateTupleDescCopy(*tupdesc);
+    tupstore = tuplestore_begin_heap(true, false, work_mem);
+    rsinfo->returnMode = SFRM_Materialize;
+    rsinfo->setResult = tupstore;
+    rsinfo->setDesc = *tupdesc;
+    MemoryContextSwitchTo(old_context);
+    return tupstore;
+}
+
+/*
+ * static void put_contents_row(Tuplestorestate *tupstore, TupleDesc tupdesc,
+ *                              const char *file, const char *prefix,
+ *                              const char *phase, char *conninfo,
+ *                              const char *status)
+ *
+ * Adds the row for one participant entry of a set file:  file, prefix,
+ * phase, host, port, database, status.  conninfo is split up in place.
+ */
+
+static void
+put_contents_row(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		 const char *file, const char *prefix, const char *phase,
+		 char *conninfo, const char *status)
+{
+    char       *host;
+    char       *port;
+    char       *database;
+    Datum	values[7];
+    bool	nulls[7] = {false, false, false, false, false, false, false};
+
+    if (strncmp(conninfo, "postgresql://", 13) != 0)
+	return;
+    host = conninfo + 13;
+    database = strchr(host, '/');
+    if (database)
+	*database++ = '\0';
+    port = strrchr(host, ':');
+    if (port)
+	*port++ = '\0';
+
+    values[0] = CStringGetTextDatum(file);
+    values[1] = CStringGetTextDatum(prefix);
+    values[2] = CStringGetTextDatum(phase);
+    values[3] = CStringGetTextDatum(host);
+    if (port && *port)
+	values[4] = Int32GetDatum(atoi(port));
+    else
+	nulls[4] = true;
+    if (database)
+	values[5] = CStringGetTextDatum(database);
+    else
+	nulls[5] = true;
+    values[6] = CStringGetTextDatum(status);
+    tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * static void contents_text(Tuplestorestate *tupstore, TupleDesc tupdesc,
+ *                           const char *file, FILE *stream)
+ *
+ * Adds the rows for a set file in the old text format.  Lines that are not
+ * participant lines are skipped.
+ */
+
+static void
+contents_text(Tuplestorestate *tupstore, TupleDesc tupdesc,
+	      const char *file, FILE *stream)
+{
+    char	linebuff[LINEBUFFSIZE];
+
+    while (fgets(linebuff, sizeof(linebuff), stream)) {
+	char	    phaselabel[12];
+	char	    connectionstr[LINEBUFFSIZE];
+	char	    txnname[NAMEDATALEN];
+	char	    status[64];
+
+	if (!strchr(linebuff, '\n') && !feof(stream)) {
+	    ereport(WARNING, (errmsg("line too long in file \"%s\", "
+				     "skipping the rest of it", file)));
+	    break;
+	}
+	if (sscanf(linebuff, "%11s %511s %63s %63s", phaselabel,
+		   connectionstr, txnname, status) == 4)
+	    put_contents_row(tupstore, tupdesc, file, txnname, phaselabel,
+			     connectionstr, status);
+    }
+}
+
+/*
+ * static void contents_records(Tuplestorestate *tupstore, TupleDesc tupdesc,
+ *                              const char *file, tpc_record_stream *stream)
+ *
+ * Adds the rows for a set file of binary records, one for each participant
+ * and action record.  Actions only carry the participant's id, so the
+ * conninfos are remembered by id as they go past.
+ */
+
+static void
+contents_records(Tuplestorestate *tupstore, TupleDesc tupdesc,
+		 const char *file, tpc_record_stream * stream)
+{
+    char	prefix[NAMEDATALEN] = "";
+    char      **conninfos = NULL;
+    int		nconninfos = 0;
+    tpc_record_view view;
+    tpc_record_result result;
+
+    while ((result = tpc_record_stream_next(stream, &view)) == TPC_RECORD_OK) {
+	const tpc_record *rec = view.rec;
+	char	   *conninfo;
+
+	if (rec->prefix_len > 0)
+	    strlcpy(prefix, view.prefix,
+		    Min(rec->prefix_len + 1, sizeof(prefix)));
+	if (TPC_REC_PHASE == rec->type)
+	    continue;
+	if (TPC_REC_PARTICIPANT == rec->type) {
+	    if (rec->participant >= nconninfos) {
+		int	    n = Max(rec->participant + 1, nconninfos * 2);
+
+		conninfos = conninfos ? repalloc(conninfos, n * sizeof(char *))
+		    : palloc(n * sizeof(char *));
+		memset(conninfos + nconninfos, 0,
+		       (n - nconninfos) * sizeof(char *));
+		nconninfos = n;
+	    }
+	    conninfos[rec->participant] = pnstrdup(view.conninfo,
+						   rec->conninfo_len);
+	}
+	if (rec->participant >= nconninfos || !conninfos[rec->participant])
+	    continue;
+	conninfo = pstrdup(conninfos[rec->participant]);
+	put_contents_row(tupstore, tupdesc, file, prefix,
+			 tpc_phase_get_label((tpc_phase) rec->phase), conninfo,
+			 tpc_status_get_label((tpc_status) rec->status));
+    }
+    if (TPC_RECORD_CORRUPT == result)
+	ereport(WARNING, (errmsg("corrupt record in file \"%s\", "
+				 "skipping the rest of it", file)));
+}
+
+/*
+ * static void contents_dir(Tuplestorestate *tupstore, TupleDesc tupdesc,
+ *                          const char *dir, MemoryContext file_context)
+ *
+ * Adds the rows for every set file in one directory.  Subdirectories, the
+ * shards and the journal, are passed over.
+ */
+
+static void
+contents_dir(Tuplestorestate *tupstore, TupleDesc tupdesc, const char *dir,
+	     MemoryContext file_context)
+{
+    MemoryContext old_context;
+    DIR	       *dirp;
+    struct dirent *de;
+
+    dirp = AllocateDir(dir);
+    if (!dirp && errno == ENOENT)
+	return;
+    while ((de = ReadDir(dirp, dir)) != NULL) {
+	char	    path[MAXPGPATH];
+	FILE	   *file;
+	tpc_record_stream *stream;
+
+	if ('.' == de->d_name[0] || strcmp(de->d_name, TPC_JOURNAL_NAME) == 0
+	    || tpc_txnsetfile_is_shard(dir, de->d_name))
+	    continue;
+	snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+	file = AllocateFile(path, PG_BINARY_R);
+	if (!file) {
+	    if (errno == ENOENT)
+		continue;
+	    ereport(ERROR, (errcode_for_file_access(),
+		    errmsg("could not open file \"%s\": %m", path)));
+	}
+
+	old_context = MemoryContextSwitchTo(file_context);
+	stream = tpc_record_stream_open(file);
+	if (tpc_record_stream_is_text(stream)) {
+	    rewind(file);
+	    contents_text(tupstore, tupdesc, path, file);
+	} else
+	    contents_records(tupstore, tupdesc, path, stream);
+	MemoryContextSwitchTo(old_context);
+	MemoryContextReset(file_context);
+	FreeFile(file);
+	CHECK_FOR_INTERRUPTS();
+    }
+    FreeDir(dirp);
+}
+
+/* SQL function for looking into the transaction set files themselves.
+ * Returns one row per participant entry in every set file in TPC_LOGDIR
+ * and its shards:
+ *   - file
+ *   - prefix
+ *   - phase the entry was written in
+ *   - host
+ *   - port
+ *   - database
+ *   - transaction status
+ *
+ * Files are read through a fixed buffer and nothing is connected to, so a
+ * backlog of any size can be inspected.  Rows go to a tuplestore, which
+ * spills to disk past work_mem.  Files that disappear while we read the
+ * directory were finished in the meantime and are skipped.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_txnset_contents);
+Datum
+tpc_txnset_contents(PG_FUNCTION_ARGS) {
+    TupleDesc	tupdesc;
+    Tuplestorestate *tupstore = tpc_materialize(fcinfo, &tupdesc);
+    MemoryContext file_context;
+
+    if (access(dirpath, F_OK) != 0)
+	return (Datum) 0;
+
+    file_context = AllocSetContextCreate(CurrentMemoryContext,
+					 "pg_globalxact set file",
+					 ALLOCSET_SMALL_SIZES);
+    contents_dir(tupstore, tupdesc, dirpath, file_context);
+    for (int i = 0; i < TPC_LOGDIR_SHARDS; ++i) {
+	char	    shard[MAXPGPATH];
+
+	tpc_txnsetfile_shard_dir(i, shard, sizeof(shard), false);
+	contents_dir(tupstore, tupdesc, shard, file_context);
+    }
+    MemoryContextDelete(file_context);
+    return (Datum) 0;
+}
+
+/*
+ * static void stress_drop(tpc_txnset *sets, int n)
+ * Closes and removes the files of the first n stress sets.
+ */
+
+static void
+stress_drop(tpc_txnset * sets, int n)
+{
+    for (int i = 0; i < n; ++i) {
+	FileClose(sets[i].log);
+	unlink(sets[i].logpath);
+    }
+}
+
+/* SQL function for checking that set files do not run us out of file
+ * descriptors.  Opens a set file for each of the given number of sets at
+ * once, all in this backend, writes a record to each and syncs them, then
+ * removes them all, and returns how many there were.  The records say the
+ * sets rolled back with no participants, so files left by a crash are
+ * simply removed by recovery.
+ */
+
+PG_FUNCTION_INFO_V1(tpc_log_stress);
+Datum
+tpc_log_stress(PG_FUNCTION_ARGS) {
+    int		nsets = PG_GETARG_INT32(0);
+    tpc_txnset *sets;
+    volatile int nopen = 0;
+
+    if (nsets < 1 || nsets > 1000000)
+	ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+		errmsg("number of sets must be between 1 and 1000000")));
+    sets = palloc0(sizeof(tpc_txnset) * nsets);
+
+    PG_TRY();
+    {
+	for (int i = 0; i < nsets; ++i) {
+	    tpc_txnset *set = &sets[i];
+
+	    set->log_method = TPC_LOG_FILE;
+	    set->registry_slot = -1;
+	    set->tpc_phase = ROLLBACK;
+	    snprintf(set->txn_prefix, sizeof(set->txn_prefix),
+		     "tpc_log_stress_%d_%d", MyProcPid, i);
+	    start_file(set, set->txn_prefix);
+	    nopen = i + 1;
+	    tpc_txnsetfile_write_phase(set, ROLLBACK);
+	    CHECK_FOR_INTERRUPTS();
+	}
+	for (int i = 0; i < nsets; ++i) {
+	    if (FileSync(sets[i].log, tpc_wait_event(TPC_WAIT_LOG_SYNC)) != 0)
+		ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+			errmsg("could not fsync file %s: %m",
+			       sets[i].logpath)));
+	    CHECK_FOR_INTERRUPTS();
+	}
+    }
+    PG_CATCH();
+    {
+	stress_drop(sets, nopen);
+	PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    stress_drop(sets, nsets);
+    pfree(sets);
+    PG_RETURN_INT32(nsets);
+}
+
+/*
+ * State shared with the remote callbacks while a phase is in flight.
+ */
+typedef struct phase_state {
+	tpc_txnset *txnset;
+	bool can_complete;
+	bool unknown;		/* a one-phase COMMIT lost its connection */
+	const char *prepare_query;	/* for writers found by probe_txn */
+} phase_state;
+
+/*
+ * static bool check_prepare(tpc_txn *txn, PGresult *res, void *arg)
+ *
+ * Callback for the PREPARE TRANSACTION fan-out.  A PREPARE issued in a
+ * transaction block that has already failed reports success with a
+ * ROLLBACK command tag, so the tag has to be checked as well as the status.
+ *
+ * Returns false on the first failure so the remaining PREPAREs are
+ * cancelled rather than waited for.
+ */
+static bool
+check_prepare(tpc_txn *txn, PGresult *res, void *arg)
+{
+	phase_state *state = (phase_state *) arg;
+
+	txn->prepared = (res && PQresultStatus(res) == PGRES_COMMAND_OK
+			 && strcmp(PQcmdStatus(res), "PREPARE TRANSACTION") == 0);
+	tpc_stats_remote(TPC_STAT_REMOTE_PREPARE, txn, txn->prepared);
+	if (!txn->prepared) {
+		ereport(WARNING, (errmsg("could not prepare %s on %s: %s",
+				state->txnset->txn_prefix, PQhost(txn->conn),
+				PQerrorMessage(txn->conn))));
+		state->can_complete = false;
+	}
+	return txn->prepared;
+}
+
+/*
+ * static bool probe_txn(tpc_txn *txn, PGresult *res, void *arg)
+ *
+ * Callback for finding read-only participants.  Each participant is asked
+ * whether its transaction has an xid.  One without has written nothing, so
+ * it is committed on the spot and takes no further part.  One with is sent
+ * straight on to PREPARE if the state has a prepare query, so that under
+ * presumed abort nobody waits for anybody else between the two.
+ */
+static bool
+probe_txn(tpc_txn *txn, PGresult *res, void *arg)
+{
+	phase_state *state = (phase_state *) arg;
+
+	if (!txn->probed) {
+		bool ok = (res && PQresultStatus(res) == PGRES_TUPLES_OK
+			   && PQntuples(res) == 1);
+
+		txn->probed = true;
+		tpc_stats_remote(TPC_STAT_REMOTE_PROBE, txn, ok);
+		if (!ok) {
+			ereport(WARNING, (errmsg("could not check %s on %s: %s",
+					state->txnset->txn_prefix, PQhost(txn->conn),
+					PQerrorMessage(txn->conn))));
+			state->can_complete = false;
+			return false;
+		}
+		txn->read_only = (strcmp(PQgetvalue(res, 0, 0), "t") == 0);
+		if (txn->read_only)
+			tpc_remote_send(txn, "COMMIT");
+		else if (state->prepare_query) {
+			/* Marked before sending: if the answer is thrown away
+			 * after another participant fails, the rollback still
+			 * has to reach a PREPARE that went through.
+			 */
+			txn->prepare_sent = true;
+			tpc_remote_send(txn, state->prepare_query);
+		}
+		return true;
+	}
+	if (txn->read_only) {
+		bool ok = (res && PQresultStatus(res) == PGRES_COMMAND_OK);
+
+		tpc_stats_remote(TPC_STAT_REMOTE_COMMIT, txn, ok);
+		if (ok)
+			return true;
+		ereport(WARNING, (errmsg("could not commit read-only %s on %s: %s",
+				state->txnset->txn_prefix, PQhost(txn->conn),
+				PQerrorMessage(txn->conn))));
+		txn->read_only = false;
+		state->can_complete = false;
+		return false;
+	}
+	return check_prepare(txn, res, arg);
+}
+
+/*
+ * static void drop_read_only(tpc_txnset *txnset)
+ * Removes the participants that have already committed from the set.
+ */
+static void
+drop_read_only(tpc_txnset *txnset)
+{
+	tpc_txn *last = NULL;
+
+	for (tpc_txn *curr = txnset->head; curr; curr = curr->next) {
+		if (!curr->read_only) {
+			last = curr;
+			continue;
+		}
 		if (last)
 			last->next = curr->next;
 		else
 			txnset->head = curr->next;
-		removed = true;
 	}
-	PQclear(res);
-	return removed;
+	txnset->latest = last;
+}
+
+/*
+ * Callback for rollbacks whose outcome we do not record.  They still count
+ * in the statistics.
+ */
+static bool
+ignore_result(tpc_txn *txn, PGresult *res, void *arg)
+{
+	tpc_stats_remote(TPC_STAT_REMOTE_ROLLBACK, txn,
+		res && PQresultStatus(res) == PGRES_COMMAND_OK);
+	return true;
+}
+
+/*
+ * static tpc_stat phase_two_stat(phase_state *state)
+ * Returns the statistic for the phase two command we are waiting for.
+ */
+static tpc_stat
+phase_two_stat(phase_state *state)
+{
+	return state->txnset->tpc_phase == ROLLBACK
+		? TPC_STAT_REMOTE_ROLLBACK : TPC_STAT_REMOTE_COMMIT;
+}
+
+/*
+ * static bool phase_two_ok(phase_state *state, tpc_txn *txn, PGresult *res)
+ *
+ * Tells whether a phase two command succeeded.  A participant whose PREPARE
+ * failed or was cancelled, with its answer thrown away, still gets ROLLBACK
+ * PREPARED in case it prepared after all, and then has nothing to roll back.
+ */
+static bool
+phase_two_ok(phase_state *state, tpc_txn *txn, PGresult *res)
+{
+	const char *sqlstate;
+
+	if (res && PQresultStatus(res) == PGRES_COMMAND_OK)
+		return true;
+	if (!res || txn->prepared || state->txnset->tpc_phase != ROLLBACK)
+		return false;
+	sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+	/* undefined_object: no such prepared transaction */
+	return sqlstate && strcmp(sqlstate, "42704") == 0;
+}
+
+/*
+ * static bool log_action(tpc_txn *txn, PGresult *res, void *arg)
+ *
+ * Callback for the phase two fan-out.  Writes the OK or BAD action line for
+ * each participant as its answer arrives.
+ */
+static bool
+log_action(tpc_txn *txn, PGresult *res, void *arg)
+{
+	phase_state *state = (phase_state *) arg;
+	bool ok = phase_two_ok(state, txn, res);
+
+	tpc_stats_remote(phase_two_stat(state), txn, ok);
+	/* We are not allowed to throw errors here, but we can flag
+	 * the run as impossible to complete.
+	 */
+	if (!ok)
+		state->can_complete = false;
+	tpc_txnsetfile_write_action(state->txnset, txn,
+		ok ? TPC_STATUS_OK : TPC_STATUS_BAD);
+	return true;
+}
+
+/*
+ * static bool check_action(tpc_txn *txn, PGresult *res, void *arg)
+ *
+ * Callback for the phase two fan-out under presumed abort.  Like
+ * log_action, but nothing is written per participant.
+ */
+static bool
+check_action(tpc_txn *txn, PGresult *res, void *arg)
+{
+	phase_state *state = (phase_state *) arg;
+	bool ok = phase_two_ok(state, txn, res);
+
+	tpc_stats_remote(phase_two_stat(state), txn, ok);
+	if (!ok)
+		state->can_complete = false;
+	return true;
+}
+
+/*
+ * static bool check_commit(tpc_txn *txn, PGresult *res, void *arg)
+ *
+ * Callback for a one-phase commit.  Like check_prepare, a COMMIT in a
+ * transaction block that has already failed succeeds with a ROLLBACK tag.
+ * A COMMIT that lost its connection may or may not have committed, which
+ * is told apart from one the participant refused.
+ */
+static bool
+check_commit(tpc_txn *txn, PGresult *res, void *arg)
+{
+	phase_state *state = (phase_state *) arg;
+	bool ok = (res && PQresultStatus(res) == PGRES_COMMAND_OK
+		   && strcmp(PQcmdStatus(res), "COMMIT") == 0);
+
+	tpc_stats_remote(TPC_STAT_REMOTE_COMMIT, txn, ok);
+	if (ok)
+		return true;
+	if (res)
+		ereport(WARNING, (errmsg("could not commit %s on %s: %s",
+				state->txnset->txn_prefix, PQhost(txn->conn),
+				PQerrorMessage(txn->conn))));
+	else {
+		ereport(WARNING, (errmsg("lost connection to %s while committing "
+				"%s, outcome unknown",
+				PQhost(txn->conn), state->txnset->txn_prefix)));
+		state->unknown = true;
+	}
+	state->can_complete = false;
+	return true;
+}
+
+/*
+ * static void log_decision(tpc_phase decision)
+ *
+ * Under presumed abort nothing is logged until there is something worth
+ * remembering.  This starts the log for the set and writes the decision
+ * and the participant list as a single record with a single sync.
+ *
+ * With log_method = file that takes two syncs rather than one:  creating
+ * the set file syncs its directory, and then the record is synced.
+ * Both are needed, since a synced file whose directory entry is lost in a
+ * crash takes the decision with it, and recovery would then roll back a
+ * set we told the client had committed.  The journal and WAL, which write
+ * into space that already exists, need only the one.
+ */
+static void
+log_decision(tpc_phase decision)
+{
+	tpc_txnsetfile_start(txnset, txnset->txn_prefix);
+	/* From here on the set is logged like any other. */
+	txnset->presumed_abort = false;
+	tpc_txnsetfile_write_participants(txnset, decision);
+	tpc_txnsetfile_sync(txnset);
+}
+
+/*
+ * static void set_phase(tpc_phase phase)
+ * Moves the current txnset to phase and shows it in the registry.
+ */
+static void
+set_phase(tpc_phase phase)
+{
+	txnset->tpc_phase = phase;
+	tpc_registry_publish(txnset);
+}
+
+/*
+ * static tpc_phase finish_phase_two(phase_state *state)
+ *
+ * Marks the set COMPLETE and removes its file if every participant
+ * answered, otherwise leaves the file for recovery and marks the set
+ * INCOMPLETE.  The INCOMPLETE phase is only kept in memory, since recovery
+ * needs the last decision recorded in the file.
+ */
+static tpc_phase
+finish_phase_two(phase_state *state)
+{
+	if (state->can_complete) {
+		set_phase(COMPLETE);
+		tpc_txnsetfile_complete(txnset);
+	} else {
+		tpc_txnsetfile_incomplete(txnset);
+		set_phase(INCOMPLETE);
+	}
+	return txnset->tpc_phase;
+}
+
+/*
+ * static bool one_phase_candidate(tpc_txnset *txnset)
+ * Returns true if the set may be committed without two-phase commit.
+ */
+static bool
+one_phase_candidate(tpc_txnset *txnset)
+{
+	return tpc_one_phase_commit_setting && txnset->head
+		&& !txnset->head->next;
+}
+
+/*
+ * Prepares the transaction on all participants.
+ *
+ * The participant list is written to the transaction set file and synced
+ * before anything is sent, so recovery can find every remote that might
+ * have prepared.  PREPARE TRANSACTION then goes to all participants at once.
+ * On the first failure the outstanding PREPAREs are cancelled and the set
+ * is rolled back straight away.
+ *
+ * Under presumed abort (pg_globalxact.presumed_abort) nothing is logged
+ * here at all.  A crash before the commit decision then leaves prepared
+ * transactions on the remotes that no set file mentions; they are presumed
+ * aborted and must be rolled back by hand.
+ *
+ * With pg_globalxact.detect_read_only each participant is first asked
+ * whether it has an xid.  Those that do not are committed there and then and
+ * dropped from the set, so they are never logged, prepared or recovered.
+ * Under presumed abort the PREPARE follows the answer on each connection
+ * without waiting for the others; otherwise the writers have to be known
+ * before they can be logged, which costs one extra round trip.
+ *
+ * A set left with a single participant is not prepared at all when
+ * pg_globalxact.one_phase_commit is on; tpc_commit sends it a plain COMMIT.
+ *
+ * Returns PREPARE if every participant prepared, otherwise the phase the
+ * rollback ended in.
+ */
+
+static tpc_phase
+prepare_set(void)
+{
+	phase_state state;
+	char prepare_query[128];
+
+	if (!tpc_phase_is_valid_transition(txnset->tpc_phase, PREPARE)) {
+		ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+				errmsg("Not in a valid phase of transaction")));
+	}
+
+	state.txnset = txnset;
+	state.can_complete = true;
+	state.prepare_query = NULL;
+	snprintf(prepare_query, sizeof(prepare_query),
+		preparefmt, txnset->txn_prefix);
+	txnset->presumed_abort = tpc_presumed_abort_setting;
+
+	if (tpc_detect_read_only_setting) {
+		/* Under presumed abort writers prepare as soon as they have
+		 * answered.  Otherwise they have to be logged before anyone
+		 * prepares, so everyone answers first.
+		 */
+		if (txnset->presumed_abort && !one_phase_candidate(txnset))
+			state.prepare_query = prepare_query;
+		tpc_remote_fanout(txnset->head, probefmt, probe_txn, &state,
+			tpc_wait_event(TPC_WAIT_REMOTE_PROBE));
+		drop_read_only(txnset);
+		if (!state.can_complete) {
+			if (state.prepare_query)
+				set_phase(PREPARE);
+			return tpc_rollback();
+		}
+		/* If nobody wrote anything there is nothing to log. */
+		if (!txnset->head)
+			txnset->presumed_abort = true;
+	}
+
+	/* With a single participant left its COMMIT is the decision, so
+	 * there is nothing to prepare and nothing to log.
+	 */
+	if (one_phase_candidate(txnset) && !txnset->head->prepared) {
+		txnset->one_phase = true;
+		txnset->presumed_abort = true;
+		set_phase(PREPARE);
+		return txnset->tpc_phase;
+	}
+
+	if (!txnset->presumed_abort) {
+		tpc_txnsetfile_start(txnset, txnset->txn_prefix);
+		tpc_txnsetfile_write_participants(txnset, PREPARE);
+		tpc_txnsetfile_sync(txnset);
+	}
+	set_phase(PREPARE);
+
+	if (!state.prepare_query) {
+		for (tpc_txn *curr = txnset->head; curr; curr = curr->next)
+			curr->prepare_sent = true;
+		tpc_remote_fanout(txnset->head, prepare_query, check_prepare, &state,
+			tpc_wait_event(TPC_WAIT_REMOTE_PREPARE));
+		if (!state.can_complete)
+			return tpc_rollback();
+	}
+	return txnset->tpc_phase;
+}
+
+/* 
+ * Rolls back the transaction by name on a connection
+ * Writes data to rollback segment of pending transaction log.
+ *
+ * ROLLBACK PREPARED is sent at once to every participant that was sent
+ * PREPARE, whether or not we saw it succeed:  after a failure the answers
+ * to the other PREPAREs are thrown away, and one may have prepared despite
+ * the cancel.  Those that were never sent PREPARE just get ROLLBACK.
+ * Before the prepare phase has started nothing has been logged, so all
+ * participants get a plain ROLLBACK and nothing is written.
+ *
+ * Under presumed abort a rollback writes nothing unless some participant
+ * could not be rolled back, in which case the set is logged so recovery
+ * can finish the job.
+ */
+static tpc_phase
+rollback_set(void)
+{
+	phase_state state;
+	char rollback_query[128];
+
+	state.txnset = txnset;
+	state.can_complete = true;
+	state.prepare_query = NULL;
+	if (txnset->tpc_phase == BEGIN) {
+		tpc_remote_fanout(txnset->head, "ROLLBACK", ignore_result, &state,
+			tpc_wait_event(TPC_WAIT_REMOTE_ROLLBACK));
+		set_phase(COMPLETE);
+		return txnset->tpc_phase;
+	}
+
+	/* Once a decision is logged it is up to recovery, and we may be
+	 * running inside an abort where errors are not allowed.
+	 */
+	if (txnset->tpc_phase != PREPARE) {
+		ereport(WARNING, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+				errmsg("Not in a valid phase of transaction, "
+				       "leaving %s for recovery", txnset->txn_prefix)));
+		if (txnset->tpc_phase == COMMIT || txnset->tpc_phase == ROLLBACK) {
+			tpc_txnsetfile_incomplete(txnset);
+			set_phase(INCOMPLETE);
+		}
+		return txnset->tpc_phase;
+	}
+
+	set_phase(ROLLBACK);
+	if (!txnset->presumed_abort)
+		tpc_txnsetfile_write_phase(txnset, ROLLBACK);
+
+	snprintf(rollback_query, sizeof(rollback_query), 
+		rollbackfmt, txnset->txn_prefix);
+	for (tpc_txn *curr = txnset->head; curr; curr = curr->next)
+		tpc_remote_send(curr,
+			curr->prepare_sent ? rollback_query : "ROLLBACK");
+	tpc_remote_wait(txnset->head,
+		txnset->presumed_abort ? check_action : log_action, &state,
+		tpc_wait_event(TPC_WAIT_REMOTE_ROLLBACK));
+
+	if (txnset->presumed_abort) {
+		if (state.can_complete) {
+			set_phase(COMPLETE);
+			return txnset->tpc_phase;
+		}
+		log_decision(ROLLBACK);
+	}
+	return finish_phase_two(&state);
+}
+
+/*
+ * Commits a transaction by name on a connection
+ *
+ * After writes status (committed or error) as action in pending transaction 
+ * log.
+ *
+ * COMMIT PREPARED is sent to all participants at once, so this takes as
+ * long as the slowest participant.
+ *
+ * Under presumed abort the decision and participant list are the first and
+ * only synced record for the set.  No action lines are written, and once
+ * every participant has committed the set is forgotten without a sync.
+ *
+ * With pg_globalxact.async_commit the set is queued for a dispatcher once
+ * the decision is durable, and COMMIT is returned without waiting.
+ *
+ * A one-phase set just gets COMMIT, before the local transaction commits.
+ * Returns ROLLBACK if the participant did not commit, so that the local
+ * transaction can be rolled back as well, and INCOMPLETE if the connection
+ * was lost so that nobody knows whether it did.  Nothing was logged for the
+ * set, so there is nothing for recovery to do either way.
+ *
+ * Records our error state for complete run.
+ */
+
+static tpc_phase
+commit_set(void)
+{
+	phase_state state;
+	char commit_query[128];
+	bool presumed_abort = txnset->presumed_abort;
+
+	if (txnset->tpc_phase != PREPARE) {
+		ereport(ERROR, (errcode(ERRCODE_INVALID_TRANSACTION_STATE),
+				errmsg("Not in a valid phase of transaction")));
+	}
+
+	/* Everyone was read-only and has committed already. */
+	if (!txnset->head) {
+		set_phase(COMPLETE);
+		return txnset->tpc_phase;
+	}
+
+	state.txnset = txnset;
+	state.can_complete = true;
+	state.unknown = false;
+	state.prepare_query = NULL;
+	if (txnset->one_phase) {
+		tpc_remote_fanout(txnset->head, "COMMIT", check_commit, &state,
+			tpc_wait_event(TPC_WAIT_REMOTE_COMMIT));
+		set_phase(state.unknown ? INCOMPLETE
+			  : state.can_complete ? COMPLETE : ROLLBACK);
+		return txnset->tpc_phase;
+	}
+
+	/* The decision has to be durable before anyone is told about it.
+	 * If the sync fails we are still in PREPARE and the abort that
+	 * follows rolls everything back.
+	 */
+	if (presumed_abort) {
+		log_decision(COMMIT);
+	} else {
+		tpc_txnsetfile_write_phase(txnset, COMMIT);
+		tpc_txnsetfile_sync(txnset);
+	}
+	set_phase(COMMIT);
+
+	/* With async_commit a dispatcher takes it from here. */
+	if (tpc_async_commit && tpc_dispatch_enqueue(txnset)) {
+		tpc_txnsetfile_handoff(txnset);
+		return COMMIT;
+	}
+
+	snprintf(commit_query, sizeof(commit_query), 
+		commitfmt, txnset->txn_prefix);
+	tpc_remote_fanout(txnset->head, commit_query,
+		presumed_abort ? check_action : log_action, &state,
+		tpc_wait_event(TPC_WAIT_REMOTE_COMMIT));
+
+	return finish_phase_two(&state);
+}
+
+/*
+ * tpc_phase tpc_prepare(void)
+ * tpc_phase tpc_rollback(void)
+ * tpc_phase tpc_commit(void)
+ *
+ * The entry points for each phase time the whole of it for the statistics.
+ * A phase counts as an error if it did not end where it was meant to; one
+ * that raises an error is not counted at all.
+ */
+
+tpc_phase
+tpc_prepare()
+{
+	instr_time start;
+	tpc_phase result;
+
+	tpc_stats_start(&start);
+	result = prepare_set();
+	tpc_stats_record(TPC_STAT_PREPARE, &start, result == PREPARE);
+	return result;
+}
+
+tpc_phase
+tpc_rollback()
+{
+	instr_time start;
+	tpc_phase result;
+
+	tpc_stats_start(&start);
+	result = rollback_set();
+	tpc_stats_record(TPC_STAT_ROLLBACK, &start, result == COMPLETE);
+	return result;
+}
+
+tpc_phase
+tpc_commit()
+{
+	instr_time start;
+	tpc_phase result;
+
+	tpc_stats_start(&start);
+	result = commit_set();
+	tpc_stats_record(txnset->one_phase
+		? TPC_STAT_ONE_PHASE_COMMIT : TPC_STAT_COMMIT, &start,
+		result == COMPLETE || result == COMMIT);
+	return result;
+}
+
+/*
+ * Registeres a background worker to process the file.
+ *
+ * We use the bgw_extra field to point to the file rather than using the
+ * arg struct.  An empty fname asks the worker to recover every set in the
+ * directory in one go.
+ *
+ */
+
+static void
+tpc_register_bgworker(const char *fname)
+{
+        BackgroundWorkerHandle *bgwhandle = NULL;
+        BackgroundWorker bgw;
+
+        memset(&bgw, 0, sizeof(bgw));
+        snprintf(bgw.bgw_name, sizeof(bgw.bgw_name),
+                "TPC Cleanup %s", fname[0] ? fname : dirpath);
+        snprintf(bgw.bgw_type, sizeof(bgw.bgw_type), "TPC Cleanup");
+        strlcpy(bgw.bgw_library_name, "pg_globalxact",
+                sizeof(bgw.bgw_library_name));
+        strlcpy(bgw.bgw_function_name, "tpc_bgworker",
+               sizeof(bgw.bgw_function_name));
+        bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+        bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+        bgw.bgw_restart_time = 60;
+        strlcpy(bgw.bgw_extra, fname, sizeof(bgw.bgw_extra));
+        bgw.bgw_main_arg = 0;
+        bgw.bgw_notify_pid = 0;
+        if (!RegisterDynamicBackgroundWorker(&bgw, &bgwhandle)){
+                ereport(WARNING, (errmsg(
+                        "could not start worker for %s, "
+                        "Manual cleanup required.",
+                        fname[0] ? fname : dirpath)));
+        }
+        return;
+}
+
+
+void
+tpc_bgworker(Datum unused)
+{
+	BackgroundWorkerUnblockSignals();
+	if (MyBgworkerEntry->bgw_extra[0])
+		tpc_process_file(MyBgworkerEntry->bgw_extra);
+	else
+		tpc_recover_dir();
+	return;
+}
+
+void
+tpc_process_file(char *fname)
+{
+	tpc_recover_files(&fname, 1);
+	return;
 }
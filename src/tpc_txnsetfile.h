@@ -0,0 +1,42 @@
+#ifndef TPC_TXNSETFILE_H
+
+#define TPC_TXNSETFILE_H
+#include "tpc_txnset.h"
+#include "tpc_record.h"
+#include <utils/tuplestore.h>
+
+/*
+ * Logging of transaction sets.  Despite the name these cover every
+ * pg_globalxact.log_method; the set remembers which one it was started with.
+ */
+
+/* Longest conninfo we record for a participant, with its NUL.  A record
+ * has one byte for its length.
+ */
+#define TPC_CONNINFO_MAX 256
+
+extern bool tpc_presumed_abort_setting;
+extern bool tpc_detect_read_only_setting;
+extern bool tpc_one_phase_commit_setting;
+
+extern int  tpc_txnsetfile_shard(const char *prefix);
+extern void tpc_txnsetfile_shard_dir(int shard, char *buf, size_t len,
+				     bool create);
+extern bool tpc_txnsetfile_is_shard(const char *dir, const char *name);
+extern tpc_txnset *tpc_txnset_from_file(const char *local_globalid);
+extern void tpc_txnsetfile_start(tpc_txnset * txnset, const char *local_globalid);
+extern void tpc_txnsetfile_reopen(tpc_txnset * txnset);
+extern void tpc_txnsetfile_handoff(tpc_txnset * txnset);
+extern void tpc_txnsetfile_write_phase(tpc_txnset * txnset, tpc_phase next_phase);
+extern void tpc_txnsetfile_write_action(tpc_txnset * txnset, tpc_txn * txn, tpc_status status);
+extern void tpc_txnsetfile_write_participants(tpc_txnset * txnset, tpc_phase phase);
+extern void tpc_txnsetfile_sync(tpc_txnset * txnset);
+extern void tpc_txnsetfile_complete(tpc_txnset * txnset);
+extern void tpc_txnsetfile_incomplete(tpc_txnset * txnset);
+extern int  tpc_txnsetfile_conninfo(tpc_txn * txn, char *buf, size_t len);
+extern void tpc_txnsetfile_phase_two_query(tpc_phase decision, const char *prefix,
+					   char *buf, size_t len);
+extern Tuplestorestate *tpc_materialize(FunctionCallInfo fcinfo,
+					TupleDesc * tupdesc);
+
+#endif
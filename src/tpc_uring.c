@@ -0,0 +1,376 @@
+/*
+ * tpc_uring.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file is the io_uring engine of the log writer.  With the sync
+ * engine the log writer writes, syncs and only then writes again, so there
+ * is never more than one fdatasync in flight and whatever is appended
+ * during one waits for the next.
+ *
+ * Here a flush is a chain of writes from the journal buffer, linked to an
+ * fdatasync of the segment, submitted in one system call.  The journal
+ * buffer is registered with the ring, so the kernel does not have to map
+ * it again for every write.  Up to URING_FLUSHES flushes are in flight at
+ * once.  The ring signals completions on an eventfd, so the log writer can
+ * sleep on that and its latch at the same time, and reaps them in batches.
+ * Chains may complete in any order and each fdatasync only covers its own
+ * writes, so a flush only counts as done once every flush before it is.
+ *
+ * Without liburing the engine cannot be selected and none of this is
+ * compiled.
+ */
+
+#include "tpc_uring.h"
+#include "tpc_wait.h"
+#include <pgstat.h>
+#include <utils/guc.h>
+
+#ifdef TPC_USE_LIBURING
+#include <liburing.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/* Flushes in flight at once, and ring entries for each:  up to two writes,
+ * since the buffer wraps, and the sync.
+ */
+#define URING_FLUSHES 16
+#define URING_OPS_PER_FLUSH 3
+
+typedef struct uring_flush {
+    uint64	end;		/* flush_pos once it is done */
+    bool	done;
+} uring_flush;
+
+static struct io_uring ring;
+static bool started = false;
+static char *registered = NULL;	/* the registered buffer, if any */
+static Size registered_size = 0;
+static int  event_fd = -1;
+static uring_flush flushes[URING_FLUSHES];
+static uint64 flush_head = 0;	/* oldest flush in flight */
+static uint64 flush_tail = 0;	/* next flush to submit */
+
+static uint64 op_data(uint64 flush, bool sync, Size len);
+static void complete_op(struct io_uring_cqe *cqe);
+static struct io_uring_sqe *next_sqe(void);
+#endif
+
+static const struct config_enum_entry io_engine_options[] = {
+    {"sync", TPC_IO_SYNC, false},
+#ifdef TPC_USE_LIBURING
+    {"io_uring", TPC_IO_URING, false},
+#endif
+    {NULL, 0, false}
+};
+
+int	    tpc_io_engine_setting = TPC_IO_SYNC;
+
+/*
+ * void tpc_uring_init(void)
+ * Defines our GUCs.
+ */
+
+void
+tpc_uring_init(void)
+{
+    DefineCustomEnumVariable("pg_globalxact.io_engine",
+			     "How the log writer writes the journal.",
+			     "sync writes with pwrite and waits for each "
+			     "fdatasync, io_uring keeps several flushes in "
+			     "flight through io_uring.",
+			     &tpc_io_engine_setting,
+			     TPC_IO_SYNC,
+			     io_engine_options,
+			     PGC_POSTMASTER, 0,
+			     NULL, NULL, NULL);
+}
+
+#ifdef TPC_USE_LIBURING
+
+/*
+ * static uint64 op_data(uint64 flush, bool sync, Size len)
+ *
+ * Packs what a completion needs to know into user_data:  the flush's slot,
+ * whether it is the sync, and for a write how much it was to write.
+ */
+
+static uint64
+op_data(uint64 flush, bool sync, Size len)
+{
+    return ((flush % URING_FLUSHES) << 33) | ((uint64) sync << 32)
+	| (uint32) len;
+}
+
+static struct io_uring_sqe *
+next_sqe(void)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+
+    /* The ring has room for every op of every flush allowed in flight. */
+    if (!sqe)
+	elog(ERROR, "io_uring submission queue is full");
+    return sqe;
+}
+
+/*
+ * bool tpc_uring_start(char *buffer, Size size)
+ *
+ * Sets up the ring for the log writer and registers buffer, which all
+ * writes come from, with it.  Returns false, having logged why, if io_uring
+ * cannot be used, in which case the log writer falls back to pwrite.
+ */
+
+bool
+tpc_uring_start(char *buffer, Size size)
+{
+    struct iovec iov;
+    int		rc;
+
+    rc = io_uring_queue_init(URING_FLUSHES * URING_OPS_PER_FLUSH, &ring, 0);
+    if (rc < 0) {
+	errno = -rc;
+	ereport(LOG, (errmsg("could not set up io_uring for the journal, "
+			     "using pwrite instead: %m")));
+	return false;
+    }
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || (rc = io_uring_register_eventfd(&ring, event_fd)) < 0) {
+	if (event_fd >= 0) {
+	    errno = -rc;
+	    close(event_fd);
+	    event_fd = -1;
+	}
+	ereport(LOG, (errmsg("could not set up io_uring for the journal, "
+			     "using pwrite instead: %m")));
+	io_uring_queue_exit(&ring);
+	return false;
+    }
+
+    /* Registering can fail on a low RLIMIT_MEMLOCK; plain writes still
+     * beat waiting on one sync at a time.
+     */
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    rc = io_uring_register_buffers(&ring, &iov, 1);
+    if (rc < 0) {
+	errno = -rc;
+	ereport(LOG, (errmsg("could not register the journal buffer with "
+			     "io_uring: %m")));
+    } else {
+	registered = buffer;
+	registered_size = size;
+    }
+
+    flush_head = flush_tail = 0;
+    started = true;
+    return true;
+}
+
+void
+tpc_uring_stop(void)
+{
+    if (!started)
+	return;
+    io_uring_queue_exit(&ring);
+    close(event_fd);
+    event_fd = -1;
+    registered = NULL;
+    started = false;
+}
+
+bool
+tpc_uring_can_submit(void)
+{
+    return flush_tail - flush_head < URING_FLUSHES;
+}
+
+int
+tpc_uring_in_flight(void)
+{
+    return (int) (flush_tail - flush_head);
+}
+
+int
+tpc_uring_eventfd(void)
+{
+    return event_fd;
+}
+
+/*
+ * void tpc_uring_write(int fd, const char *data, Size len, off_t offset)
+ *
+ * Queues a write for the flush being built.  Nothing is submitted until
+ * tpc_uring_sync ends the flush.
+ */
+
+void
+tpc_uring_write(int fd, const char *data, Size len, off_t offset)
+{
+    struct io_uring_sqe *sqe = next_sqe();
+
+    if (registered && data >= registered
+	&& data + len <= registered + registered_size)
+	io_uring_prep_write_fixed(sqe, fd, data, len, offset, 0);
+    else
+	io_uring_prep_write(sqe, fd, data, len, offset);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe->user_data = op_data(flush_tail, false, len);
+}
+
+/*
+ * void tpc_uring_sync(int fd, uint64 end)
+ *
+ * Ends the flush being built with an fdatasync of fd and submits it.  Once
+ * it and every flush before it are done, everything before end is durable.
+ * The caller checks tpc_uring_can_submit first.
+ */
+
+void
+tpc_uring_sync(int fd, uint64 end)
+{
+    struct io_uring_sqe *sqe = next_sqe();
+    uring_flush *flush = &flushes[flush_tail % URING_FLUSHES];
+    int		rc;
+
+    Assert(tpc_uring_can_submit());
+    io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+    sqe->user_data = op_data(flush_tail, true, 0);
+    flush->end = end;
+    flush->done = false;
+    flush_tail++;
+
+    rc = io_uring_submit(&ring);
+    if (rc < 0) {
+	errno = -rc;
+	ereport(ERROR, (errcode_for_file_access(),
+		errmsg("could not submit journal writes: %m")));
+    }
+}
+
+/*
+ * static void complete_op(struct io_uring_cqe *cqe)
+ *
+ * Handles one completion.  A failed or short write is a PANIC, as it is
+ * for the sync engine:  the rest of its chain is cancelled and the journal
+ * would have a hole in it.
+ */
+
+static void
+complete_op(struct io_uring_cqe *cqe)
+{
+    uint64	data = cqe->user_data;
+    uring_flush *flush = &flushes[data >> 33];
+
+    if (0 == ((data >> 32) & 1)) {
+	if (cqe->res != (int) (uint32) data) {
+	    errno = cqe->res < 0 ? -cqe->res : ENOSPC;
+	    ereport(PANIC, (errcode_for_file_access(),
+		    errmsg("could not write to the journal: %m")));
+	}
+	return;
+    }
+    if (cqe->res < 0) {
+	errno = -cqe->res;
+	ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+		errmsg("could not fdatasync the journal: %m")));
+    }
+    flush->done = true;
+}
+
+/*
+ * uint64 tpc_uring_reap(bool wait)
+ *
+ * Collects every completion there is, waiting for at least one first if
+ * wait is set and anything is in flight.  Returns the end of the newest
+ * flush now known to be durable, or 0 if there is no new one.
+ */
+
+uint64
+tpc_uring_reap(bool wait)
+{
+    struct io_uring_cqe *cqe;
+    unsigned	head;
+    unsigned	seen = 0;
+    uint64	counter;
+    uint64	end = 0;
+
+    if (wait && flush_tail > flush_head) {
+	int	    rc;
+
+	pgstat_report_wait_start(tpc_wait_event(TPC_WAIT_LOG_SYNC));
+	do
+	    rc = io_uring_wait_cqe(&ring, &cqe);
+	while (-EINTR == rc);
+	pgstat_report_wait_end();
+	if (rc < 0) {
+	    errno = -rc;
+	    ereport(ERROR, (errcode_for_file_access(),
+		    errmsg("could not wait for journal writes: %m")));
+	}
+    }
+    (void) read(event_fd, &counter, sizeof(counter));
+
+    io_uring_for_each_cqe(&ring, head, cqe) {
+	complete_op(cqe);
+	++seen;
+    }
+    io_uring_cq_advance(&ring, seen);
+
+    while (flush_head < flush_tail && flushes[flush_head % URING_FLUSHES].done) {
+	end = flushes[flush_head % URING_FLUSHES].end;
+	flush_head++;
+    }
+    return end;
+}
+
+#else				/* !TPC_USE_LIBURING */
+
+bool
+tpc_uring_start(char *buffer, Size size)
+{
+    return false;
+}
+
+void
+tpc_uring_stop(void)
+{
+}
+
+bool
+tpc_uring_can_submit(void)
+{
+    return false;
+}
+
+int
+tpc_uring_in_flight(void)
+{
+    return 0;
+}
+
+int
+tpc_uring_eventfd(void)
+{
+    return -1;
+}
+
+void
+tpc_uring_write(int fd, const char *data, Size len, off_t offset)
+{
+    elog(ERROR, "pg_globalxact was built without io_uring support");
+}
+
+void
+tpc_uring_sync(int fd, uint64 end)
+{
+    elog(ERROR, "pg_globalxact was built without io_uring support");
+}
+
+uint64
+tpc_uring_reap(bool wait)
+{
+    return 0;
+}
+
+#endif				/* TPC_USE_LIBURING */
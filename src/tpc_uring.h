@@ -0,0 +1,29 @@
+#ifndef TPC_URING_H
+
+#define TPC_URING_H
+#include <postgres.h>
+
+/*
+ * How the log writer writes and syncs the journal.  SYNC writes with
+ * pwrite and waits out each fdatasync before writing again.  URING, only
+ * available when built with LIBURING=1, submits writes and syncs through
+ * io_uring and keeps several flushes in flight.
+ */
+typedef enum {
+    TPC_IO_SYNC,
+    TPC_IO_URING
+}	    tpc_io_engine;
+
+extern int  tpc_io_engine_setting;
+
+extern void tpc_uring_init(void);
+extern bool tpc_uring_start(char *buffer, Size size);
+extern void tpc_uring_stop(void);
+extern bool tpc_uring_can_submit(void);
+extern int  tpc_uring_in_flight(void);
+extern int  tpc_uring_eventfd(void);
+extern void tpc_uring_write(int fd, const char *data, Size len, off_t offset);
+extern void tpc_uring_sync(int fd, uint64 end);
+extern uint64 tpc_uring_reap(bool wait);
+
+#endif
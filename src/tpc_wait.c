@@ -0,0 +1,51 @@
+/*
+ * tpc_wait.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file maps our waits to wait events.  PostgreSQL 17 lets extensions
+ * define wait events by name; the ids are shared between processes, so
+ * each process looks up all of ours the first time it needs one and keeps
+ * them.  Looking them up takes a lock, which is why it is not done again.
+ */
+
+#include "tpc_wait.h"
+#include <pgstat.h>
+
+#if PG_VERSION_NUM >= 170000
+#include <utils/wait_event.h>
+
+static const char *const wait_names[TPC_NUM_WAITS] = {
+    "GlobalXactRemoteConnect",
+    "GlobalXactRemoteBegin",
+    "GlobalXactRemoteProbe",
+    "GlobalXactRemotePrepare",
+    "GlobalXactRemoteCommit",
+    "GlobalXactRemoteRollback",
+    "GlobalXactRemoteResolve",
+    "GlobalXactLogWrite",
+    "GlobalXactLogSync"
+};
+
+static uint32 wait_events[TPC_NUM_WAITS];
+static bool wait_events_known = false;
+#endif
+
+/*
+ * uint32 tpc_wait_event(tpc_wait wait)
+ * Returns the wait_event_info to report for a wait.
+ */
+
+uint32
+tpc_wait_event(tpc_wait wait)
+{
+#if PG_VERSION_NUM >= 170000
+    if (!wait_events_known) {
+	for (int i = 0; i < TPC_NUM_WAITS; ++i)
+	    wait_events[i] = WaitEventExtensionNew(wait_names[i]);
+	wait_events_known = true;
+    }
+    return wait_events[wait];
+#else
+    return PG_WAIT_EXTENSION;
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef TPC_WAIT_H
+
+#define TPC_WAIT_H
+#include <postgres.h>
+
+/*
+ * Wait events for the places global transactions spend their time, so
+ * that pg_stat_activity shows what a backend committing one is waiting
+ * for.  On PostgreSQL 17 and later each gets a wait event of its own,
+ * named GlobalXact..., in the Extension class.  Older versions cannot
+ * tell them apart and report the generic Extension wait event for all of
+ * them.
+ */
+
+typedef enum {
+    TPC_WAIT_REMOTE_CONNECT,
+    TPC_WAIT_REMOTE_BEGIN,
+    TPC_WAIT_REMOTE_PROBE,
+    TPC_WAIT_REMOTE_PREPARE,
+    TPC_WAIT_REMOTE_COMMIT,
+    TPC_WAIT_REMOTE_ROLLBACK,
+    TPC_WAIT_REMOTE_RESOLVE,
+    TPC_WAIT_LOG_WRITE,
+    TPC_WAIT_LOG_SYNC,
+    TPC_NUM_WAITS
+}	    tpc_wait;
+
+extern uint32 tpc_wait_event(tpc_wait wait);
+
+#endif
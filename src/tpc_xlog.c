@@ -0,0 +1,288 @@
+/*
+ * tpc_xlog.c
+ * maintainer: Chris Travers <chris.travers@gmail.com>
+ *
+ * This file logs transaction sets to WAL through a custom resource manager.
+ * Decisions then share the WAL flush and group commit of ordinary commits
+ * and reach standbys with everything else.
+ *
+ * Nothing is kept in WAL that recovery has to read back directly.  Instead
+ * redo writes each set out as an ordinary transaction set file when its
+ * DECISION record is replayed and removes the file when its FORGET record
+ * is replayed.  After crash recovery, or on a promoted standby, the files
+ * left are exactly the sets that were still in doubt, and recovery proceeds
+ * as it does for the file method.
+ *
+ * The catch is checkpoints.  A set whose DECISION record falls before the
+ * redo point of the last checkpoint would never be replayed.  So from its
+ * first DECISION record until it is forgotten or written out as a file, the
+ * backend owning a set delays checkpoints the way commit does.  A
+ * checkpoint started in that window waits until phase two is over.
+ *
+ * An error in that window must not leave checkpoints delayed for the rest
+ * of the session, so the delay also ends when the transaction aborts or
+ * the backend exits.  A set that failed before it was written out has no
+ * file to recover from then anyway, short of a crash replaying it.
+ */
+
+#include "tpc_txnset.h"
+#include "tpc_txnsetfile.h"
+#include "tpc_xlog.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <miscadmin.h>
+#include <storage/fd.h>
+#include <storage/ipc.h>
+
+#if PG_VERSION_NUM >= 150000
+
+#include <access/rmgr.h>
+#include <access/xlog.h>
+#include <access/xlog_internal.h>
+#include <access/xloginsert.h>
+#include <access/xlogreader.h>
+#include <storage/proc.h>
+
+/*
+ * Until an id is reserved on the PostgreSQL wiki this uses the id set aside
+ * for experiments.  Changing it makes existing WAL unreadable, so it must
+ * not change once the extension is in use.
+ */
+#define TPC_RMGR_ID RM_EXPERIMENTAL_ID
+
+#define XLOG_TPC_DECISION 0x00
+#define XLOG_TPC_FORGET   0x10
+
+typedef struct xl_tpc_set {
+    char	prefix[NAMEDATALEN];
+    /* for DECISION, the contents of the set file follow */
+} xl_tpc_set;
+
+static bool registered = false;
+static bool delaying = false;
+static bool exit_hook_registered = false;
+
+static void release_at_exit(int code, Datum arg);
+static void forget_file(const char *path);
+static void tpc_xlog_redo(XLogReaderState *record);
+static void tpc_xlog_desc(StringInfo buf, XLogReaderState *record);
+static const char *tpc_xlog_identify(uint8 info);
+
+static const RmgrData tpc_rmgr = {
+    .rm_name = "pg_globalxact",
+    .rm_redo = tpc_xlog_redo,
+    .rm_desc = tpc_xlog_desc,
+    .rm_identify = tpc_xlog_identify
+};
+
+/*
+ * void tpc_xlog_init(void)
+ * Registers the resource manager.  This has to happen while preloading so
+ * the startup process knows about it.
+ */
+
+void
+tpc_xlog_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+	return;
+    RegisterCustomRmgr(TPC_RMGR_ID, &tpc_rmgr);
+    registered = true;
+}
+
+bool
+tpc_xlog_available(void)
+{
+    return registered;
+}
+
+/*
+ * void tpc_xlog_decision(const char *prefix, const char *lines, int len)
+ *
+ * Logs the set as it stands and waits for the record to be flushed.  The
+ * first call for a set starts delaying checkpoints; the flag must be set
+ * before the record is inserted for the delay to cover it.
+ */
+
+void
+tpc_xlog_decision(const char *prefix, const char *lines, int len)
+{
+    xl_tpc_set	xlrec;
+    XLogRecPtr	lsn;
+
+    if (!registered)
+	ereport(ERROR, (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+		errmsg("pg_globalxact.log_method = wal requires "
+		       "pg_globalxact in shared_preload_libraries")));
+
+    if (!delaying) {
+	if (!exit_hook_registered) {
+	    before_shmem_exit(release_at_exit, 0);
+	    exit_hook_registered = true;
+	}
+	MyProc->delayChkptFlags |= DELAY_CHKPT_START;
+	delaying = true;
+    }
+
+    memset(&xlrec, 0, sizeof(xlrec));
+    strlcpy(xlrec.prefix, prefix, sizeof(xlrec.prefix));
+    XLogBeginInsert();
+    XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+    XLogRegisterData((char *) lines, len);
+    lsn = XLogInsert(TPC_RMGR_ID, XLOG_TPC_DECISION);
+    XLogFlush(lsn);
+}
+
+/*
+ * void tpc_xlog_forget(const char *prefix)
+ *
+ * Logs that the set is finished.  Nobody needs to wait for this; if it is
+ * lost the set is recovered again and found to be finished.
+ */
+
+void
+tpc_xlog_forget(const char *prefix)
+{
+    xl_tpc_set	xlrec;
+
+    memset(&xlrec, 0, sizeof(xlrec));
+    strlcpy(xlrec.prefix, prefix, sizeof(xlrec.prefix));
+    XLogBeginInsert();
+    XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+    XLogInsert(TPC_RMGR_ID, XLOG_TPC_FORGET);
+    tpc_xlog_release();
+}
+
+/*
+ * void tpc_xlog_release(void)
+ * Stops delaying checkpoints.  The set must be forgotten or safely in a
+ * file by now, or be given up on because the transaction aborted.
+ */
+
+void
+tpc_xlog_release(void)
+{
+    if (delaying) {
+	MyProc->delayChkptFlags &= ~DELAY_CHKPT_START;
+	delaying = false;
+    }
+}
+
+static void
+release_at_exit(int code, Datum arg)
+{
+    tpc_xlog_release();
+}
+
+static void
+forget_file(const char *path)
+{
+    if (unlink(path) != 0 && errno != ENOENT)
+	ereport(WARNING, (errcode_for_file_access(),
+		errmsg("could not remove file \"%s\": %m", path)));
+}
+
+/*
+ * static void tpc_xlog_redo(XLogReaderState *record)
+ *
+ * Writes or removes the set file.  The file is synced straight away, since
+ * a restartpoint could otherwise move past the record before the file was
+ * durable.  A set file written by a version before shards is in TPC_LOGDIR
+ * itself, so forgetting a set removes that one too.
+ */
+
+static void
+tpc_xlog_redo(XLogReaderState *record)
+{
+    uint8	info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+    xl_tpc_set *xlrec = (xl_tpc_set *) XLogRecGetData(record);
+    char	shard[MAXPGPATH];
+    char	path[MAXPGPATH];
+    int		fd;
+
+    tpc_txnsetfile_shard_dir(tpc_txnsetfile_shard(xlrec->prefix), shard,
+			     sizeof(shard), XLOG_TPC_DECISION == info);
+    snprintf(path, sizeof(path), "%s/%s", shard, xlrec->prefix);
+    switch (info) {
+    case XLOG_TPC_DECISION:
+	{
+	    const char *lines = XLogRecGetData(record) + sizeof(xl_tpc_set);
+	    int		len = XLogRecGetDataLen(record) - sizeof(xl_tpc_set);
+
+	    fd = BasicOpenFile(path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+	    if (fd < 0)
+		ereport(ERROR, (errcode_for_file_access(),
+			errmsg("could not create file \"%s\": %m", path)));
+	    if (write(fd, lines, len) != len)
+		ereport(ERROR, (errcode_for_file_access(),
+			errmsg("could not write file \"%s\": %m", path)));
+	    if (pg_fsync(fd) != 0)
+		ereport(data_sync_elevel(ERROR), (errcode_for_file_access(),
+			errmsg("could not fsync file \"%s\": %m", path)));
+	    close(fd);
+	    fsync_fname(shard, true);
+	    break;
+	}
+    case XLOG_TPC_FORGET:
+	forget_file(path);
+	snprintf(path, sizeof(path), "%s/%s", TPC_LOGDIR, xlrec->prefix);
+	forget_file(path);
+	break;
+    default:
+	elog(PANIC, "tpc_xlog_redo: unknown op code %u", info);
+    }
+}
+
+static void
+tpc_xlog_desc(StringInfo buf, XLogReaderState *record)
+{
+    xl_tpc_set *xlrec = (xl_tpc_set *) XLogRecGetData(record);
+
+    appendStringInfo(buf, "set %s", xlrec->prefix);
+}
+
+static const char *
+tpc_xlog_identify(uint8 info)
+{
+    switch (info & ~XLR_INFO_MASK) {
+    case XLOG_TPC_DECISION:
+	return "DECISION";
+    case XLOG_TPC_FORGET:
+	return "FORGET";
+    default:
+	return NULL;
+    }
+}
+
+#else				/* PG_VERSION_NUM < 150000 */
+
+void
+tpc_xlog_init(void)
+{
+}
+
+bool
+tpc_xlog_available(void)
+{
+    return false;
+}
+
+void
+tpc_xlog_decision(const char *prefix, const char *lines, int len)
+{
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+	    errmsg("pg_globalxact.log_method = wal requires "
+		   "PostgreSQL 15 or later")));
+}
+
+void
+tpc_xlog_forget(const char *prefix)
+{
+}
+
+void
+tpc_xlog_release(void)
+{
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef TPC_XLOG_H
+
+#define TPC_XLOG_H
+#include <postgres.h>
+
+/*
+ * WAL records for transaction sets.  A DECISION record carries everything
+ * the set file would contain so far, and replaying it writes that file.  A
+ * FORGET record removes the file again.  Only available on PostgreSQL 15 and
+ * later, where extensions may register their own resource managers.
+ */
+
+extern void tpc_xlog_init(void);
+extern bool tpc_xlog_available(void);
+extern void tpc_xlog_decision(const char *prefix, const char *lines, int len);
+extern void tpc_xlog_forget(const char *prefix);
+extern void tpc_xlog_release(void);
+
+#endif
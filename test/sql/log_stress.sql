@@ -0,0 +1,7 @@
+-- Set files are held open through virtual file descriptors, so one backend
+-- can have more sets open than max_files_per_process.
+SELECT tpc_log_stress(2000);
+-- Nothing is left behind.
+SELECT count(*) FROM tpc_txnset_contents()
+ WHERE prefix LIKE 'tpc_log_stress%';
+SELECT tpc_log_stress(0);
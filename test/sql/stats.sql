@@ -0,0 +1,29 @@
+-- The views' columns come from the catalog and need nothing loaded.
+SELECT attname, format_type(atttypid, atttypmod)
+  FROM pg_attribute
+ WHERE attrelid = 'pg_globalxact_transactions'::regclass AND attnum > 0
+ ORDER BY attnum;
+SELECT attname, format_type(atttypid, atttypmod)
+  FROM pg_attribute
+ WHERE attrelid = 'pg_globalxact_stats'::regclass AND attnum > 0
+ ORDER BY attnum;
+-- Only superusers may clear the statistics.
+SELECT has_function_privilege('public', 'tpc_stats_reset()', 'execute');
+
+-- Without pg_globalxact in shared_preload_libraries there is no shared
+-- memory to report from, and each function says so.  That is what
+-- stats_1.out expects, and the test stops there.
+SELECT current_setting('shared_preload_libraries') NOT LIKE '%pg_globalxact%'
+       AS not_preloaded \gset
+\if :not_preloaded
+SELECT * FROM pg_globalxact_transactions;
+SELECT * FROM pg_globalxact_stats;
+SELECT tpc_stats_reset();
+\quit
+\endif
+
+-- No global transaction is open outside of one.
+SELECT count(*) FROM pg_globalxact_transactions;
+-- A reset leaves no step with any calls.
+SELECT tpc_stats_reset();
+SELECT count(*) FROM pg_globalxact_stats;
@@ -0,0 +1,168 @@
+-- Set files are written here by hand, following src/tpc_record.h, then read
+-- back by tpc_txnset_contents() and finished by recovery.  Records are in
+-- the byte order of the server and the expected output is for a
+-- little-endian one; on any other the test stops here, which is what
+-- txnset_files_1.out expects.
+SELECT get_byte(pg_read_binary_file('global/pg_control', 8, 1), 0)
+       <> pg_control_version % 256 AS skip_test
+  FROM pg_control_system() \gset
+\if :skip_test
+\quit
+\endif
+
+SET client_min_messages = warning;
+CREATE SCHEMA tpc_test;
+CREATE TABLE tpc_test.output (line text);
+
+CREATE FUNCTION tpc_test.le(n bigint, width int) RETURNS bytea
+LANGUAGE plpgsql IMMUTABLE AS $$
+DECLARE
+    result bytea := '';
+BEGIN
+    FOR i IN 0 .. width - 1 LOOP
+        result := result
+            || set_byte('\x00'::bytea, 0, ((n >> (8 * i)) & 255)::int);
+    END LOOP;
+    RETURN result;
+END $$;
+
+CREATE FUNCTION tpc_test.crc32c(data bytea) RETURNS bigint
+LANGUAGE plpgsql IMMUTABLE AS $$
+DECLARE
+    crc bigint := 4294967295;
+BEGIN
+    FOR i IN 0 .. length(data) - 1 LOOP
+        crc := crc # get_byte(data, i);
+        FOR j IN 1 .. 8 LOOP
+            IF crc & 1 = 1 THEN
+                crc := (crc >> 1) # 2197175160;
+            ELSE
+                crc := crc >> 1;
+            END IF;
+        END LOOP;
+    END LOOP;
+    RETURN crc # 4294967295;
+END $$;
+
+-- kind: 1 phase, 2 participant, 3 action.  phase: 1 prepare, 2 commit,
+-- 3 rollback, 4 complete.  status: 0 pending, 1 ok, 2 bad.
+CREATE FUNCTION tpc_test.record(kind int, phase int, participant int,
+                                status int, prefix text, conninfo text)
+RETURNS bytea LANGUAGE plpgsql IMMUTABLE AS $$
+DECLARE
+    body bytea := convert_to(prefix, 'UTF8') || convert_to(conninfo, 'UTF8');
+    len int := (16 + length(body) + 3) / 4 * 4;
+    rest bytea;
+BEGIN
+    rest := tpc_test.le(len, 2) || tpc_test.le(1, 1) || tpc_test.le(kind, 1)
+        || tpc_test.le(participant, 2) || tpc_test.le(phase, 1)
+        || tpc_test.le(status, 1) || tpc_test.le(length(prefix), 1)
+        || tpc_test.le(length(conninfo), 1) || tpc_test.le(0, 2) || body
+        || tpc_test.le(0, len - 16 - length(body));
+    RETURN tpc_test.le(tpc_test.crc32c(rest), 4) || rest;
+END $$;
+
+-- The shard a prefix goes in: FNV-1a, as in tpc_txnsetfile_shard().
+CREATE FUNCTION tpc_test.shard(prefix text) RETURNS text
+LANGUAGE plpgsql IMMUTABLE AS $$
+DECLARE
+    bytes bytea := convert_to(prefix, 'UTF8');
+    hash bigint := 2166136261;
+BEGIN
+    FOR i IN 0 .. length(bytes) - 1 LOOP
+        hash := (hash # get_byte(bytes, i)) * 16777619 % 4294967296;
+    END LOOP;
+    RETURN upper(lpad(to_hex(hash % 256), 2, '0'));
+END $$;
+
+-- Writes a file, making its directory first if need be.
+CREATE FUNCTION tpc_test.write_file(path text, data bytea) RETURNS bool
+LANGUAGE plpgsql AS $$
+DECLARE
+    lo oid;
+BEGIN
+    EXECUTE format('COPY tpc_test.output FROM PROGRAM %L',
+                   'mkdir -p ' || regexp_replace(path, '/[^/]*$', ''));
+    lo := lo_from_bytea(0, data);
+    PERFORM lo_export(lo, path);
+    PERFORM lo_unlink(lo);
+    RETURN true;
+END $$;
+
+-- Recovery runs in a background worker; waits for it to remove a file.
+CREATE FUNCTION tpc_test.removed(path text) RETURNS bool
+LANGUAGE plpgsql AS $$
+BEGIN
+    FOR i IN 1 .. 600 LOOP
+        IF (pg_stat_file(path, true)).size IS NULL THEN
+            RETURN true;
+        END IF;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN false;
+END $$;
+
+-- A binary set file in its shard reads back record for record.
+CREATE TEMP TABLE sharded AS
+SELECT 'extglobalxact/' || tpc_test.shard('tpc_test_sharded')
+       || '/tpc_test_sharded' AS path;
+SELECT tpc_test.write_file(path,
+       tpc_test.record(1, 1, 0, 0, 'tpc_test_sharded', '')
+       || tpc_test.record(2, 1, 0, 0, '', 'postgresql://remote1:5432/db1')
+       || tpc_test.record(2, 1, 1, 0, '', 'postgresql://remote2:5433/db2')
+       || tpc_test.record(1, 2, 0, 0, 'tpc_test_sharded', '')
+       || tpc_test.record(3, 2, 0, 1, '', '')
+       || tpc_test.record(3, 2, 1, 2, '', ''))
+  FROM sharded;
+SELECT file, phase, host, port, database, status
+  FROM tpc_txnset_contents()
+ WHERE prefix = 'tpc_test_sharded'
+ ORDER BY phase DESC, host;
+
+-- Files left directly in extglobalxact/ by versions before shards, in the
+-- binary format and in the text format used before that, read back too.
+SELECT tpc_test.write_file('extglobalxact/tpc_test_legacy',
+       tpc_test.record(1, 3, 0, 0, 'tpc_test_legacy', '')
+       || tpc_test.record(2, 3, 0, 0, '', 'postgresql://remote3:5432/db3'));
+SELECT tpc_test.write_file('extglobalxact/tpc_test_text',
+       convert_to(E'phase rollback\n' || 'rollback '
+                  || E'postgresql://remote4:5434/db4 tpc_test_text PENDING\n',
+                  'UTF8'));
+SELECT file, prefix, phase, host, port, database, status
+  FROM tpc_txnset_contents()
+ WHERE prefix IN ('tpc_test_legacy', 'tpc_test_text')
+ ORDER BY prefix;
+
+-- A damaged record is reported, and nothing after it is trusted.
+SELECT tpc_test.write_file('extglobalxact/tpc_test_corrupt',
+       tpc_test.record(1, 3, 0, 0, 'tpc_test_corrupt', '')
+       || tpc_test.record(2, 3, 0, 0, '', 'postgresql://remote5:5432/db5')
+       || overlay(tpc_test.record(2, 3, 1, 0, '', 'postgresql://remote6:5432/db6')
+                  PLACING '\xff'::bytea FROM 20 FOR 1)
+       || tpc_test.record(2, 3, 2, 0, '', 'postgresql://remote7:5432/db7'));
+SELECT host FROM tpc_txnset_contents() WHERE prefix = 'tpc_test_corrupt';
+
+-- Recovery removes a file whose last phase is COMPLETE without contacting
+-- anyone, wherever it is, and finishes a set with no participants at once.
+SELECT tpc_test.write_file(path, pg_read_binary_file(path)
+       || tpc_test.record(1, 4, 0, 0, 'tpc_test_sharded', ''))
+  FROM sharded;
+SELECT tpc_test.write_file('extglobalxact/tpc_test_legacy',
+       pg_read_binary_file('extglobalxact/tpc_test_legacy')
+       || tpc_test.record(1, 4, 0, 0, 'tpc_test_legacy', ''));
+SELECT tpc_test.write_file('extglobalxact/tpc_test_text',
+       pg_read_binary_file('extglobalxact/tpc_test_text')
+       || convert_to(E'phase complete\n', 'UTF8'));
+SELECT tpc_test.write_file('extglobalxact/tpc_test_corrupt',
+       tpc_test.record(1, 1, 0, 0, 'tpc_test_corrupt', ''));
+SELECT tpc_cleanup(path) FROM sharded;
+SELECT tpc_cleanup('extglobalxact/' || name)
+  FROM (VALUES ('tpc_test_corrupt'), ('tpc_test_legacy'), ('tpc_test_text'))
+       v(name);
+SELECT tpc_test.removed(path) FROM sharded;
+SELECT name, tpc_test.removed('extglobalxact/' || name)
+  FROM (VALUES ('tpc_test_corrupt'), ('tpc_test_legacy'), ('tpc_test_text'))
+       v(name)
+ ORDER BY name;
+
+DROP SCHEMA tpc_test CASCADE;